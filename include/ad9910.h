@@ -135,7 +135,7 @@ DEF_REG_BIT(fsc, aux_dac_ctl, 8, 0);
 DEF_REG_BIT(io_update_rate, io_update_rate, 32, 0);
 DEF_REG_BIT(ftw, ftw, 32, 0);
 DEF_REG_BIT(pow, pow, 16, 0);
-DEF_REG_BIT(amplitude_rame_rate, asf, 16, 16);
+DEF_REG_BIT(amplitude_ramp_rate, asf, 16, 16);
 DEF_REG_BIT(amplitude_scale_factor, asf, 14, 2);
 DEF_REG_BIT(amplitude_step_size, asf, 2, 0);
 
@@ -201,6 +201,36 @@ typedef enum {
   ad9910_parallel_polar = 0x3
 } parallel_mode;
 
+/* sample format for parallel playback with a variable update rate. The
+ * value is kept on the parallel port for dwell periods of the frequency
+ * set with ad9910_set_parallel_frequency */
+typedef struct
+{
+  uint16_t value;
+  uint16_t dwell;
+} ad9910_parallel_sample;
+
+/* stop conditions of a looping parallel playback */
+enum
+{
+  ad9910_parallel_stop_trigger = 0x1, /* rising edge on IO_UPDATE */
+  ad9910_parallel_stop_request = 0x2, /* request callback returns true */
+};
+
+#define AD9910_PARALLEL_FOREVER SIZE_MAX
+
+typedef struct
+{
+  size_t begin;   /* first sample of the loop region */
+  size_t end;     /* first sample behind the loop region */
+  size_t repeats; /* passes through the loop or AD9910_PARALLEL_FOREVER */
+  int stop;       /* combination of ad9910_parallel_stop_* */
+  int (*request)(void);
+  /* checked after every pass whatever the stop conditions are, may be
+   * NULL */
+  int (*abort)(void);
+} ad9910_parallel_loop;
+
 typedef enum {
   ad9910_ramp_dest_frequency = 0x0,
   ad9910_ramp_dest_phase = 0x1,
@@ -245,6 +275,17 @@ static INLINE uint64_t ad9910_get_profile_value(int profile,
  */
 void ad9910_update_reg(ad9910_register* reg);
 
+/* longest SPI frame of a single register write, instruction plus 64 bit */
+#define AD9910_MAX_FRAME_SIZE 9
+
+/**
+ * writes the SPI frame which transfers the register value into buf. buf
+ * needs to hold reg->size + 1 bytes.
+ *
+ * @return number of bytes in the frame
+ */
+size_t ad9910_build_reg_frame(const ad9910_register* reg, uint8_t* buf);
+
 /**
  * this function can be used to update multiple registers at once.
  * @param mask bitmask indication the registers to update
@@ -267,8 +308,63 @@ float ad9910_backconvert_amplitude(uint32_t);
 uint32_t ad9910_convert_phase(float);
 float ad9910_backconvert_phase(uint32_t);
 
+/**
+ * converts frequency samples for the parallel port in place. In frequency
+ * mode the AD9910 shifts the unsigned 16 bit parallel word left by the FM
+ * gain and adds it to the FTW register. The FTW is therefore set to the
+ * smallest sample and the gain is chosen as small as possible so the
+ * full 16 bit resolution covers the span of the samples.
+ *
+ * @param base frequency tuning word the offsets are relative to
+ * @param data holds len float offsets in Hz on input and len parallel
+ *             words on output
+ * @param len number of samples
+ * @param ftw receives the frequency tuning word for the FTW register
+ * @return the FM gain or -1 if the samples can't be represented
+ */
+int ad9910_pack_parallel_frequency(uint32_t base, void* data, size_t len,
+                                   uint32_t* ftw);
+
+/**
+ * packs amplitude/phase pairs in place into parallel words for the polar
+ * mode. The upper byte of a word holds the 8 MSBs of the amplitude and
+ * the lower byte the 8 MSBs of the phase.
+ *
+ * The raw version takes pairs of 16 bit register values (14 bit amplitude
+ * scale factor and 16 bit phase offset word), the other one pairs of 32 bit
+ * floats with the amplitude in dBFS and the phase in radians.
+ *
+ * @param data holds len pairs on input and len parallel words on output
+ * @param len number of pairs
+ */
+void ad9910_pack_parallel_polar_raw(void* data, size_t len);
+void ad9910_pack_parallel_polar(void* data, size_t len);
+
+/**
+ * resets the AD9910 and starts its PLL. Locking takes a while, other
+ * peripherals can be initialized before ad9910_init_finish is called.
+ */
 void ad9910_init(void);
 
+/**
+ * waits for the PLL lock, writes the stored register image or the default
+ * configuration and executes the startup sequence. Pressing the red button
+ * during startup skips and clears both.
+ */
+void ad9910_init_finish(void);
+
+/* writes all registers in a single DMA transfer */
+void ad9910_update_all_regs(void);
+
+/**
+ * stores the current register values, they are written instead of the
+ * default configuration during the next startup.
+ *
+ * @return 0 on success, 1 if the store is full
+ */
+int ad9910_save_registers(void);
+void ad9910_clear_registers(void);
+
 /**
  * data written to the registers doesn't get active until this function is
  * called or another profile is selected
@@ -318,6 +414,10 @@ float ad9910_set_parallel_frequency(float freq);
 
 float ad9910_get_parallel_frequency(void);
 
+/* largest dwell count whose hold time still fits into the 32 bit parallel
+ * timer at the current parallel frequency */
+uint32_t ad9910_get_parallel_max_dwell(void);
+
 /**
  * start operation on the parallel interface. The function won't return
  * until all data has been transmitted and it will disable all interrupts
@@ -329,6 +429,47 @@ float ad9910_get_parallel_frequency(void);
  */
 void ad9910_execute_parallel(uint16_t* data, size_t len, size_t repeats);
 
+/**
+ * plays data[0, begin) once, then repeats data[begin, end) and finally
+ * plays data[end, len). The stop conditions and the abort callback are
+ * checked after every pass through the loop region, so a stopped playback
+ * still finishes the current pass and the outro without a gap.
+ *
+ * @return 1 if the loop was stopped early, 0 otherwise
+ */
+int ad9910_execute_parallel_loop(const uint16_t* data, size_t len,
+                                 const ad9910_parallel_loop* loop);
+
+/**
+ * same as ad9910_execute_parallel but every sample carries its own hold
+ * time. A sample stays on the output for dwell times the period set by
+ * ad9910_set_parallel_frequency, a dwell count of 0 is treated as 1.
+ *
+ * @param data samples to transmit
+ * @param len number of samples in data
+ * @param repeats how often the data should be transmitted
+ * @param abort checked after every pass, ends the playback if it returns
+ *              true. May be NULL
+ * @return 1 if the playback was aborted, 0 otherwise
+ */
+int ad9910_execute_parallel_dwell(const ad9910_parallel_sample* data,
+                                  size_t len, size_t repeats,
+                                  int (*abort)(void));
+
+/**
+ * same as ad9910_execute_parallel but the samples are streamed from the
+ * external SPI memory. If the memory can't keep up with the update rate
+ * the previous value is held and an underrun is counted, see
+ * extmem_stream_get_underruns.
+ *
+ * @param address start address of the samples in the external memory
+ * @param len number of samples
+ * @param repeats how often the data should be transmitted
+ * @param abort checked after every pass like in the dwell playback
+ */
+void ad9910_execute_parallel_external(uint32_t address, size_t len,
+                                      size_t repeats, int (*abort)(void));
+
 void ad9910_set_frequency(uint8_t profile, uint32_t freq);
 void ad9910_set_amplitude(uint8_t profile, uint16_t ampl);
 void ad9910_set_phase(uint8_t profile, uint16_t phase);
@@ -0,0 +1,88 @@
+/*
+ * Compact binary protocol on its own TCP port for automated clients. Every
+ * frame starts with a header followed by length bytes of payload, all
+ * values are little endian. Every frame is answered with a header carrying
+ * the opcode with BINARY_RESPONSE set, the tag of the request and a status,
+ * followed by the payload of the response if there is one. The responses
+ * of all frames received in one segment are sent together, a client
+ * has to wait for them before the send buffer of 4 segments is full,
+ * otherwise the connection is aborted.
+ *
+ * The commands are executed by the main loop or recorded in programming
+ * mode in the same way as the SCPI commands.
+ */
+
+#ifndef _BINARY_H
+#define _BINARY_H
+
+#include <stdint.h>
+
+/* From 33500B: 5024 SCPI telnet, 5025 SCPI socket */
+#define BINARY_PORT 5025
+
+/* largest payload of frames which aren't streamed */
+#define BINARY_PAYLOAD_SIZE 1024
+
+#define BINARY_RESPONSE 0x80
+
+struct binary_header
+{
+  uint32_t length; /* of the payload */
+  uint8_t opcode;
+  uint8_t tag;     /* copied into the response */
+  uint16_t status; /* only used in responses */
+  uint32_t argument;
+};
+
+enum binary_opcode
+{
+  binary_op_nop = 0x00,     /* only answered */
+  binary_op_write = 0x01,   /* payload of binary_write entries */
+  binary_op_update = 0x02,  /* IO update */
+  binary_op_wait = 0x03,    /* argument in ms */
+  binary_op_trigger = 0x04, /* wait for the trigger */
+  binary_op_mode = 0x05,    /* argument is an enum scpi_mode */
+  binary_op_data = 0x06,    /* payload into the external memory */
+  binary_op_status = 0x07,  /* responds with a binary_status */
+  binary_op_abort = 0x08,   /* stops the running sequence */
+};
+
+enum binary_status
+{
+  binary_status_ok = 0,
+  binary_status_opcode = 1,  /* unknown opcode */
+  binary_status_length = 2,  /* payload too long or of the wrong size */
+  binary_status_invalid = 3, /* invalid argument or register */
+  binary_status_failed = 4,  /* execution failed */
+  binary_status_busy = 5,    /* refused while a sequence runs */
+};
+
+/* writes 32 bits of a register, 64 bit registers are written in two words */
+struct binary_write
+{
+  uint8_t address;
+  uint8_t word; /* 0 for the lower, 1 for the upper 32 bits */
+  uint16_t reserved;
+  uint32_t value;
+};
+
+struct binary_status_response
+{
+  uint32_t mode;
+  uint32_t pll_lock;
+  uint32_t steps;    /* in the selected sequence */
+  uint32_t sequence; /* enum command_run_state */
+  uint32_t cycle;    /* of the running sequence */
+  uint32_t executed; /* commands of the running sequence */
+};
+
+/* starts listening, has to be called after lwIP is initialized */
+int binary_init(void);
+
+/* checks if received frames are waiting for binary_process */
+int binary_pending(void);
+
+/* executes the received frames, called from the main loop */
+void binary_process(void);
+
+#endif /* _BINARY_H */
@@ -0,0 +1,37 @@
+/*
+ * Timestamps of the boot phases, taken with the cycle counter of the
+ * Cortex-M4. The times are counted from the start of main.
+ */
+
+#ifndef _BOOT_H
+#define _BOOT_H
+
+#include <stdint.h>
+
+typedef enum {
+  boot_phase_store,     /* flash store scanned */
+  boot_phase_dds,       /* AD9910 reset and PLL started */
+  boot_phase_extmem,    /* external memory ready */
+  boot_phase_ethernet,  /* Ethernet, lwIP and SCPI ready */
+  boot_phase_pll,       /* PLL locked or timed out */
+  boot_phase_registers, /* register image written */
+  boot_phase_startup,   /* startup sequence executed */
+  boot_phase_count,
+} boot_phase;
+
+/* starts the cycle counter, has to be called first in main */
+void boot_timing_init(void);
+
+/* records that phase has finished now */
+void boot_timing_mark(boot_phase phase);
+
+/**
+ * @return time in microseconds from the start of main to the end of the
+ *         phase or 0 if the phase wasn't reached
+ */
+uint32_t boot_timing_get(boot_phase phase);
+
+/* short name of the phase for reports */
+const char* boot_phase_name(boot_phase phase);
+
+#endif /* _BOOT_H */
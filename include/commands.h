@@ -7,10 +7,38 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define COMMAND_QUEUE_LENGTH 1024
+/* memory shared by all stored sequences */
+#define COMMAND_QUEUE_LENGTH 4096
+
+/* number of sequences which can be stored at the same time and the
+ * maximal length of their names */
+#define COMMAND_SLOTS 8
+#define COMMAND_NAME_LENGTH 15
+
+/* the sequence selected after boot */
+#define COMMAND_DEFAULT_NAME "MAIN"
+
+/* maximal nesting of loops and subroutine calls during execution */
+#define COMMAND_STACK_DEPTH 16
 
 extern uint8_t command_execute_flag;
 
+enum command_run_state
+{
+  command_run_idle,
+  command_run_busy,    /* executing commands */
+  command_run_wait,    /* in a wait command */
+  command_run_trigger, /* waiting for the trigger */
+};
+
+struct command_status
+{
+  enum command_run_state state;
+  const char* name; /* of the running sequence */
+  uint32_t cycle;   /* repeats already finished */
+  uint32_t steps;   /* commands executed so far */
+};
+
 typedef enum {
   command_type_end = 0x00,
   command_type_register,           /* change register */
@@ -21,6 +49,19 @@ typedef enum {
   command_type_spi_write,          /* internal command performing SPI update */
   command_type_parallel,           /* run parallel sequence */
   command_type_parallel_frequency, /* parallel update frequency */
+  command_type_parallel_external,  /* parallel sequence from extmem */
+  command_type_ramp_chain,         /* run the ramp chain */
+  command_type_loop,               /* begin of a counted loop */
+  command_type_loop_end,           /* end of the innermost loop */
+  command_type_sub,                /* begin of a subroutine */
+  command_type_return,             /* end of a subroutine */
+  command_type_call,               /* call a subroutine */
+  command_type_if,                 /* branch on an input pin level */
+  command_type_else,               /* alternative branch */
+  command_type_endif,              /* end of a branch */
+  command_type_register_add,       /* add a step to a register field */
+  command_type_register_scale,     /* multiply a register field */
+  command_type_jump,               /* continue with another sequence */
 } command_type;
 
 typedef struct
@@ -29,6 +70,19 @@ typedef struct
   uint32_t value;
 } command_register;
 
+typedef struct
+{
+  const ad9910_register_bit* reg;
+  int32_t step;
+  int wrap; /* wrap around at the field width instead of saturating */
+} command_register_add;
+
+typedef struct
+{
+  const ad9910_register_bit* reg;
+  uint32_t factor; /* Q16.16 fixed point, the result saturates */
+} command_register_scale;
+
 typedef struct
 {
   const gpio_pin pin;
@@ -38,6 +92,7 @@ typedef struct
 typedef void command_update;
 typedef void command_trigger;
 typedef void command_spi_write;
+typedef void command_ramp_chain;
 
 typedef struct
 {
@@ -47,8 +102,14 @@ typedef struct
 typedef struct
 {
   uint16_t* data;
-  size_t length;
+  size_t length; /* number of samples */
   size_t repeats;
+  /* data holds ad9910_parallel_sample pairs instead of plain values */
+  int dwell;
+  /* loop region and stop conditions, see ad9910_parallel_loop */
+  size_t loop_begin;
+  size_t loop_end;
+  int stop;
 } command_parallel;
 
 typedef struct
@@ -56,6 +117,54 @@ typedef struct
   float frequency;
 } command_parallel_frequency;
 
+typedef struct
+{
+  uint32_t address;
+  size_t length; /* number of samples */
+  size_t repeats;
+} command_parallel_external;
+
+/* the offsets of the control flow commands are relative to the begin of
+ * the queue and filled in by commands_link */
+typedef struct
+{
+  uint32_t count;
+  uint32_t end; /* behind the matching loop end */
+} command_loop;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t end; /* behind the matching return */
+} command_sub;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t target; /* first command of the subroutine */
+} command_call;
+
+typedef struct
+{
+  gpio_pin pin;
+  int level;     /* branch is taken if the pin has this level */
+  uint32_t next; /* behind the matching else or endif */
+} command_if;
+
+typedef struct
+{
+  uint32_t end; /* behind the matching endif */
+} command_else;
+
+typedef struct
+{
+  char name[COMMAND_NAME_LENGTH + 1];
+} command_jump;
+
+typedef void command_loop_end;
+typedef void command_return;
+typedef void command_endif;
+
 typedef struct
 {
   command_type type;
@@ -63,29 +172,160 @@ typedef struct
 
 int command_queue_pin(const command_pin*);
 int command_queue_register(const command_register*);
+int command_queue_register_add(const command_register_add*);
+int command_queue_register_scale(const command_register_scale*);
 int command_queue_trigger(const command_trigger*);
 int command_queue_update(const command_update*);
 int command_queue_wait(const command_wait*);
 int command_queue_parallel(const command_parallel*);
 int command_queue_parallel_frequency(const command_parallel_frequency*);
+int command_queue_parallel_external(const command_parallel_external*);
+int command_queue_ramp_chain(const command_ramp_chain*);
+int command_queue_loop(const command_loop*);
+int command_queue_loop_end(const command_loop_end*);
+int command_queue_sub(const command_sub*);
+int command_queue_return(const command_return*);
+int command_queue_call(const command_call*);
+int command_queue_if(const command_if*);
+int command_queue_else(const command_else*);
+int command_queue_endif(const command_endif*);
+int command_queue_jump(const command_jump*);
+
+/**
+ * selects the sequence which is changed by the following commands. It is
+ * created if no sequence with that name exists.
+ *
+ * @return 0 on success, 1 if the name is invalid or all slots are used
+ */
+int commands_select(const char* name, size_t len);
+const char* commands_get_selected(void);
+
+/**
+ * removes the sequence. The default sequence is only cleared, if the
+ * selected sequence is removed the default one is selected.
+ *
+ * @return 0 on success, 1 if the sequence doesn't exist
+ */
+int commands_delete(const char* name, size_t len);
+
+/**
+ * name and size in bytes of the sequence in slot i
+ *
+ * @return 0 on success, 1 if the slot is unused
+ */
+int commands_get_slot(size_t i, const char** name, size_t* size);
+
+/**
+ * selects the sequence which is run by the next commands_execute instead
+ * of the selected one.
+ *
+ * @return 0 on success, 1 if the sequence doesn't exist
+ */
+int commands_execute_select(const char* name, size_t len);
+
+/**
+ * saves the selected sequence in the flash store under its name.
+ *
+ * @return 0 on success, 1 if the sequence can't be linked or the store is
+ *         full
+ */
+int commands_save(void);
+
+/**
+ * selects the sequence with the given name and replaces it with the copy
+ * from the flash store.
+ *
+ * @return 0 on success, 1 if there is no such sequence in the store or it
+ *         doesn't fit into memory
+ */
+int commands_load(const char* name, size_t len);
 
 void commands_clear(void);
+
+/* number of steps in the selected sequence, every recorded command is one
+ * step */
+size_t commands_step_count(void);
+
+/**
+ * removes step n (counted from 0) of the selected sequence
+ *
+ * @return 0 on success, 1 if the step doesn't exist
+ */
+int commands_step_delete(size_t n);
+
+/**
+ * commands recorded after this call are inserted before step n instead of
+ * being appended, until commands_step_append is called or another sequence
+ * is selected. n may be the number of steps to append.
+ *
+ * @return 0 on success, 1 if the step doesn't exist
+ */
+int commands_step_insert(size_t n);
+
+/* removes step n and inserts the following commands in its place */
+int commands_step_replace(size_t n);
+
+void commands_step_append(void);
 void commands_repeat(uint32_t);
 uint32_t get_commands_repeat(void);
+
+/* sets up the timer of the sequencer interrupt */
+void commands_init(void);
+
+/**
+ * starts the sequence selected by commands_execute_select or the selected
+ * one. It is run by the sequencer interrupt, waits don't block the main
+ * loop. Does nothing while a sequence runs.
+ */
 void commands_execute(void);
 
+/* stops the running sequence after the current command, a wait or a
+ * trigger wait is ended right away */
+void commands_abort(void);
+int commands_running(void);
+void commands_status(struct command_status*);
+
+/* ends a playback of the running sequence which stops on network requests
+ * after its current pass. Does nothing if no sequence runs */
+void commands_parallel_stop(void);
+
+/* checks if the last parallel playback was ended by its stop condition */
+int commands_parallel_stopped(void);
+
+/* called from the interrupt of the sequencer timer */
+void commands_timer_handler(void);
+
+/* called from the EXTI interrupt when the trigger input fell during a
+ * trigger wait */
+void commands_trigger_handler(void);
+
+/**
+ * matches the control flow commands in all sequences and stores the jump
+ * offsets in them. Subroutines have to be defined at the top level and end
+ * with a return, loops and branches have to be closed within the block
+ * they were opened in.
+ *
+ * @return 0 on success, 1 if the blocks don't match or a called subroutine
+ *         or sequence doesn't exist
+ */
+int commands_link(void);
+
 size_t execute_command(const command*);
 size_t execute_command_register(const command_register*);
+size_t execute_command_register_add(const command_register_add*);
+size_t execute_command_register_scale(const command_register_scale*);
 size_t execute_command_pin(const command_pin*);
 size_t execute_command_trigger(const command_trigger*);
 size_t execute_command_wait(const command_wait*);
 size_t execute_command_update(const command_update*);
 size_t execute_command_parallel(const command_parallel*);
 size_t execute_command_parallel_frequency(const command_parallel_frequency*);
+size_t execute_command_parallel_external(const command_parallel_external*);
+size_t execute_command_ramp_chain(const command_ramp_chain*);
 
 void startup_command_clear(void);
 void startup_command_execute(void);
-void startup_command_save(void);
+int startup_command_save(void);
 
 /*
  - single tone
@@ -2,6 +2,7 @@
 #define __ETHERNET_H
 
 #include "data.h"
+#include "scpi.h"
 
 #include <lwip/err.h>
 #include <stddef.h>
@@ -9,21 +10,59 @@
 
 #define CONNECTION_TIMEOUT 30000
 
+/* number of SCPI clients which can be connected at the same time */
+#define ETHERNET_CONNECTIONS 3
+
 void ethernet_init(void);
 void ethernet_loop(void);
 
-err_t ethernet_queue(const char*, uint16_t length);
+/* queues a part of the response to the message which is processed */
 err_t ethernet_copy_queue(const char*, uint16_t length);
 
-size_t ethernet_copy_data(void* dest, size_t len, size_t offset);
+/**
+ * stores a part of a binary block which was received at offset from the
+ * start of the block.
+ *
+ * @return 0 on success, 1 to discard the rest of the block
+ */
+typedef int (*ethernet_sink)(const void* data, size_t len, size_t offset,
+                             void* arg);
+
+/**
+ * hands the data of a binary block to sink as soon as it arrives, one
+ * received segment at a time. Every part is acknowledged after sink
+ * returned, so the receive window stays open while the block is streamed
+ * into its destination.
+ *
+ * @param start pointer to the start of the block as returned by the parser,
+ *        it may point past the end of the message passed to scpi_process
+ * @return 0 on success, 1 if sink failed or the client disconnected
+ *         before the whole block arrived. The whole block is consumed if
+ *         the client is still connected.
+ */
+int ethernet_receive_block(const char* start, size_t len, ethernet_sink sink,
+                           void* arg);
 
 /**
- * write data from the input buffer into buf
+ * receives a binary block into dest.
  *
- * this function is called by the lexer if it needs more data. It copies
- * data from the lwip buffer into the lexers buffer
+ * @return 0 on success, 1 if the client disconnected before the whole
+ *         block arrived. dest is only partly filled then.
+ */
+int ethernet_copy_data(void* dest, size_t len, const char* start);
+
+/**
+ * checks if a client sent a message which is just a SEQuence:ABORt or
+ * PARallel:STOP, so other clients polling the device don't stop anything.
+ * This only peeks at the receive descriptors and is safe to call with
+ * interrupts disabled. Messages which were already handed to lwIP are
+ * acted upon by the receive path, see commands_abort and
+ * commands_parallel_stop.
  */
-size_t ethernet_get_data(char* buf, size_t len);
+enum scpi_stop ethernet_stop_pending(void);
+
+/* called from the interrupt handler of the Ethernet DMA */
+void ethernet_interrupt_handler(void);
 
 /* signals the parser that it should handle binary data next */
 void ethernet_data_next(struct binary_data*);
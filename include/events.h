@@ -0,0 +1,52 @@
+/*
+ * Events raised in interrupts, e.g. the end of a sequence or the loss of
+ * the PLL lock. They are queued in a lock free ring and handed out by the
+ * main loop, which updates the SCPI status registers of all clients and
+ * pushes them as text lines to the client connected to EVENTS_PORT:
+ *
+ *   <name>,<time in ms>
+ *
+ * Service requests of the SCPI clients are pushed as SRQ,<client>,<status
+ * byte> and events lost because the ring was full as LOST,<count>.
+ */
+
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENTS_PORT 5027
+
+/* must be a power of 2 */
+#define EVENTS_QUEUE_SIZE 16
+
+enum event_type
+{
+  event_sequence_done,
+  event_sequence_aborted,
+  event_pll_lost,
+};
+
+struct event
+{
+  enum event_type type;
+  uint32_t time; /* LocalTime when it was raised */
+};
+
+/* starts listening, has to be called after lwIP is initialized */
+int events_init(void);
+
+/* queues an event, can be called from any interrupt */
+void events_post(enum event_type);
+
+/* checks if events are waiting to be handled by events_process */
+int events_pending(void);
+
+/* handles the queued events, called from the main loop */
+void events_process(void);
+
+/* sends a line to the event client, if one is connected */
+void events_push(const char* data, size_t len);
+
+#endif /* _EVENTS_H */
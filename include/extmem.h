@@ -0,0 +1,86 @@
+/*
+ * External SPI memory (SRAM or NOR flash) used to store parallel data
+ * which doesn't fit into the internal RAM
+ */
+
+#ifndef _EXTMEM_H
+#define _EXTMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the memory chips use 24 bit addresses */
+#define EXTMEM_SIZE 0x1000000
+
+/* smallest unit which can be erased in the flash chips */
+#define EXTMEM_FLASH_SECTOR 4096
+
+/* number of samples buffered between the memory and the parallel port */
+#define EXTMEM_RING_SAMPLES 4096
+
+typedef enum {
+  extmem_type_sram = 0,
+  extmem_type_flash = 1,
+} extmem_type;
+
+void extmem_init(void);
+
+void extmem_set_type(extmem_type);
+extmem_type extmem_get_type(void);
+
+/**
+ * writes data to the external memory. Flash sectors are erased when the
+ * write reaches their first byte, uploads to flash therefore have to start
+ * at a sector boundary.
+ *
+ * @return 0 on success, 1 if the range exceeds the memory
+ */
+int extmem_write(uint32_t address, const void* data, size_t len);
+
+/**
+ * writes data without erasing, flash sectors have to be erased with
+ * extmem_erase before. Used when the data doesn't arrive in order.
+ *
+ * @return 0 on success, 1 if the range exceeds the memory
+ */
+int extmem_program(uint32_t address, const void* data, size_t len);
+
+/**
+ * erases the flash sector containing address, does nothing for SRAM.
+ *
+ * @return 0 on success, 1 if the address exceeds the memory
+ */
+int extmem_erase(uint32_t address);
+int extmem_read(uint32_t address, void* data, size_t len);
+
+/**
+ * highest parallel update frequency the memory can sustain while
+ * streaming. This is limited by the SPI clock and the command overhead of
+ * every read burst.
+ */
+float extmem_max_sample_rate(void);
+
+/**
+ * prepares streaming of a waveform starting at address with the given
+ * number of samples. The waveform is played total / samples times. The
+ * ring buffer is filled before this function returns.
+ */
+void extmem_stream_start(uint32_t address, uint32_t samples, uint64_t total);
+
+/**
+ * fetches the next sample from the ring buffer and keeps the DMA
+ * transfers running. Returns 0 if the memory couldn't keep up and no
+ * sample is available yet.
+ */
+int extmem_stream_pop(uint16_t* value);
+
+/* call if a sample was due but extmem_stream_pop had nothing to offer */
+void extmem_stream_underrun(void);
+
+/* stops all transfers, has to be called at the end of the playback */
+void extmem_stream_stop(void);
+
+/* number of underruns during the last playback */
+uint32_t extmem_stream_get_underruns(void);
+
+#endif /* _EXTMEM_H */
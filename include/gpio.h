@@ -40,6 +40,9 @@ DEF_GPIO(RED_BUTTON, D, 12);
 DEF_GPIO(DRCTL, D, 2);
 DEF_GPIO(DRHOLD, D, 3);
 DEF_GPIO(DROVER, D, 1);
+DEF_GPIO(OSK, D, 0);
+
+DEF_GPIO(EXTMEM_CS, A, 15);
 
 DEF_GPIO(TX_ENABLE, B, 0);
 DEF_GPIO(PARALLEL_F0, B, 15);
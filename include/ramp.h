@@ -0,0 +1,145 @@
+/*
+ * Chains of digital ramps which are executed back to back. When a ramp
+ * reaches its limit the AD9910 raises DROVER, the interrupt on that pin
+ * starts a DMA transfer of the prebuilt limit, step and rate registers of
+ * the next segment and issues an IO update once the transfer is done.
+ */
+
+#ifndef _RAMP_H
+#define _RAMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAMP_CHAIN_LENGTH 64
+
+/* time in ms a chain may take longer than the sum of its segments before
+ * it is given up, e.g. because DROVER doesn't rise */
+#define RAMP_CHAIN_TIMEOUT 10
+
+typedef struct
+{
+  uint32_t target; /* ramp register value at the end of the segment */
+  uint32_t step;
+  uint16_t rate;
+} ramp_segment;
+
+void ramp_chain_clear(void);
+
+/* the value the first segment starts from */
+void ramp_chain_set_start(uint32_t);
+uint32_t ramp_chain_get_start(void);
+
+/**
+ * appends a segment ramping from the end of the previous segment to
+ * target.
+ *
+ * @return 0 on success, 1 if the chain is full or the segment is invalid
+ */
+int ramp_chain_append(const ramp_segment*);
+
+size_t ramp_chain_length(void);
+const ramp_segment* ramp_chain_get(size_t);
+
+/**
+ * runs the whole chain with the ramp destination currently selected in
+ * CFR2 and returns when the last segment reached its target. The ramp
+ * registers and DRCTL are left in the state of the last segment. The chain
+ * is given up if it takes more than RAMP_CHAIN_TIMEOUT ms longer than its
+ * segments add up to.
+ *
+ * @return 0 on success, 1 if the chain timed out
+ */
+int ramp_chain_execute(void);
+
+/* period of the digital ramp generator clock (SYSCLK / 4) in seconds */
+#define RAMP_CLOCK_PERIOD 4e-9
+
+typedef struct
+{
+  uint32_t step;
+  uint16_t rate;
+  double duration; /* achieved duration in seconds */
+} ramp_solution;
+
+/**
+ * finds the step size and rate for a ramp over span (in ramp register
+ * units) which comes closest to the requested duration. All rates are
+ * tried, if several pairs reach the same duration the one with the
+ * smallest overshoot of the last step is chosen. Durations longer than
+ * the slowest ramp (step 1, rate 0xFFFF) are clamped to it, the achieved
+ * duration is reported in the solution.
+ *
+ * @return 0 on success, 1 if span or duration are 0
+ */
+int ramp_solve(uint32_t span, double duration, ramp_solution*);
+
+/* duration in seconds of a ramp over span with the given step and rate */
+double ramp_duration(uint32_t span, uint32_t step, uint16_t rate);
+
+/**
+ * the same for the automatic OSK amplitude ramp from 0 to amplitude, which
+ * only allows step sizes of 1, 2, 4 and 8. The shortest step size reaching
+ * the best duration is chosen.
+ *
+ * @return 0 on success, 1 if amplitude or duration are 0
+ */
+int ramp_solve_osk(uint16_t amplitude, double duration, ramp_solution*);
+
+/**
+ * provides point i of a curve which should be compiled into a ramp chain.
+ * Times are in seconds and strictly increasing, values are in units of the
+ * 32 bit ramp registers.
+ */
+typedef void (*ramp_curve)(size_t i, const void* arg, double* time,
+                           double* value);
+
+/**
+ * replaces the ramp chain with the smallest number of linear segments
+ * which stay within max_error of the points of the curve. A segment always
+ * starts where the previous one ended, the chain starts at the first point.
+ * Flat segments are held with ramps of at most max_error back and forth,
+ * so they keep their time.
+ *
+ * @return 0 on success, 1 if the chain is too short to hold the segments
+ */
+int ramp_chain_compile(ramp_curve curve, const void* arg, size_t points,
+                       double max_error);
+
+typedef enum {
+  ramp_shape_linear,
+  ramp_shape_exponential,
+  ramp_shape_tanh,
+} ramp_shape;
+
+/* number of points a function is sampled with before compiling it */
+#define RAMP_COMPILE_SAMPLES 1024
+
+/**
+ * compiles a sweep from start to stop (in ramp register units) with the
+ * given duration in seconds. Exponential sweeps need start and stop
+ * larger than 0, steepness sets the slope in the middle of tanh sweeps.
+ *
+ * @return 0 on success, 1 if the parameters are invalid or the chain is
+ *         too short
+ */
+int ramp_chain_compile_function(ramp_shape shape, double start, double stop,
+                                double duration, double steepness,
+                                double max_error);
+
+/**
+ * compiles a list of points given as pairs of 32 bit floats (time in
+ * seconds, value). The values are multiplied with scale to convert them to
+ * ramp register units, the times have to be strictly increasing.
+ *
+ * @return 0 on success, 1 if the points are invalid or the chain is too
+ *         short
+ */
+int ramp_chain_compile_points(const void* data, size_t points, double scale,
+                              double max_error);
+
+/* called from the interrupt handlers of DROVER and the SPI DMA */
+void ramp_chain_drover_handler(void);
+void ramp_chain_dma_handler(void);
+
+#endif /* _RAMP_H */
@@ -1,11 +1,65 @@
 #ifndef _SCPI_H
 #define _SCPI_H
 
-#define SCPI_INPUT_BUFFER_LENGTH 256
+#include "commands.h"
+#include "events.h"
+
+#include <stddef.h>
+
 #define SCPI_ERROR_QUEUE_SIZE 17
 
+enum scpi_mode
+{
+  scpi_mode_normal,
+  scpi_mode_program,
+  scpi_mode_execute
+};
+
 void scpi_init(void);
 
-int scpi_process(char* data, int len);
+/* clears the error queue of the connection for a new client */
+void scpi_connect(size_t connection);
+
+/**
+ * parses and executes a complete message received on the connection.
+ * Binary blocks are only parsed up to their header, the commands read the
+ * data with ethernet_copy_data.
+ */
+int scpi_process(size_t connection, char* data, int len);
+
+/* sets the status register bits of the event for all clients */
+void scpi_event(enum event_type);
+
+enum scpi_stop
+{
+  scpi_stop_none = 0,
+  scpi_stop_abort,    /* SEQuence:ABORt */
+  scpi_stop_parallel, /* PARallel:STOP */
+};
+
+/* checks if the message is only a SEQuence:ABORt or PARallel:STOP, which
+ * are processed while a sequence runs */
+enum scpi_stop scpi_is_abort(const char* data, size_t len);
+
+/* reports a message which didn't fit into memory */
+void scpi_input_overrun(size_t connection);
+
+/**
+ * switches the mode like the MODE command. Executing runs the selected
+ * sequence or the one called name (if not NULL) after the current message
+ * and returns to the normal mode.
+ *
+ * @return 0 on success, 1 if the blocks of the sequence don't match, 2 if
+ *         there is no sequence called name
+ */
+int scpi_set_mode(enum scpi_mode mode, const char* name, size_t len);
+enum scpi_mode scpi_get_mode(void);
+
+/* executes a command right away or records it in programming mode, like
+ * the SCPI commands do */
+void scpi_process_command_register(const command_register*);
+void scpi_process_command_trigger(const command_trigger*);
+void scpi_process_command_update(const command_update*);
+void scpi_process_command_wait(const command_wait*);
 
 #endif /* _SCPI_H */
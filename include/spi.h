@@ -14,6 +14,20 @@ static INLINE int spi_is_busy(void);
 static INLINE void spi_wait(void);
 void spi_write_multi(uint8_t* data, uint32_t length);
 
+/**
+ * DMA transfers to the AD9910 using DMA2 stream 3 (SPI1_TX). The buffer
+ * has to stay valid until the transfer completed. If the interrupt is
+ * enabled DMA2_Stream3_IRQHandler is called at the end of a transfer, it
+ * has to call spi_dma_finish.
+ */
+void spi_dma_init(int interrupt);
+void spi_write_dma(const uint8_t* data, uint32_t length);
+/* waits until the last byte left the shift register and clears the
+ * receive side which overflowed during the transfer */
+void spi_dma_finish(void);
+/* cancels a running transfer and returns SPI1 to plain register writes */
+void spi_dma_deinit(void);
+
 /* implementation starts here */
 
 static INLINE uint8_t
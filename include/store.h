@@ -0,0 +1,71 @@
+/*
+ * Log structured key/value store in the flash sectors reserved as EEPROM.
+ * Records are only ever appended, a newer record with the same key
+ * replaces the older one. When a sector is full the next one is started
+ * and the records still in use are copied out of the oldest sector before
+ * it is erased, so the sectors are erased in turn.
+ */
+
+#ifndef _STORE_H
+#define _STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* maximal length of a key including the terminating 0 */
+#define STORE_KEY_LENGTH 24
+/* chunked values append "#nn" to the key for their chunks */
+#define STORE_CHUNKED_KEY_LENGTH (STORE_KEY_LENGTH - 3)
+/* maximal length of the header saved with a chunked value */
+#define STORE_CHUNKED_HEAD_LENGTH 32
+
+/**
+ * scans the sectors for the end of the log and finishes a compaction which
+ * was interrupted by a reset. Has to be called before any other function.
+ */
+void store_init(void);
+
+/**
+ * finds the newest record of key.
+ *
+ * @return pointer to the data in flash (aligned to 4 bytes) or NULL if the
+ *         key doesn't exist
+ */
+const void* store_get(const char* key, size_t* len);
+
+/**
+ * appends a record. The data is not readable under key before the whole
+ * record was written, an interrupted write leaves the previous value.
+ *
+ * @return 0 on success, 1 if the record doesn't fit into a sector or the
+ *         store is full
+ */
+int store_put(const char* key, const void* data, size_t len);
+
+/* @return 0 on success, 1 if the store is full */
+int store_delete(const char* key);
+
+/**
+ * stores a value larger than a sector as numbered chunk records. The record
+ * under key itself is written last and holds the length, the number of
+ * chunks and head, a small header of the caller. The previous value is
+ * removed first, an interrupted write leaves no value.
+ *
+ * @return 0 on success, 1 if the key is too long or the store is full
+ */
+int store_put_chunked(const char* key, const void* head, size_t head_len,
+                      const void* data, size_t len);
+
+/**
+ * reassembles a value written by store_put_chunked into buf.
+ *
+ * @return 0 on success, 1 if the key doesn't exist, a chunk is missing or
+ *         the value doesn't fit into size bytes
+ */
+int store_get_chunked(const char* key, void* head, size_t head_len,
+                      void* buf, size_t size, size_t* len);
+
+/* number of bytes which can still be appended to the current sector */
+size_t store_get_free(void);
+
+#endif /* _STORE_H */
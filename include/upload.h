@@ -0,0 +1,65 @@
+/*
+ * Bulk upload of waveforms into the external memory over UDP. The host
+ * starts a session with the destination and length, sends the numbered
+ * chunks as fast as it likes and then asks for the status. The answer
+ * carries a bitmap of the chunks which are still missing, only these are
+ * sent again until none are left. All values are little endian.
+ */
+
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <stdint.h>
+
+#define UPLOAD_PORT 5026
+
+/* payload of every chunk but the last, fits into one Ethernet frame */
+#define UPLOAD_CHUNK_SIZE 1024
+
+/* chunks covered by the bitmap of one status answer */
+#define UPLOAD_STATUS_CHUNKS 8192
+
+/* set in the type of every answer */
+#define UPLOAD_RESPONSE 0x80
+
+struct upload_header
+{
+  uint8_t type;
+  uint8_t status; /* only used in answers */
+  uint16_t session;
+  uint32_t index;
+};
+
+enum upload_type
+{
+  /* followed by an upload_start, answered with the number of chunks in
+   * index. Cancels the running session */
+  upload_type_start = 0x01,
+  /* index is the number of the chunk, followed by its data */
+  upload_type_data = 0x02,
+  /* answered with the first missing chunk in index, or the number of
+   * chunks if the upload is complete, followed by a bitmap of the missing
+   * chunks starting with this one. Bit n of byte m is chunk index + 8m + n */
+  upload_type_status = 0x03,
+};
+
+enum upload_status
+{
+  upload_status_ok = 0,
+  upload_status_session = 1, /* unknown session, the chunk was dropped */
+  /* invalid range or length, uploads to flash have to start at a sector
+   * boundary */
+  upload_status_invalid = 2,
+  upload_status_failed = 3,  /* writing to the memory failed */
+};
+
+struct upload_start
+{
+  uint32_t address;
+  uint32_t length;
+};
+
+/* starts listening, has to be called after lwIP is initialized */
+int upload_init(void);
+
+#endif /* _UPLOAD_H */
@@ -4,6 +4,7 @@
 #define INLINE __attribute__((always_inline)) inline
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 #define _str(s) #s
 #define str(s) _str(s)
@@ -57,7 +57,14 @@
 
 /* MEM_SIZE: the size of the heap memory. If the application will send
 a lot of data that needs to be copied, this should be set high. */
-#define MEM_SIZE                (10*1024)
+#define MEM_SIZE                (16*1024)
+
+/* The heap and the memory pools are only accessed by the CPU, the
+   Ethernet DMA works on its own buffers. The linker script therefore
+   places the uninitialized data of mem.o and memp.o (ram_heap and
+   memp_memory, about 55 KB with the settings below) in the 64 KB core
+   coupled memory, which is otherwise unused and leaves the 128 KB main
+   SRAM to the DMA buffers and the parallel data. */
 
 /* MEMP_NUM_PBUF: the number of memp struct pbufs. If the application
    sends a lot of data out of ROM (or other static memory), this
@@ -68,24 +75,26 @@ a lot of data that needs to be copied, this should be set high. */
 #define MEMP_NUM_UDP_PCB        6
 /* MEMP_NUM_TCP_PCB: the number of simulatenously active TCP
    connections. */
-#define MEMP_NUM_TCP_PCB        2
+#define MEMP_NUM_TCP_PCB        7
 /* MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP
    connections. */
-#define MEMP_NUM_TCP_PCB_LISTEN 1
+#define MEMP_NUM_TCP_PCB_LISTEN 3
 /* MEMP_NUM_TCP_SEG: the number of simultaneously queued TCP
    segments. */
-#define MEMP_NUM_TCP_SEG        8
+#define MEMP_NUM_TCP_SEG        32
 /* MEMP_NUM_SYS_TIMEOUT: the number of simulateously active
    timeouts. */
 #define MEMP_NUM_SYS_TIMEOUT    10
 
 
 /* ---------- Pbuf options ---------- */
-/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. */
-#define PBUF_POOL_SIZE          8
+/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. It has to hold
+   a full receive window. */
+#define PBUF_POOL_SIZE          24
 
-/* PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. */
-#define PBUF_POOL_BUFSIZE       500
+/* PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. A full frame
+   fits into one pbuf, so received segments are never split. */
+#define PBUF_POOL_BUFSIZE       1516
 
 
 /* ---------- TCP options ---------- */
@@ -94,21 +103,22 @@ a lot of data that needs to be copied, this should be set high. */
 
 /* Controls if TCP should queue segments that arrive out of
    order. Define to 0 if your device is low on memory. */
-#define TCP_QUEUE_OOSEQ         0
+#define TCP_QUEUE_OOSEQ         1
 
 /* TCP Maximum segment size. */
 #define TCP_MSS                 (1500 - 40)	  /* TCP_MSS = (Ethernet MTU - IP header size - TCP header size) */
 
 /* TCP sender buffer space (bytes). */
-#define TCP_SND_BUF             (2*TCP_MSS)
+#define TCP_SND_BUF             (4*TCP_MSS)
 
 /*  TCP_SND_QUEUELEN: TCP sender buffer space (pbufs). This must be at least
   as much as (2 * TCP_SND_BUF/TCP_MSS) for things to work. */
 
 #define TCP_SND_QUEUELEN        (4* TCP_SND_BUF/TCP_MSS)
 
-/* TCP receive window. */
-#define TCP_WND                 (2*TCP_MSS)
+/* TCP receive window. Large uploads stall on small windows, lwIP 1.4
+   doesn't support window scaling so it is limited to 64 KB anyways. */
+#define TCP_WND                 (16*TCP_MSS)
 
 
 /* ---------- ICMP options ---------- */
@@ -123,7 +133,7 @@ a lot of data that needs to be copied, this should be set high. */
 
 
 /* ---------- UDP options ---------- */
-#define LWIP_UDP                0
+#define LWIP_UDP                1
 #define UDP_TTL                 255
 
 
@@ -1,23 +1,40 @@
 #include "ad9910.h"
 
+#include "boot.h"
 #include "commands.h"
+#include "extmem.h"
 #include "gpio.h"
 #include "spi.h"
+#include "store.h"
 #include "timing.h"
 
 #include <math.h>
+#include <string.h>
+#include <stm32f4xx_dma.h>
+#include <stm32f4xx_exti.h>
 #include <stm32f4xx_rcc.h>
+#include <stm32f4xx_syscfg.h>
 #include <stm32f4xx_tim.h>
 
 enum
 {
-  ad9910_pll_lock_timeout = 10000000, // ~1s
+  ad9910_pll_lock_timeout = 1000, // ms
   ad9910_ram_address = 0x16,
 };
 
+/* time the PLL was started to lock */
+static uint32_t pll_start;
+
+static int ad9910_load_registers(void);
+
 /* we use timer 2 because it is has a 32 bit counter */
 TIM_TypeDef* parallel_timer = TIM2;
 
+/* key of the register image restored during startup */
+#define AD9910_IMAGE_KEY "ad9910"
+
+#define AD9910_REGISTER_COUNT (sizeof(ad9910_regs) / sizeof(ad9910_register))
+
 /* define registers with their values after bootup */
 ad9910_registers ad9910_regs = {
   .cfr1 = {.address = 0x00, .value = 0x0, .size = 4 },
@@ -88,52 +105,46 @@ ad9910_init()
   spi_deinit();
   spi_init_fast();
 
-  /* wait for PLL lock signal */
+  /* the PLL needs some time to lock, ad9910_init_finish waits for it */
   gpio_set_high(LED_RED);
-  int i = 0;
-  while (gpio_get(PLL_LOCK) == 0 && i < ad9910_pll_lock_timeout) {
-    ++i;
+  pll_start = LocalTime;
+}
+
+void
+ad9910_init_finish()
+{
+  while (gpio_get(PLL_LOCK) == 0 &&
+         LocalTime - pll_start < ad9910_pll_lock_timeout) {
   }
   gpio_set_low(LED_RED);
+  boot_timing_mark(boot_phase_pll);
+
+  /* press red button during startup to skip the stored register image and
+   * command execution and clear both */
+  const int skip_startup = gpio_get(RED_BUTTON) != 0;
 
-  /* set communication mode to SDIO with 3 wires (CLK, IN, OUT) */
-  ad9910_set_value(ad9910_sdio_input_only, 1);
+  if (skip_startup || ad9910_load_registers()) {
+    /* set communication mode to SDIO with 3 wires (CLK, IN, OUT) */
+    ad9910_set_value(ad9910_sdio_input_only, 1);
 
-  /* enable PDCLK line */
-  ad9910_set_value(ad9910_pdclk_enable, 1);
+    /* enable PDCLK line */
+    ad9910_set_value(ad9910_pdclk_enable, 1);
 
-  /* enable inverse sinc filter */
-  ad9910_set_value(ad9910_inverse_sinc_filter_enable, 1);
+    /* enable inverse sinc filter */
+    ad9910_set_value(ad9910_inverse_sinc_filter_enable, 1);
 
-  /* enable amplitude scale from profile registers */
-  ad9910_set_value(ad9910_enable_amplitude_scale, 1);
+    /* enable amplitude scale from profile registers */
+    ad9910_set_value(ad9910_enable_amplitude_scale, 1);
 
-  /* match latency of amlitude, frequency and phase updates */
-  ad9910_set_value(ad9910_matched_latency_enable, 1);
+    /* match latency of amlitude, frequency and phase updates */
+    ad9910_set_value(ad9910_matched_latency_enable, 1);
+  }
 
   /* update all register. It might be that only the STM32F4 has been
    * resetet and there is still data in the registers. With these commands
    * we set them to the values we specified */
-  ad9910_update_reg(&ad9910_regs.cfr1);
-  ad9910_update_reg(&ad9910_regs.cfr2);
-  ad9910_update_reg(&ad9910_regs.cfr3);
-  ad9910_update_reg(&ad9910_regs.aux_dac_ctl);
-  ad9910_update_reg(&ad9910_regs.io_update_rate);
-  ad9910_update_reg(&ad9910_regs.ftw);
-  ad9910_update_reg(&ad9910_regs.pow);
-  ad9910_update_reg(&ad9910_regs.asf);
-  ad9910_update_reg(&ad9910_regs.multichip_sync);
-  ad9910_update_reg(&ad9910_regs.ramp_limit);
-  ad9910_update_reg(&ad9910_regs.ramp_step);
-  ad9910_update_reg(&ad9910_regs.ramp_rate);
-  ad9910_update_reg(&ad9910_regs.prof0);
-  ad9910_update_reg(&ad9910_regs.prof1);
-  ad9910_update_reg(&ad9910_regs.prof2);
-  ad9910_update_reg(&ad9910_regs.prof3);
-  ad9910_update_reg(&ad9910_regs.prof4);
-  ad9910_update_reg(&ad9910_regs.prof5);
-  ad9910_update_reg(&ad9910_regs.prof6);
-  ad9910_update_reg(&ad9910_regs.prof7);
+  ad9910_update_all_regs();
+  boot_timing_mark(boot_phase_registers);
 
   ad9910_select_profile(0);
   ad9910_select_parallel_target(0);
@@ -143,20 +154,90 @@ ad9910_init()
   gpio_set_high(TX_ENABLE);
   ad9910_enable_output(1);
 
-  /* press red button during startup to skip command execution and clear
-   * the startup command */
-  if (gpio_get(RED_BUTTON) == 0) {
-    startup_command_execute();
-  } else {
+  if (skip_startup) {
     startup_command_clear();
+  } else {
+    startup_command_execute();
   }
+  boot_timing_mark(boot_phase_startup);
+}
+
+void
+ad9910_update_all_regs()
+{
+  static uint8_t buf[AD9910_REGISTER_COUNT * AD9910_MAX_FRAME_SIZE];
+
+  const ad9910_register* regs = &ad9910_regs.cfr1;
+  size_t len = 0;
+
+  for (size_t i = 0; i < AD9910_REGISTER_COUNT; ++i) {
+    len += ad9910_build_reg_frame(regs + i, buf + len);
+  }
+
+  /* like the ramp chain segments the frames are sent back to back in one
+   * transfer, the AD9910 parses them as consecutive instructions */
+  spi_dma_init(0);
+  spi_write_dma(buf, len);
+  while (DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TCIF3) == RESET) {
+  }
+  spi_dma_deinit();
+}
+
+int
+ad9910_save_registers()
+{
+  uint64_t image[AD9910_REGISTER_COUNT];
+  const ad9910_register* regs = &ad9910_regs.cfr1;
+
+  for (size_t i = 0; i < AD9910_REGISTER_COUNT; ++i) {
+    image[i] = regs[i].value;
+  }
+
+  return store_put(AD9910_IMAGE_KEY, image, sizeof(image));
+}
+
+void
+ad9910_clear_registers()
+{
+  store_delete(AD9910_IMAGE_KEY);
+}
+
+/* copies the stored register image into ad9910_regs, returns 1 if there is
+ * none */
+static int
+ad9910_load_registers()
+{
+  size_t len;
+  const uint64_t* image = store_get(AD9910_IMAGE_KEY, &len);
+
+  if (image == NULL || len != AD9910_REGISTER_COUNT * sizeof(uint64_t)) {
+    return 1;
+  }
+
+  ad9910_register* regs = &ad9910_regs.cfr1;
+  for (size_t i = 0; i < AD9910_REGISTER_COUNT; ++i) {
+    regs[i].value = image[i];
+  }
+
+  return 0;
 }
 
 void
 ad9910_update_reg(ad9910_register* reg)
 {
-  static uint8_t buf[9];
+  static uint8_t buf[AD9910_MAX_FRAME_SIZE];
+
+  const size_t len = ad9910_build_reg_frame(reg, buf);
 
+  spi_write_multi(buf, len);
+
+  /* make sure that the write is done before we return */
+  spi_wait();
+}
+
+size_t
+ad9910_build_reg_frame(const ad9910_register* reg, uint8_t* buf)
+{
   buf[0] = reg->address | AD9910_INSTR_WRITE;
 
   /* MSB is not only for the bits in every byte but also for the bytes
@@ -165,10 +246,7 @@ ad9910_update_reg(ad9910_register* reg)
     buf[i] = ((const uint8_t*)(&(reg->value)))[reg->size - i];
   }
 
-  spi_write_multi(buf, reg->size + 1);
-
-  /* make sure that the write is done before we return */
-  spi_wait();
+  return reg->size + 1;
 }
 
 void
@@ -178,9 +256,10 @@ ad9910_update_multiple_regs(uint32_t mask)
    * struct as an array of registers */
   ad9910_register* regs = &ad9910_regs.cfr1;
 
-  /* TODO implement DMA */
-  for (size_t i = 0; i < sizeof(mask) * 8; ++i) {
-    if (mask & (i << i)) {
+  /* the mask is indexed by register address, which has gaps, so it can't
+   * be used as array index directly */
+  for (size_t i = 0; i < sizeof(ad9910_regs) / sizeof(ad9910_register); ++i) {
+    if (mask & (1u << regs[i].address)) {
       ad9910_update_reg(regs + i);
     }
   }
@@ -261,6 +340,14 @@ ad9910_get_parallel_frequency()
   return ((float)(CORE_CLOCK_SPEED / 2)) / (parallel_timer->ARR + 1);
 }
 
+uint32_t
+ad9910_get_parallel_max_dwell()
+{
+  const uint64_t max = ((uint64_t)UINT32_MAX + 1) / (parallel_timer->ARR + 1);
+
+  return max > UINT32_MAX ? UINT32_MAX : max;
+}
+
 void
 ad9910_enable_parallel(int mode)
 {
@@ -274,6 +361,83 @@ ad9910_enable_parallel(int mode)
 void
 ad9910_execute_parallel(uint16_t* data, size_t len, size_t rep)
 {
+  const ad9910_parallel_loop loop = {
+    .begin = 0,
+    .end = len,
+    .repeats = rep,
+    .stop = 0,
+    .request = NULL,
+    .abort = NULL,
+  };
+
+  ad9910_execute_parallel_loop(data, len, &loop);
+}
+
+static INLINE void
+ad9910_parallel_wait_update()
+{
+  /* these are inlined versions of TIM_GetFlagStatus and TIM_ClearFlag
+   * if they are not inlined the function call take ages */
+  while ((parallel_timer->SR & TIM_FLAG_Update) == (uint16_t)RESET) {
+  }
+  parallel_timer->SR = (uint16_t)~TIM_FLAG_Update;
+}
+
+static INLINE void
+ad9910_parallel_play(const uint16_t* data, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; ++i) {
+    ad9910_parallel_wait_update();
+    ad9910_set_parallel(data[i]);
+  }
+}
+
+static int
+ad9910_parallel_stop_requested(const ad9910_parallel_loop* loop)
+{
+  if (loop->abort && loop->abort()) {
+    return 1;
+  }
+
+  if ((loop->stop & ad9910_parallel_stop_trigger) &&
+      (EXTI->PR & EXTI_Line11)) {
+    return 1;
+  }
+
+  if ((loop->stop & ad9910_parallel_stop_request) && loop->request &&
+      loop->request()) {
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+ad9910_execute_parallel_loop(const uint16_t* data, size_t len,
+                             const ad9910_parallel_loop* loop)
+{
+  /* an empty loop region would spin without playing anything */
+  if (len == 0 || loop->begin >= loop->end || loop->end > len) {
+    return 0;
+  }
+
+  /* an empty loop region is skipped, the first pass has to play at least
+   * one sample to be able to start with data[0] */
+  if (loop->repeats == 0 && loop->begin == 0) {
+    return 0;
+  }
+
+  if (loop->stop & ad9910_parallel_stop_trigger) {
+    /* the trigger line is connected to IO_UPDATE. Only the edge detection
+     * of EXTI line 11 is used, its interrupt stays masked */
+    gpio_set_pin_mode_input(IO_UPDATE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+    SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOD, EXTI_PinSource11);
+    EXTI->IMR &= ~EXTI_Line11;
+    EXTI->RTSR |= EXTI_Line11;
+    EXTI->PR = EXTI_Line11;
+  }
+
   /* disable interrupts to prevent delays */
   /* TODO just disable timing and ethernet interrupts */
   __disable_irq();
@@ -287,18 +451,172 @@ ad9910_execute_parallel(uint16_t* data, size_t len, size_t rep)
   /* enable timer */
   TIM_Cmd(parallel_timer, ENABLE);
 
-  for (size_t i = 0; i < len * rep; ++i) {
-    // these are inlined versions of TIM_GetFlagStatus and TIM_ClearFlag
-    // if they are not inlined the function call take ages
+  /* the first sample is already on the output */
+  size_t start = 1;
+  if (loop->begin > 0) {
+    ad9910_parallel_play(data, 1, loop->begin);
+    start = loop->begin;
+  }
+
+  /* count passes instead of samples, len * repeats might not fit */
+  int stopped = 0;
+  for (size_t r = 0;
+       loop->repeats == AD9910_PARALLEL_FOREVER || r < loop->repeats; ++r) {
+    ad9910_parallel_play(data, start, loop->end);
+    start = loop->begin;
+
+    if (ad9910_parallel_stop_requested(loop)) {
+      stopped = 1;
+      break;
+    }
+  }
+
+  ad9910_parallel_play(data, loop->end, len);
+
+  /* keep the last sample for a full period */
+  ad9910_parallel_wait_update();
+
+  TIM_Cmd(parallel_timer, DISABLE);
+
+  /* reenable interrupts */
+  __enable_irq();
+
+  if (loop->stop & ad9910_parallel_stop_trigger) {
+    EXTI->RTSR &= ~EXTI_Line11;
+    EXTI->PR = EXTI_Line11;
+    gpio_set_pin_mode_output(IO_UPDATE);
+  }
+
+  return stopped;
+}
+
+/* periods which don't fit into the timer are rejected by the SCPI parser,
+ * the frequency might still change in a sequence, they are clamped then */
+static INLINE uint32_t
+ad9910_dwell_period(uint32_t interval, uint16_t dwell)
+{
+  const uint64_t period = (uint64_t)interval * (dwell ? dwell : 1) - 1;
+
+  return period > UINT32_MAX ? UINT32_MAX : period;
+}
+
+int
+ad9910_execute_parallel_dwell(const ad9910_parallel_sample* data, size_t len,
+                              size_t rep, int (*abort)(void))
+{
+  if (len == 0 || rep == 0) {
+    return 0;
+  }
+
+  /* the configured parallel frequency is the base period which gets
+   * stretched by the dwell count of every sample */
+  const uint32_t interval = parallel_timer->ARR + 1;
+
+  __disable_irq();
+
+  ad9910_set_parallel(data[0].value);
+
+  ad9910_enable_parallel(1);
+
+  /* with preloading a new period only gets active on the next update
+   * event. This allows us to write the period of the following sample
+   * while the current one is still on the output */
+  TIM_ARRPreloadConfig(parallel_timer, ENABLE);
+  parallel_timer->ARR = ad9910_dwell_period(interval, data[0].dwell);
+  /* move the period of the first sample into the shadow register */
+  TIM_GenerateEvent(parallel_timer, TIM_EventSource_Update);
+  parallel_timer->ARR = ad9910_dwell_period(interval, data[1 % len].dwell);
+
+  TIM_ClearFlag(parallel_timer, TIM_FLAG_Update);
+  TIM_Cmd(parallel_timer, ENABLE);
+
+  /* the first sample is already on the output */
+  int aborted = 0;
+  for (size_t r = 0; r < rep && !aborted; ++r) {
+    for (size_t i = (r == 0); i < len; ++i) {
+      const size_t next = (i + 1 < len) ? i + 1 : 0;
+
+      while ((parallel_timer->SR & TIM_FLAG_Update) == (uint16_t)RESET) {
+      }
+      parallel_timer->SR = (uint16_t)~TIM_FLAG_Update;
+
+      ad9910_set_parallel(data[i].value);
+      parallel_timer->ARR = ad9910_dwell_period(interval, data[next].dwell);
+    }
+
+    aborted = abort && abort();
+  }
+
+  /* keep the last sample for its full dwell time */
+  while ((parallel_timer->SR & TIM_FLAG_Update) == (uint16_t)RESET) {
+  }
+
+  TIM_Cmd(parallel_timer, DISABLE);
+
+  /* restore the base period for normal parallel playback */
+  TIM_ARRPreloadConfig(parallel_timer, DISABLE);
+  parallel_timer->ARR = interval - 1;
+
+  __enable_irq();
+
+  return aborted;
+}
+
+void
+ad9910_execute_parallel_external(uint32_t address, size_t len, size_t rep,
+                                 int (*abort)(void))
+{
+  if (len == 0 || rep == 0) {
+    return;
+  }
+
+  const uint64_t total = (uint64_t)len * rep;
+
+  /* fill the ring buffer before the output starts */
+  extmem_stream_start(address, len, total);
+
+  __disable_irq();
+
+  uint16_t value = 0;
+  extmem_stream_pop(&value);
+  ad9910_set_parallel(value);
+
+  ad9910_enable_parallel(1);
+
+  TIM_ClearFlag(parallel_timer, TIM_FLAG_Update);
+  TIM_Cmd(parallel_timer, ENABLE);
+
+  /* the first sample is already on the output. The next value is fetched
+   * while waiting for the update so the timer only has to set the port */
+  int pending = 0;
+  size_t pos = 1; /* in the current pass */
+  for (uint64_t i = 1; i < total;) {
+    if (!pending) {
+      pending = extmem_stream_pop(&value);
+    }
+
     if ((parallel_timer->SR & TIM_FLAG_Update) != (uint16_t)RESET) {
       parallel_timer->SR = (uint16_t)~TIM_FLAG_Update;
-      ad9910_set_parallel(data[i % len]);
+      if (pending) {
+        ad9910_set_parallel(value);
+        pending = 0;
+        ++i;
+        if (++pos == len) {
+          pos = 0;
+          if (abort && abort()) {
+            break;
+          }
+        }
+      } else {
+        extmem_stream_underrun();
+      }
     }
   }
 
   TIM_Cmd(parallel_timer, DISABLE);
 
-  /* reenable interrupts */
+  extmem_stream_stop();
+
   __enable_irq();
 }
 
@@ -314,6 +632,133 @@ ad9910_backconvert_frequency(uint32_t f)
   return f * 1e9 / ad9910_max_frequency;
 }
 
+int
+ad9910_pack_parallel_frequency(uint32_t base, void* data, size_t len,
+                               uint32_t* ftw)
+{
+  if (len == 0) {
+    return -1;
+  }
+
+  /* the samples are read with memcpy because the buffer is shared
+   * between the float input and the 16 bit output */
+  const char* in = data;
+  uint16_t* out = data;
+
+  int64_t low = INT64_MAX;
+  int64_t high = INT64_MIN;
+  for (size_t i = 0; i < len; ++i) {
+    float f;
+    memcpy(&f, in + i * sizeof(f), sizeof(f));
+
+    const int64_t offset = nearbyintf(f / 1e9 * ad9910_max_frequency);
+    low = min(low, offset);
+    high = max(high, offset);
+  }
+
+  if (base + low < 0 || base + high > (int64_t)ad9910_max_frequency) {
+    return -1;
+  }
+
+  const uint64_t span = high - low;
+  int gain = 0;
+  while ((span >> gain) > 0xFFFF) {
+    gain++;
+  }
+
+  /* fm_gain is a 4 bit field */
+  if (gain > 15) {
+    return -1;
+  }
+
+  /* every output word is written after the input it overlaps with has
+   * been read, so a forward pass is safe */
+  for (size_t i = 0; i < len; ++i) {
+    float f;
+    memcpy(&f, in + i * sizeof(f), sizeof(f));
+
+    const int64_t offset = nearbyintf(f / 1e9 * ad9910_max_frequency);
+    const uint64_t word = (offset - low + ((1 << gain) >> 1)) >> gain;
+    out[i] = min(word, 0xFFFF);
+  }
+
+  *ftw = base + low;
+
+  return gain;
+}
+
+/* builds the parallel word from a pair with the amplitude in the lower
+ * and the phase in the upper half word */
+static INLINE uint16_t
+ad9910_pack_polar_pair(uint32_t pair)
+{
+  return ((pair << (16 - ad9910_bits_amplitude)) & 0xFF00) | (pair >> 24);
+}
+
+/* the same for two pairs at once, the first word ends up in the lower half
+ * word. The DSP instructions gather both amplitudes and both phases in one
+ * register each, so a single shift and mask builds both words */
+static INLINE uint32_t
+ad9910_pack_polar_pairs(uint32_t first, uint32_t second)
+{
+  const uint32_t amplitudes = __PKHBT(first, second, 16);
+  const uint32_t phases = __PKHTB(second, first, 16);
+
+  return ((amplitudes << (16 - ad9910_bits_amplitude)) & 0xFF00FF00) |
+         ((phases >> 8) & 0x00FF00FF);
+}
+
+void
+ad9910_pack_parallel_polar_raw(void* data, size_t len)
+{
+  const char* in = data;
+  char* out = data;
+
+  /* the output never overtakes the input, which is twice as large */
+  size_t i = 0;
+  for (; i + 1 < len; i += 2) {
+    uint32_t pairs[2];
+    memcpy(pairs, in + i * sizeof(uint32_t), sizeof(pairs));
+
+    const uint32_t words = ad9910_pack_polar_pairs(pairs[0], pairs[1]);
+    memcpy(out + i * sizeof(uint16_t), &words, sizeof(words));
+  }
+
+  if (i < len) {
+    uint32_t pair;
+    memcpy(&pair, in + i * sizeof(pair), sizeof(pair));
+
+    const uint16_t word = ad9910_pack_polar_pair(pair);
+    memcpy(out + i * sizeof(uint16_t), &word, sizeof(word));
+  }
+}
+
+void
+ad9910_pack_parallel_polar(void* data, size_t len)
+{
+  const char* in = data;
+  char* out = data;
+  uint32_t pairs[2];
+
+  /* the conversion is done for each pair, the packing two at a time */
+  for (size_t i = 0; i < len; ++i) {
+    float pair[2];
+    memcpy(pair, in + i * sizeof(pair), sizeof(pair));
+
+    const uint32_t amplitude = ad9910_convert_amplitude(pair[0]);
+    const uint32_t phase = ad9910_convert_phase(pair[1]);
+    pairs[i % 2] = amplitude | (phase << 16);
+
+    if (i % 2) {
+      const uint32_t words = ad9910_pack_polar_pairs(pairs[0], pairs[1]);
+      memcpy(out + (i - 1) * sizeof(uint16_t), &words, sizeof(words));
+    } else if (i + 1 == len) {
+      const uint16_t word = ad9910_pack_polar_pair(pairs[0]);
+      memcpy(out + i * sizeof(uint16_t), &word, sizeof(word));
+    }
+  }
+}
+
 uint32_t
 ad9910_convert_amplitude(float f)
 {
@@ -0,0 +1,424 @@
+#include "binary.h"
+
+#include "ad9910.h"
+#include "commands.h"
+#include "extmem.h"
+#include "gpio.h"
+#include "scpi.h"
+#include "util.h"
+
+#include <lwip/memp.h>
+#include <lwip/tcp.h>
+#include <string.h>
+
+#define BINARY_REGISTER_COUNT (sizeof(ad9910_regs) / sizeof(ad9910_register))
+
+struct binary_connection
+{
+  struct tcp_pcb* pcb;
+  /* received segments waiting for binary_process */
+  struct pbuf* queue;
+  int closing; /* the client closed the connection after the queued data */
+  struct binary_header header;
+  size_t header_len;  /* bytes of the header received so far */
+  size_t payload_len; /* bytes of the payload received so far */
+  uint16_t status;
+  uint32_t result; /* argument of the response */
+  uint32_t payload[BINARY_PAYLOAD_SIZE / sizeof(uint32_t)];
+};
+
+static struct tcp_pcb* listen_pcb;
+static struct binary_connection bc = {.pcb = NULL, .queue = NULL };
+
+/* fields covering the 32 bit words of all registers. Recorded commands
+ * point to them, so they have to stay valid */
+static ad9910_register_bit words[BINARY_REGISTER_COUNT][2];
+
+static err_t binary_accept_callback(void*, struct tcp_pcb*, err_t);
+static err_t binary_recv_callback(void*, struct tcp_pcb*, struct pbuf*, err_t);
+static void binary_err_callback(void*, err_t);
+static void binary_close(struct tcp_pcb*);
+static void binary_reset(void);
+static void binary_drop_queue(void);
+
+static err_t binary_input(const uint8_t* data, size_t len);
+static void binary_frame_begin(void);
+static void binary_frame_data(const uint8_t* data, size_t len);
+static err_t binary_frame_end(void);
+static uint16_t binary_write(void);
+static err_t binary_respond(const void* payload, uint32_t len);
+
+int
+binary_init()
+{
+  ad9910_register* regs = &ad9910_regs.cfr1;
+
+  for (size_t i = 0; i < BINARY_REGISTER_COUNT; ++i) {
+    const int bits = regs[i].size * 8;
+    words[i][0] = (ad9910_register_bit){
+      .reg = regs + i, .bits = min(bits, 32), .offset = 0,
+    };
+    words[i][1] = (ad9910_register_bit){
+      .reg = regs + i, .bits = max(bits - 32, 0), .offset = 32,
+    };
+  }
+
+  listen_pcb = tcp_new();
+  if (listen_pcb == NULL) {
+    return 1;
+  }
+
+  if (tcp_bind(listen_pcb, IP_ADDR_ANY, BINARY_PORT) != ERR_OK) {
+    memp_free(MEMP_TCP_PCB, listen_pcb);
+    return 1;
+  }
+
+  listen_pcb = tcp_listen(listen_pcb);
+  tcp_accept(listen_pcb, binary_accept_callback);
+
+  return 0;
+}
+
+static err_t
+binary_accept_callback(void* arg, struct tcp_pcb* newpcb, err_t err)
+{
+  LWIP_UNUSED_ARG(arg);
+  LWIP_UNUSED_ARG(err);
+
+  bc.pcb = newpcb;
+  binary_drop_queue();
+  binary_reset();
+
+  tcp_recv(newpcb, binary_recv_callback);
+  tcp_err(newpcb, binary_err_callback);
+
+  /* like the SCPI server only one client is served at a time */
+  tcp_accept(listen_pcb, NULL);
+
+  tcp_accepted(newpcb);
+
+  return ERR_OK;
+}
+
+static err_t
+binary_recv_callback(void* arg, struct tcp_pcb* pcb, struct pbuf* p,
+                     err_t err)
+{
+  /* the client closed the connection, its last frames are answered
+   * first */
+  if (p == NULL) {
+    if (bc.queue != NULL) {
+      bc.closing = 1;
+    } else {
+      binary_close(pcb);
+    }
+    return ERR_OK;
+  }
+
+  if (err != ERR_OK) {
+    pbuf_free(p);
+    return err;
+  }
+
+  /* the frames are executed by binary_process from the main loop. Some of
+   * them block, and lwIP is polled while the SCPI server waits for data or
+   * sends, which would call us again. The window is only opened once the
+   * data was processed */
+  if (bc.queue == NULL) {
+    bc.queue = p;
+  } else {
+    pbuf_cat(bc.queue, p);
+  }
+
+  return ERR_OK;
+}
+
+int
+binary_pending()
+{
+  return bc.queue != NULL;
+}
+
+void
+binary_process()
+{
+  struct tcp_pcb* pcb = bc.pcb;
+  struct pbuf* p = bc.queue;
+
+  if (p == NULL) {
+    return;
+  }
+
+  const u16_t len = p->tot_len;
+
+  /* segments arriving while the frames are executed are queued again */
+  bc.queue = NULL;
+
+  err_t err = ERR_OK;
+  for (struct pbuf* q = p; q != NULL && err == ERR_OK; q = q->next) {
+    err = binary_input(q->payload, q->len);
+  }
+
+  pbuf_free(p);
+
+  /* the connection was aborted if a response couldn't be sent, or reset
+   * by the client in the meantime */
+  if (err != ERR_OK || bc.pcb != pcb) {
+    return;
+  }
+
+  if (bc.closing && bc.queue == NULL) {
+    binary_close(pcb);
+    return;
+  }
+
+  tcp_recved(pcb, len);
+  tcp_output(pcb);
+}
+
+static void
+binary_err_callback(void* arg, err_t err)
+{
+  LWIP_UNUSED_ARG(arg);
+  LWIP_UNUSED_ARG(err);
+
+  /* lwIP already freed the pcb */
+  bc.pcb = NULL;
+  binary_drop_queue();
+  tcp_accept(listen_pcb, binary_accept_callback);
+}
+
+static void
+binary_close(struct tcp_pcb* pcb)
+{
+  tcp_recv(pcb, NULL);
+  tcp_err(pcb, NULL);
+  tcp_close(pcb);
+
+  bc.pcb = NULL;
+  binary_drop_queue();
+  tcp_accept(listen_pcb, binary_accept_callback);
+}
+
+static void
+binary_reset()
+{
+  bc.header_len = 0;
+  bc.payload_len = 0;
+}
+
+static void
+binary_drop_queue()
+{
+  if (bc.queue != NULL) {
+    pbuf_free(bc.queue);
+    bc.queue = NULL;
+  }
+  bc.closing = 0;
+}
+
+/* splits the received data into frames, which may span several segments.
+ * Stops if the connection was aborted */
+static err_t
+binary_input(const uint8_t* data, size_t len)
+{
+  while (len > 0) {
+    size_t n;
+    if (bc.header_len < sizeof(bc.header)) {
+      n = min(len, sizeof(bc.header) - bc.header_len);
+      memcpy((uint8_t*)&bc.header + bc.header_len, data, n);
+      bc.header_len += n;
+
+      if (bc.header_len == sizeof(bc.header)) {
+        binary_frame_begin();
+      }
+    } else {
+      n = min(len, bc.header.length - bc.payload_len);
+      binary_frame_data(data, n);
+      bc.payload_len += n;
+    }
+
+    data += n;
+    len -= n;
+
+    if (bc.header_len == sizeof(bc.header) &&
+        bc.payload_len == bc.header.length) {
+      const err_t err = binary_frame_end();
+      binary_reset();
+      if (err != ERR_OK) {
+        return err;
+      }
+    }
+  }
+
+  return ERR_OK;
+}
+
+static void
+binary_frame_begin()
+{
+  bc.status = binary_status_ok;
+  bc.result = 0;
+
+  /* only the queries and the abort don't interfere with the sequencer */
+  if (commands_running() && bc.header.opcode != binary_op_nop &&
+      bc.header.opcode != binary_op_status &&
+      bc.header.opcode != binary_op_abort) {
+    bc.status = binary_status_busy;
+  } else if (bc.header.opcode == binary_op_data) {
+    if (bc.header.argument > EXTMEM_SIZE ||
+        bc.header.length > EXTMEM_SIZE - bc.header.argument) {
+      bc.status = binary_status_invalid;
+    }
+  } else if (bc.header.length > BINARY_PAYLOAD_SIZE) {
+    /* the payload is skipped */
+    bc.status = binary_status_length;
+  }
+}
+
+static void
+binary_frame_data(const uint8_t* data, size_t len)
+{
+  if (bc.status != binary_status_ok) {
+    return;
+  }
+
+  /* uploads are written to the memory as they arrive */
+  if (bc.header.opcode == binary_op_data) {
+    if (extmem_write(bc.header.argument + bc.payload_len, data, len)) {
+      bc.status = binary_status_failed;
+    }
+    return;
+  }
+
+  memcpy((uint8_t*)bc.payload + bc.payload_len, data, len);
+}
+
+static err_t
+binary_frame_end()
+{
+  struct binary_status_response status;
+  struct command_status run;
+
+  if (bc.status != binary_status_ok) {
+    return binary_respond(NULL, 0);
+  }
+
+  switch (bc.header.opcode) {
+    case binary_op_nop:
+      break;
+    case binary_op_write:
+      bc.status = binary_write();
+      break;
+    case binary_op_update:
+      scpi_process_command_update(NULL);
+      break;
+    case binary_op_wait: {
+      const command_wait cmd = {.delay = bc.header.argument };
+      scpi_process_command_wait(&cmd);
+      break;
+    }
+    case binary_op_trigger:
+      scpi_process_command_trigger(NULL);
+      break;
+    case binary_op_mode:
+      if (bc.header.argument > scpi_mode_execute) {
+        bc.status = binary_status_invalid;
+      } else if (scpi_set_mode(bc.header.argument, NULL, 0)) {
+        bc.status = binary_status_failed;
+      }
+      break;
+    case binary_op_data:
+      bc.result = bc.header.length;
+      break;
+    case binary_op_status:
+      status.mode = scpi_get_mode();
+      status.pll_lock = gpio_get(PLL_LOCK);
+      status.steps = commands_step_count();
+      commands_status(&run);
+      status.sequence = run.state;
+      status.cycle = run.cycle;
+      status.executed = run.steps;
+      return binary_respond(&status, sizeof(status));
+    case binary_op_abort:
+      commands_abort();
+      break;
+    default:
+      bc.status = binary_status_opcode;
+      break;
+  }
+
+  return binary_respond(NULL, 0);
+}
+
+/* checks all entries before the first one is applied, so a frame is
+ * either written completely or not at all */
+static uint16_t
+binary_write()
+{
+  const struct binary_write* entries = (const struct binary_write*)bc.payload;
+  const size_t count = bc.header.length / sizeof(struct binary_write);
+  const ad9910_register_bit* fields[BINARY_PAYLOAD_SIZE /
+                                    sizeof(struct binary_write)];
+
+  if (bc.header.length % sizeof(struct binary_write)) {
+    return binary_status_length;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    fields[i] = NULL;
+    for (size_t j = 0; j < BINARY_REGISTER_COUNT; ++j) {
+      if (words[j][0].reg->address == entries[i].address &&
+          entries[i].word < 2 && words[j][entries[i].word].bits > 0) {
+        fields[i] = &words[j][entries[i].word];
+      }
+    }
+
+    if (fields[i] == NULL) {
+      bc.result = i;
+      return binary_status_invalid;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    const command_register cmd = {.reg = fields[i],
+                                  .value = entries[i].value };
+    scpi_process_command_register(&cmd);
+  }
+
+  bc.result = count;
+
+  return binary_status_ok;
+}
+
+/* a client which doesn't wait for its responses can't be served, the
+ * connection is aborted if a response doesn't fit into the send buffer */
+static err_t
+binary_respond(const void* payload, uint32_t len)
+{
+  if (bc.pcb == NULL) {
+    return ERR_CONN;
+  }
+
+  const struct binary_header header = {
+    .length = len,
+    .opcode = bc.header.opcode | BINARY_RESPONSE,
+    .tag = bc.header.tag,
+    .status = bc.status,
+    .argument = bc.result,
+  };
+
+  err_t err = tcp_write(bc.pcb, &header, sizeof(header),
+                        TCP_WRITE_FLAG_COPY |
+                          (len > 0 ? TCP_WRITE_FLAG_MORE : 0));
+  if (err == ERR_OK && len > 0) {
+    err = tcp_write(bc.pcb, payload, len, TCP_WRITE_FLAG_COPY);
+  }
+
+  if (err != ERR_OK) {
+    /* calls binary_err_callback, which releases the connection */
+    tcp_abort(bc.pcb);
+  }
+
+  return err;
+}
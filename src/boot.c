@@ -0,0 +1,44 @@
+#include "boot.h"
+
+#include "timing.h"
+
+#include <stm32f4xx.h>
+
+static uint32_t boot_marks[boot_phase_count];
+
+static const char* const boot_phase_names[boot_phase_count] = {
+  [boot_phase_store] = "STORE",
+  [boot_phase_dds] = "DDS",
+  [boot_phase_extmem] = "EXTMEM",
+  [boot_phase_ethernet] = "ETHERNET",
+  [boot_phase_pll] = "PLL",
+  [boot_phase_registers] = "REGISTERS",
+  [boot_phase_startup] = "STARTUP",
+};
+
+void
+boot_timing_init()
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void
+boot_timing_mark(boot_phase phase)
+{
+  /* the counter overflows after 25 s, long before that boot is done */
+  boot_marks[phase] = DWT->CYCCNT;
+}
+
+uint32_t
+boot_timing_get(boot_phase phase)
+{
+  return boot_marks[phase] / (CORE_CLOCK_SPEED / 1000000);
+}
+
+const char*
+boot_phase_name(boot_phase phase)
+{
+  return boot_phase_names[phase];
+}
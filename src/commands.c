@@ -3,14 +3,42 @@
 #include "ad9910.h"
 #include "crc.h"
 #include "eeprom.h"
+#include "ethernet.h"
+#include "events.h"
 #include "gpio.h"
+#include "ramp.h"
+#include "scpi.h"
+#include "store.h"
 #include "timing.h"
+#include "util.h"
 
+#include <misc.h>
+#include <stm32f4xx_exti.h>
+#include <stm32f4xx_rcc.h>
+#include <stm32f4xx_syscfg.h>
+#include <stm32f4xx_tim.h>
 #include <string.h>
 
 uint8_t command_execute_flag = 0;
 
-#define STARTUP_EEPROM eeprom_block0
+#define STARTUP_KEY "startup"
+/* stored sequences are saved as this prefix followed by their name */
+#define SEQUENCE_KEY_PREFIX "seq:"
+/* location of the startup sequence before the store */
+#define STARTUP_LEGACY_EEPROM eeprom_block0
+
+/* times the waits of a running sequence, 32 bit with 1 MHz */
+#define COMMAND_TIMER TIM5
+#define COMMAND_TIMER_IRQn TIM5_IRQn
+#define COMMAND_TIMER_RATE 1000000
+/* the trigger input is IO_UPDATE on PD11, a falling edge on its EXTI line
+ * ends a trigger wait */
+#define COMMAND_TRIGGER_LINE EXTI_Line11
+/* a sequence which doesn't wait gives way to the main loop at the next
+ * repeat or jump once it kept the interrupt for this many cycles, and
+ * continues after COMMAND_YIELD_TICKS */
+#define COMMAND_SLICE_CYCLES (CORE_CLOCK_SPEED / 1000 * 10)
+#define COMMAND_YIELD_TICKS 1000
 
 /* these registers are used to keep track of the necessary changes while
  * programming the DDS. This is necessary because some changes depend on
@@ -20,27 +48,103 @@ ad9910_registers command_regs;
 
 struct command_queue
 {
-  void* const begin;
+  void* begin;
   void* end; /* ptr behind the last used byte */
   uint32_t repeat;
 };
 
+/* the queues of all sequences are stored back to back in commands_buf in
+ * the order of their slots. Unused slots have an empty queue at the end of
+ * the previous slot. */
+struct command_slot
+{
+  char name[COMMAND_NAME_LENGTH + 1]; /* empty if the slot is unused */
+  struct command_queue queue;
+};
+
 static char commands_buf[COMMAND_QUEUE_LENGTH];
 
-static struct command_queue commands = {
-  .begin = commands_buf,
-  .end = commands_buf,
-  .repeat = 0,
+static struct command_slot slots[COMMAND_SLOTS] = {
+  [0] = {.name = COMMAND_DEFAULT_NAME,
+         .queue = {.begin = commands_buf, .end = commands_buf } },
+  [1 ... COMMAND_SLOTS - 1] = {.queue = {.begin = commands_buf,
+                                         .end = commands_buf } },
 };
 
+/* sequence changed by the commands */
+static struct command_slot* current = slots;
+/* position in the selected sequence where new commands are inserted,
+ * negative to append them */
+static ptrdiff_t insert_offset = -1;
+/* sequence run by the next commands_execute, the selected one if NULL */
+static struct command_slot* execute_slot = NULL;
+
 static uint32_t update_registers = 0;
 
-static void execute_commands(struct command_queue*);
+/* position in the sequence which is run. The sequencer interrupt executes
+ * the commands up to the next wait and continues when its timer expires or
+ * the trigger edge arrives, the network is handled in between. Playbacks
+ * run inside the interrupt and check for an abort after every pass, ramp
+ * chains run to their end or timeout */
+static struct
+{
+  const struct command_queue* queue;
+  uint32_t pos;
+  uint32_t cycle; /* repeats of the queue already finished */
+  /* return offset and remaining iterations of loops and calls */
+  struct
+  {
+    uint32_t ret;
+    uint32_t remaining;
+  } stack[COMMAND_STACK_DEPTH];
+  size_t depth;
+  uint32_t steps; /* commands executed since the start */
+  uint32_t wait;  /* ms of the current wait command */
+  uint64_t ticks; /* of the current wait which are left */
+  int trigger;    /* the trigger input is configured */
+  uint32_t slice; /* cycle counter when the interrupt took over */
+} run;
+
+static volatile enum command_run_state run_state = command_run_idle;
+static volatile int run_abort = 0;
+/* set by the edge interrupt of the trigger input */
+static volatile int trigger_seen = 0;
+
+/* stop request of the playbacks in the running sequence and the result of
+ * the last playback */
+static volatile int parallel_stop = 0;
+static volatile int parallel_stopped = 0;
+
+static void execute_commands(const struct command_queue*);
+static void command_run_begin(const struct command_queue*);
+static enum command_run_state command_run_continue(void);
+static int command_run_slice_over(void);
+static int command_wait_trigger(void);
+static void command_trigger_arm(int);
+static void command_run_finish(void);
+static void command_timer_start(void);
+static int command_parallel_stop_requested(void);
+static void command_poll_stop(void);
+static int command_abort_requested(void);
+static int command_queue_link(struct command_queue*);
+static int command_slot_resize(struct command_slot*, ptrdiff_t);
+static struct command_slot* command_find_slot(const char*, size_t);
 static size_t execute_command_register_only(const command_register*);
+static size_t execute_command_register_add_only(const command_register_add*);
+static size_t execute_command_register_scale_only(
+  const command_register_scale*);
+static void command_register_add_apply(const command_register_add*);
+static void command_register_scale_apply(const command_register_scale*);
+static int command_queue_register_write(command_type, const void*, size_t);
 static size_t execute_command_spi_write(const command_spi_write*);
 static int command_queue(command_type, const void*, size_t);
 static size_t get_command_length(const command*);
-static const command* find_last_command(void);
+static const command* find_command_before(size_t offset);
+static int command_is_register_write(const command*);
+static const void* startup_command_get_legacy(size_t*);
+static int command_slot_splice(struct command_slot*, size_t, ptrdiff_t);
+static size_t command_insert_offset(void);
+static ptrdiff_t command_step_offset(size_t);
 
 #define DEFINE_COMMAND_QUEUE_IMPL(cmd, size)                                   \
   int command_queue_##cmd(const command_##cmd* command)                        \
@@ -58,19 +162,58 @@ DEFINE_COMMAND_QUEUE_VOID(update)
 DEFINE_COMMAND_QUEUE(wait)
 DEFINE_COMMAND_QUEUE(parallel)
 DEFINE_COMMAND_QUEUE(parallel_frequency)
+DEFINE_COMMAND_QUEUE(parallel_external)
+DEFINE_COMMAND_QUEUE_VOID(ramp_chain)
+DEFINE_COMMAND_QUEUE(loop)
+DEFINE_COMMAND_QUEUE_VOID(loop_end)
+DEFINE_COMMAND_QUEUE(sub)
+DEFINE_COMMAND_QUEUE_VOID(return)
+DEFINE_COMMAND_QUEUE(call)
+DEFINE_COMMAND_QUEUE(if)
+DEFINE_COMMAND_QUEUE(else)
+DEFINE_COMMAND_QUEUE_VOID(endif)
+DEFINE_COMMAND_QUEUE(jump)
 
 int
 command_queue_register(const command_register* cmd)
+{
+  return command_queue_register_write(command_type_register, cmd,
+                                      sizeof(command_register));
+}
+
+int
+command_queue_register_add(const command_register_add* cmd)
+{
+  return command_queue_register_write(command_type_register_add, cmd,
+                                      sizeof(command_register_add));
+}
+
+int
+command_queue_register_scale(const command_register_scale* cmd)
+{
+  return command_queue_register_write(command_type_register_scale, cmd,
+                                      sizeof(command_register_scale));
+}
+
+/* queues a command changing a register followed by the spi write
+ * transferring all changed registers to the DDS */
+static int
+command_queue_register_write(command_type type, const void* cmd,
+                             size_t cmd_len)
 {
   /* if the last command was a spi write we remove that because we have
    * more registers to change */
-  const command* last = find_last_command();
+  const size_t offset = command_insert_offset();
+  const command* last = find_command_before(offset);
   if (last != NULL && last->type == command_type_spi_write) {
-    commands.end -= sizeof(command);
+    command_slot_splice(current, offset - sizeof(command),
+                        -(ptrdiff_t)sizeof(command));
+    if (insert_offset >= 0) {
+      insert_offset -= sizeof(command);
+    }
   }
 
-  size_t ret =
-    command_queue(command_type_register, cmd, sizeof(command_register));
+  size_t ret = command_queue(type, cmd, cmd_len);
   ret += command_queue(command_type_spi_write, cmd, 0);
 
   return ret;
@@ -80,18 +223,211 @@ static int
 command_queue(command_type type, const void* cmd, size_t cmd_len)
 {
   const size_t len = sizeof(command) + cmd_len;
+  const size_t offset = command_insert_offset();
 
   /* check if enough memory is left in the queue */
-  if (commands.end - (void*)commands.begin + len > COMMAND_QUEUE_LENGTH) {
+  if (command_slot_splice(current, offset, len)) {
     return 1;
   }
 
-  command* header = commands.end;
+  command* header = current->queue.begin + offset;
   header->type = type;
-  commands.end += sizeof(command);
+  memcpy(header + 1, cmd, cmd_len);
+
+  if (insert_offset >= 0) {
+    insert_offset += len;
+  }
+
+  return 0;
+}
+
+static size_t
+command_insert_offset()
+{
+  return insert_offset >= 0 ? (size_t)insert_offset
+                            : (size_t)(current->queue.end - current->queue.begin);
+}
+
+/* inserts delta bytes at offset into the queue of the slot or removes
+ * -delta bytes there */
+static int
+command_slot_splice(struct command_slot* slot, size_t offset, ptrdiff_t delta)
+{
+  void* const pos = slot->queue.begin + offset;
+  const size_t tail = slot->queue.end - pos;
+
+  if (delta > 0) {
+    if (command_slot_resize(slot, delta)) {
+      return 1;
+    }
+    memmove(pos + delta, pos, tail);
+  } else {
+    memmove(pos, pos - delta, tail + delta);
+    command_slot_resize(slot, delta);
+  }
+
+  return 0;
+}
+
+/* grows or shrinks the queue of the slot at its end and moves the queues of
+ * the following slots accordingly */
+static int
+command_slot_resize(struct command_slot* slot, ptrdiff_t delta)
+{
+  struct command_slot* const last = slots + COMMAND_SLOTS - 1;
+  void* const used_end = last->queue.end;
+
+  if (used_end + delta > (void*)commands_buf + COMMAND_QUEUE_LENGTH) {
+    return 1;
+  }
+
+  memmove(slot->queue.end + delta, slot->queue.end,
+          used_end - slot->queue.end);
+  slot->queue.end += delta;
+
+  for (struct command_slot* s = slot + 1; s <= last; ++s) {
+    s->queue.begin += delta;
+    s->queue.end += delta;
+  }
+
+  return 0;
+}
+
+static struct command_slot*
+command_find_slot(const char* name, size_t len)
+{
+  if (len == 0 || len > COMMAND_NAME_LENGTH) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < COMMAND_SLOTS; ++i) {
+    if (strncmp(slots[i].name, name, len) == 0 && slots[i].name[len] == 0) {
+      return slots + i;
+    }
+  }
+
+  return NULL;
+}
+
+int
+commands_select(const char* name, size_t len)
+{
+  struct command_slot* slot = command_find_slot(name, len);
+
+  if (slot == NULL) {
+    if (len == 0 || len > COMMAND_NAME_LENGTH) {
+      return 1;
+    }
+
+    for (size_t i = 0; i < COMMAND_SLOTS && slot == NULL; ++i) {
+      if (slots[i].name[0] == 0) {
+        slot = slots + i;
+      }
+    }
+
+    if (slot == NULL) {
+      return 1;
+    }
+
+    memcpy(slot->name, name, len);
+    slot->name[len] = 0;
+    slot->queue.repeat = 0;
+  }
+
+  current = slot;
+  insert_offset = -1;
+
+  return 0;
+}
+
+const char*
+commands_get_selected()
+{
+  return current->name;
+}
+
+int
+commands_delete(const char* name, size_t len)
+{
+  struct command_slot* slot = command_find_slot(name, len);
+  if (slot == NULL) {
+    return 1;
+  }
+
+  command_slot_resize(slot, slot->queue.begin - slot->queue.end);
+  slot->queue.repeat = 0;
+
+  if (slot != slots) {
+    slot->name[0] = 0;
+  }
+
+  if (current == slot) {
+    current = slots;
+    insert_offset = -1;
+  }
+  if (execute_slot == slot) {
+    execute_slot = NULL;
+  }
+
+  return 0;
+}
+
+int
+commands_get_slot(size_t i, const char** name, size_t* size)
+{
+  if (i >= COMMAND_SLOTS || slots[i].name[0] == 0) {
+    return 1;
+  }
+
+  *name = slots[i].name;
+  *size = slots[i].queue.end - slots[i].queue.begin;
+
+  return 0;
+}
+
+int
+commands_execute_select(const char* name, size_t len)
+{
+  execute_slot = command_find_slot(name, len);
+
+  return execute_slot == NULL;
+}
+
+int
+commands_save()
+{
+  if (command_queue_link(&current->queue)) {
+    return 1;
+  }
+
+  char key[STORE_KEY_LENGTH] = SEQUENCE_KEY_PREFIX;
+  strncat(key, current->name, COMMAND_NAME_LENGTH);
+
+  return store_put(key, current->queue.begin,
+                   current->queue.end - current->queue.begin);
+}
+
+int
+commands_load(const char* name, size_t len)
+{
+  if (len == 0 || len > COMMAND_NAME_LENGTH) {
+    return 1;
+  }
 
-  memcpy(commands.end, cmd, cmd_len);
-  commands.end += cmd_len;
+  char key[STORE_KEY_LENGTH] = SEQUENCE_KEY_PREFIX;
+  strncat(key, name, len);
+
+  size_t size;
+  const void* data = store_get(key, &size);
+  if (data == NULL || commands_select(name, len)) {
+    return 1;
+  }
+
+  commands_clear();
+  if (command_slot_resize(current, size)) {
+    return 1;
+  }
+  memcpy(current->queue.begin, data, size);
 
   return 0;
 }
@@ -99,41 +435,677 @@ command_queue(command_type type, const void* cmd, size_t cmd_len)
 void
 commands_clear()
 {
-  commands.end = commands.begin;
+  command_slot_resize(current, current->queue.begin - current->queue.end);
+  insert_offset = -1;
+}
+
+/* steps are the commands of a sequence without the spi writes, which are
+ * added automatically behind register changes */
+static ptrdiff_t
+command_step_offset(size_t n)
+{
+  const void* const begin = current->queue.begin;
+  const void* const end = current->queue.end;
+
+  for (const void* cur = begin; cur < end; cur += get_command_length(cur)) {
+    if (((const command*)cur)->type == command_type_spi_write) {
+      continue;
+    }
+    if (n-- == 0) {
+      return cur - begin;
+    }
+  }
+
+  return n == 0 ? end - begin : -1;
+}
+
+size_t
+commands_step_count()
+{
+  size_t count = 0;
+  for (const void* cur = current->queue.begin; cur < current->queue.end;
+       cur += get_command_length(cur)) {
+    count += ((const command*)cur)->type != command_type_spi_write;
+  }
+
+  return count;
+}
+
+int
+commands_step_delete(size_t n)
+{
+  const ptrdiff_t offset = command_step_offset(n);
+  if (offset < 0 || current->queue.begin + offset == current->queue.end) {
+    return 1;
+  }
+
+  const command* cmd = current->queue.begin + offset;
+  size_t len = get_command_length(cmd);
+
+  /* a register change which was written alone takes its spi write along,
+   * whatever command precedes it */
+  const command* prev = find_command_before(offset);
+  const command* next = (const void*)cmd + len;
+  if (command_is_register_write(cmd) &&
+      (prev == NULL || !command_is_register_write(prev)) &&
+      (void*)next < current->queue.end &&
+      next->type == command_type_spi_write) {
+    len += sizeof(command);
+  }
+
+  command_slot_splice(current, offset, -(ptrdiff_t)len);
+
+  if (insert_offset > offset) {
+    insert_offset = max(insert_offset - (ptrdiff_t)len, offset);
+  }
+
+  return 0;
+}
+
+int
+commands_step_insert(size_t n)
+{
+  const ptrdiff_t offset = command_step_offset(n);
+  if (offset < 0) {
+    return 1;
+  }
+
+  insert_offset = offset;
+
+  return 0;
+}
+
+int
+commands_step_replace(size_t n)
+{
+  if (commands_step_delete(n)) {
+    return 1;
+  }
+
+  return commands_step_insert(n);
+}
+
+void
+commands_step_append()
+{
+  insert_offset = -1;
 }
 
 void
 commands_repeat(uint32_t count)
 {
-  commands.repeat = count;
+  current->queue.repeat = count;
 }
 
 uint32_t
 get_commands_repeat()
 {
-  return commands.repeat;
+  return current->queue.repeat;
+}
+
+void
+commands_init()
+{
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+
+  /* the timer clock runs with half the processor speed */
+  TIM_TimeBaseInitTypeDef timer_init = {
+    .TIM_Prescaler = CORE_CLOCK_SPEED / 2 / COMMAND_TIMER_RATE - 1,
+    .TIM_CounterMode = TIM_CounterMode_Up,
+    .TIM_Period = 1,
+    .TIM_ClockDivision = TIM_CKD_DIV1,
+    .TIM_RepetitionCounter = 0
+  };
+
+  TIM_DeInit(COMMAND_TIMER);
+  TIM_TimeBaseInit(COMMAND_TIMER, &timer_init);
+  TIM_SelectOnePulseMode(COMMAND_TIMER, TIM_OPMode_Single);
+  TIM_ClearITPendingBit(COMMAND_TIMER, TIM_IT_Update);
+  TIM_ITConfig(COMMAND_TIMER, TIM_IT_Update, ENABLE);
+
+  /* the commands rely on the SysTick and the DMA interrupts, so the
+   * sequencer runs below them but above the network */
+  NVIC_InitTypeDef nvic_init = {
+    .NVIC_IRQChannel = COMMAND_TIMER_IRQn,
+    .NVIC_IRQChannelPreemptionPriority = 0x08,
+    .NVIC_IRQChannelSubPriority = 0x00,
+    .NVIC_IRQChannelCmd = ENABLE,
+  };
+  NVIC_Init(&nvic_init);
+
+  /* the trigger edge only has to hand over to the sequencer */
+  nvic_init.NVIC_IRQChannel = EXTI15_10_IRQn;
+  nvic_init.NVIC_IRQChannelPreemptionPriority = 0x00;
+  NVIC_Init(&nvic_init);
 }
 
 void
 commands_execute()
 {
-  execute_commands(&commands);
+  const struct command_slot* slot = execute_slot ? execute_slot : current;
+  execute_slot = NULL;
+
+  if (run_state != command_run_idle) {
+    return;
+  }
+
+  gpio_set_high(LED_FRONT);
+
+  command_run_begin(&slot->queue);
+  run.steps = 0;
+  run_abort = 0;
+  parallel_stop = 0;
+  run_state = command_run_busy;
+
+  /* the sequencer interrupt executes the commands */
+  NVIC_SetPendingIRQ(COMMAND_TIMER_IRQn);
 }
 
+void
+commands_abort()
+{
+  if (run_state == command_run_idle) {
+    return;
+  }
+
+  /* a running wait ends right away, other commands are finished first */
+  run_abort = 1;
+  TIM_Cmd(COMMAND_TIMER, DISABLE);
+  NVIC_SetPendingIRQ(COMMAND_TIMER_IRQn);
+}
+
+int
+commands_running()
+{
+  return run_state != command_run_idle;
+}
+
+void
+commands_parallel_stop()
+{
+  if (run_state != command_run_idle) {
+    parallel_stop = 1;
+  }
+}
+
+int
+commands_parallel_stopped()
+{
+  return parallel_stopped;
+}
+
+/* the playbacks of a sequence always end early on an abort. The receive
+ * descriptors are only scanned in a sequence, a direct playback keeps its
+ * timing between the passes */
+static int
+command_abort_requested()
+{
+  if (run_state == command_run_idle) {
+    return 0;
+  }
+
+  command_poll_stop();
+
+  return run_abort;
+}
+
+/* a SEQuence:ABORt also ends a loop waiting for a PARallel:STOP */
+static int
+command_parallel_stop_requested()
+{
+  command_poll_stop();
+
+  return parallel_stop || run_abort;
+}
+
+/* stops which were handed to lwIP already set the flags from the receive
+ * path. The playbacks keep the main loop and the interrupts off, so the
+ * ones arriving meanwhile are only visible in the receive descriptors */
 static void
-execute_commands(struct command_queue* cmds)
+command_poll_stop()
+{
+  switch (ethernet_stop_pending()) {
+    case scpi_stop_abort:
+      if (run_state != command_run_idle) {
+        run_abort = 1;
+      }
+      parallel_stop = 1;
+      break;
+    case scpi_stop_parallel:
+      parallel_stop = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+void
+commands_status(struct command_status* status)
 {
-  uint32_t i = 0;
+  /* a consistent snapshot between two steps */
+  NVIC_DisableIRQ(COMMAND_TIMER_IRQn);
+
+  status->state = run_state;
+  status->name = "";
+  status->cycle = run.cycle;
+  status->steps = run.steps;
+
+  for (size_t i = 0; i < COMMAND_SLOTS; ++i) {
+    if (run_state != command_run_idle && run.queue == &slots[i].queue) {
+      status->name = slots[i].name;
+    }
+  }
+
+  NVIC_EnableIRQ(COMMAND_TIMER_IRQn);
+}
+
+void
+commands_timer_handler()
+{
+  TIM_ClearITPendingBit(COMMAND_TIMER, TIM_IT_Update);
+
+  if (run_state == command_run_idle) {
+    return;
+  }
+
+  /* long waits take several periods of the timer */
+  if (run_state == command_run_wait && run.ticks > 0 && !run_abort) {
+    command_timer_start();
+    return;
+  }
+
+  run_state = command_run_busy;
+  run.slice = DWT->CYCCNT;
+
+  switch (command_run_continue()) {
+    case command_run_wait:
+      run_state = command_run_wait;
+      run.ticks = (uint64_t)run.wait * (COMMAND_TIMER_RATE / 1000);
+      command_timer_start();
+      break;
+    case command_run_trigger:
+      /* the edge interrupt of the trigger input continues the sequence */
+      run_state = command_run_trigger;
+      break;
+    case command_run_busy:
+      /* the sequence gave way, the main loop runs until the timer
+       * continues it. A stop which can't wait for that ends it here */
+      command_poll_stop();
+      if (!run_abort) {
+        run.ticks = COMMAND_YIELD_TICKS;
+        command_timer_start();
+        break;
+      }
+    /* fall through */
+    default:
+      command_run_finish();
+      break;
+  }
+}
+
+static void
+command_timer_start()
+{
+  /* the update happens when the counter passes the reload value */
+  const uint32_t ticks = min(run.ticks, UINT32_MAX);
+  run.ticks -= ticks;
+
+  TIM_SetCounter(COMMAND_TIMER, 1);
+  TIM_SetAutoreload(COMMAND_TIMER, ticks);
+  TIM_Cmd(COMMAND_TIMER, ENABLE);
+}
+
+int
+commands_link()
+{
+  for (size_t i = 0; i < COMMAND_SLOTS; ++i) {
+    if (slots[i].name[0] != 0 && command_queue_link(&slots[i].queue)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int
+command_queue_link(struct command_queue* queue)
+{
+  char* const begin = queue->begin;
+  const uint32_t end = queue->end - queue->begin;
+
+  /* offsets of the open loop, sub, if and else commands */
+  uint32_t blocks[COMMAND_STACK_DEPTH];
+  size_t depth = 0;
+
+  for (uint32_t pos = 0; pos < end;) {
+    command* cmd = (command*)(begin + pos);
+    const uint32_t next = pos + get_command_length(cmd);
+    command* open = depth ? (command*)(begin + blocks[depth - 1]) : NULL;
+
+    switch (cmd->type) {
+      default:
+        break;
+      case command_type_sub:
+        if (depth != 0) {
+          return 1;
+        }
+      /* fall through */
+      case command_type_loop:
+      case command_type_if:
+        if (depth == COMMAND_STACK_DEPTH) {
+          return 1;
+        }
+        blocks[depth++] = pos;
+        break;
+      case command_type_loop_end:
+        if (open == NULL || open->type != command_type_loop) {
+          return 1;
+        }
+        ((command_loop*)(open + 1))->end = next;
+        depth--;
+        break;
+      case command_type_return:
+        if (open == NULL || open->type != command_type_sub) {
+          return 1;
+        }
+        ((command_sub*)(open + 1))->end = next;
+        depth--;
+        break;
+      case command_type_else:
+        if (open == NULL || open->type != command_type_if) {
+          return 1;
+        }
+        /* the else replaces the if as open block */
+        ((command_if*)(open + 1))->next = next;
+        blocks[depth - 1] = pos;
+        break;
+      case command_type_jump: {
+        const command_jump* jump = (const command_jump*)(cmd + 1);
+        if (command_find_slot(jump->name, strlen(jump->name)) == NULL) {
+          return 1;
+        }
+        break;
+      }
+      case command_type_endif:
+        if (open != NULL && open->type == command_type_if) {
+          ((command_if*)(open + 1))->next = next;
+        } else if (open != NULL && open->type == command_type_else) {
+          ((command_else*)(open + 1))->end = next;
+        } else {
+          return 1;
+        }
+        depth--;
+        break;
+    }
 
+    pos = next;
+  }
+
+  if (depth != 0) {
+    return 1;
+  }
+
+  /* subroutines may be called before they are defined, resolve the calls
+   * once all of them are known */
+  for (uint32_t pos = 0; pos < end; pos += get_command_length(
+                                      (const command*)(begin + pos))) {
+    command* cmd = (command*)(begin + pos);
+    if (cmd->type != command_type_call) {
+      continue;
+    }
+
+    command_call* call = (command_call*)(cmd + 1);
+    call->target = end;
+
+    for (uint32_t sub = 0; sub < end; sub += get_command_length(
+                                        (const command*)(begin + sub))) {
+      const command* def = (const command*)(begin + sub);
+      if (def->type == command_type_sub &&
+          ((const command_sub*)(def + 1))->id == call->id) {
+        call->target = sub + get_command_length(def);
+        break;
+      }
+    }
+
+    if (call->target == end) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* runs the queue to the end in the foreground, used before the network
+ * is up */
+static void
+execute_commands(const struct command_queue* cmds)
+{
   gpio_set_high(LED_FRONT);
 
-  do { /* repeat loop */
-    void* cur = cmds->begin;
+  command_run_begin(cmds);
 
-    while (cur < cmds->end) {
-      cur += execute_command(cur);
+  enum command_run_state state;
+  while ((state = command_run_continue()) != command_run_idle) {
+    if (state == command_run_wait) {
+      delay(run.wait);
+    }
+  }
+
+  command_run_finish();
+}
+
+static void
+command_run_begin(const struct command_queue* cmds)
+{
+  run.queue = cmds;
+  run.pos = 0;
+  run.cycle = 0;
+  run.depth = 0;
+}
+
+/* executes the commands of the running sequence until it has to wait,
+ * returns command_run_idle once it is finished or aborted. A jump ends the
+ * sequence and continues with the repeats of the target sequence. The
+ * sequence is also ended if the loops or calls are nested too deep.
+ * command_run_busy is returned at a repeat or jump once the time slice is
+ * used up, so endless sequences without waits don't block the network */
+static enum command_run_state
+command_run_continue()
+{
+  for (;;) {
+    if (run_abort) {
+      return command_run_idle;
     }
-  } while (i++ < cmds->repeat);
+
+    const char* const begin = run.queue->begin;
+    const uint32_t end = run.queue->end - run.queue->begin;
+
+    if (run.pos >= end) {
+      if (run.cycle++ < run.queue->repeat) {
+        run.pos = 0;
+        run.depth = 0;
+        if (command_run_slice_over()) {
+          return command_run_busy;
+        }
+        continue;
+      }
+      return command_run_idle;
+    }
+
+    const command* cmd = (const command*)(begin + run.pos);
+    const void* args = cmd + 1;
+
+    switch (cmd->type) {
+      default:
+        run.pos += execute_command(cmd);
+        run.steps++;
+        break;
+      case command_type_wait:
+        run.wait = ((const command_wait*)args)->delay;
+        run.pos += sizeof(command) + sizeof(command_wait);
+        run.steps++;
+        if (run.wait > 0) {
+          return command_run_wait;
+        }
+        break;
+      case command_type_trigger:
+        if (command_wait_trigger()) {
+          return command_run_trigger;
+        }
+        run.pos += sizeof(command);
+        run.steps++;
+        break;
+      case command_type_loop: {
+        const command_loop* loop = args;
+        const uint32_t next = run.pos + sizeof(command) + sizeof(command_loop);
+        if (loop->count == 0) {
+          run.pos = loop->end;
+        } else if (run.depth == COMMAND_STACK_DEPTH) {
+          return command_run_idle;
+        } else {
+          run.stack[run.depth].ret = next;
+          run.stack[run.depth].remaining = loop->count;
+          run.depth++;
+          run.pos = next;
+        }
+        break;
+      }
+      case command_type_loop_end:
+        if (run.depth == 0) {
+          return command_run_idle;
+        }
+        if (--run.stack[run.depth - 1].remaining) {
+          run.pos = run.stack[run.depth - 1].ret;
+        } else {
+          run.depth--;
+          run.pos += sizeof(command);
+        }
+        break;
+      case command_type_sub:
+        /* subroutines are only entered by calls */
+        run.pos = ((const command_sub*)args)->end;
+        break;
+      case command_type_call:
+        if (run.depth == COMMAND_STACK_DEPTH) {
+          return command_run_idle;
+        }
+        run.stack[run.depth].ret =
+          run.pos + sizeof(command) + sizeof(command_call);
+        run.stack[run.depth].remaining = 0;
+        run.depth++;
+        run.pos = ((const command_call*)args)->target;
+        break;
+      case command_type_return:
+        if (run.depth == 0) {
+          return command_run_idle;
+        }
+        run.pos = run.stack[--run.depth].ret;
+        break;
+      case command_type_if: {
+        const command_if* branch = args;
+        if (gpio_get(branch->pin) == branch->level) {
+          run.pos += sizeof(command) + sizeof(command_if);
+        } else {
+          run.pos = branch->next;
+        }
+        break;
+      }
+      case command_type_else:
+        /* reached at the end of the taken branch */
+        run.pos = ((const command_else*)args)->end;
+        break;
+      case command_type_jump: {
+        const command_jump* jump = args;
+        const struct command_slot* slot =
+          command_find_slot(jump->name, strlen(jump->name));
+        if (slot == NULL) {
+          return command_run_idle;
+        }
+        command_run_begin(&slot->queue);
+        if (command_run_slice_over()) {
+          return command_run_busy;
+        }
+        break;
+      }
+    }
+  }
+}
+
+/* the cycle counter also advances while the playbacks keep the SysTick
+ * off */
+static int
+command_run_slice_over()
+{
+  return DWT->CYCCNT - run.slice >= COMMAND_SLICE_CYCLES;
+}
+
+/* waits for a pulse on the trigger input like execute_command_trigger
+ * without blocking the sequencer interrupt. The first call arms the edge
+ * interrupt and returns 1, the falling edge at the end of the pulse
+ * continues the sequence and the next call returns 0 */
+static int
+command_wait_trigger()
+{
+  if (!run.trigger) {
+    command_trigger_arm(1);
+  }
+
+  /* the pending bit covers the foreground run at startup */
+  if (!trigger_seen && !(EXTI->PR & COMMAND_TRIGGER_LINE)) {
+    return 1;
+  }
+
+  command_trigger_arm(0);
+
+  return 0;
+}
+
+static void
+command_trigger_arm(int enable)
+{
+  if (enable) {
+    gpio_set_pin_mode_input(IO_UPDATE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+    SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOD, EXTI_PinSource11);
+  }
+
+  trigger_seen = 0;
+  run.trigger = enable;
+
+  /* the playback uses the rising edge of the same line, so only the
+   * falling edge is touched */
+  if (enable) {
+    EXTI->FTSR |= COMMAND_TRIGGER_LINE;
+    EXTI->PR = COMMAND_TRIGGER_LINE;
+    EXTI->IMR |= COMMAND_TRIGGER_LINE;
+  } else {
+    EXTI->IMR &= ~COMMAND_TRIGGER_LINE;
+    EXTI->FTSR &= ~COMMAND_TRIGGER_LINE;
+    EXTI->PR = COMMAND_TRIGGER_LINE;
+    gpio_set_pin_mode_output(IO_UPDATE);
+  }
+}
+
+void
+commands_trigger_handler()
+{
+  /* further edges are ignored until the next trigger wait */
+  EXTI->IMR &= ~COMMAND_TRIGGER_LINE;
+  trigger_seen = 1;
+  NVIC_SetPendingIRQ(COMMAND_TIMER_IRQn);
+}
+
+static void
+command_run_finish()
+{
+  if (run.trigger) {
+    command_trigger_arm(0);
+  }
+
+  events_post(run_abort ? event_sequence_aborted : event_sequence_done);
+
+  run_abort = 0;
+  run_state = command_run_idle;
 
   gpio_set_low(LED_FRONT);
 }
@@ -146,6 +1118,14 @@ execute_command(const command* cmd)
     case command_type_register:
       len += execute_command_register_only((const command_register*)(cmd + 1));
       break;
+    case command_type_register_add:
+      len += execute_command_register_add_only(
+        (const command_register_add*)(cmd + 1));
+      break;
+    case command_type_register_scale:
+      len += execute_command_register_scale_only(
+        (const command_register_scale*)(cmd + 1));
+      break;
     case command_type_pin:
       len += execute_command_pin((const command_pin*)(cmd + 1));
       break;
@@ -168,6 +1148,26 @@ execute_command(const command* cmd)
       len += execute_command_parallel_frequency(
         (const command_parallel_frequency*)(cmd + 1));
       break;
+    case command_type_parallel_external:
+      len += execute_command_parallel_external(
+        (const command_parallel_external*)(cmd + 1));
+      break;
+    case command_type_ramp_chain:
+      len += execute_command_ramp_chain((const command_ramp_chain*)(cmd + 1));
+      break;
+    /* control flow needs the position in the queue and is handled by
+     * execute_commands, here it is skipped */
+    case command_type_loop:
+    case command_type_loop_end:
+    case command_type_sub:
+    case command_type_return:
+    case command_type_call:
+    case command_type_if:
+    case command_type_else:
+    case command_type_endif:
+    case command_type_jump:
+      len = get_command_length(cmd);
+      break;
     case command_type_end:
       break;
   }
@@ -195,6 +1195,68 @@ execute_command_register(const command_register* cmd)
   return sizeof(command_register);
 }
 
+size_t
+execute_command_register_add(const command_register_add* cmd)
+{
+  command_register_add_apply(cmd);
+  ad9910_update_matching_reg(*cmd->reg);
+
+  return sizeof(command_register_add);
+}
+
+static size_t
+execute_command_register_add_only(const command_register_add* cmd)
+{
+  command_register_add_apply(cmd);
+
+  update_registers |= (1 << cmd->reg->reg->address);
+
+  return sizeof(command_register_add);
+}
+
+static void
+command_register_add_apply(const command_register_add* cmd)
+{
+  const int64_t limit = ((int64_t)1 << cmd->reg->bits) - 1;
+  int64_t value = ad9910_get_value(*cmd->reg) + (int64_t)cmd->step;
+
+  /* without saturation ad9910_set_value masks the value to the field */
+  if (!cmd->wrap) {
+    value = min(max(value, 0), limit);
+  }
+
+  ad9910_set_value(*cmd->reg, value);
+}
+
+size_t
+execute_command_register_scale(const command_register_scale* cmd)
+{
+  command_register_scale_apply(cmd);
+  ad9910_update_matching_reg(*cmd->reg);
+
+  return sizeof(command_register_scale);
+}
+
+static size_t
+execute_command_register_scale_only(const command_register_scale* cmd)
+{
+  command_register_scale_apply(cmd);
+
+  update_registers |= (1 << cmd->reg->reg->address);
+
+  return sizeof(command_register_scale);
+}
+
+static void
+command_register_scale_apply(const command_register_scale* cmd)
+{
+  const uint64_t limit = ((uint64_t)1 << cmd->reg->bits) - 1;
+  /* fields are at most 32 bit wide, so the product fits into 64 bit */
+  const uint64_t value = (ad9910_get_value(*cmd->reg) * cmd->factor) >> 16;
+
+  ad9910_set_value(*cmd->reg, min(value, limit));
+}
+
 static size_t
 execute_command_spi_write(const command_spi_write* cmd)
 {
@@ -208,6 +1270,11 @@ execute_command_spi_write(const command_spi_write* cmd)
 size_t
 execute_command_pin(const command_pin* cmd)
 {
+  /* the OSK line is left an input until it is used */
+  if (cmd->pin.group == OSK.group && cmd->pin.pin == OSK.pin) {
+    gpio_set_pin_mode_output(OSK);
+  }
+
   gpio_set(cmd->pin, cmd->value);
 
   return sizeof(command_pin);
@@ -246,7 +1313,23 @@ execute_command_update(const command_update* cmd)
 size_t
 execute_command_parallel(const command_parallel* cmd)
 {
-  ad9910_execute_parallel(cmd->data, cmd->length, cmd->repeats);
+  if (cmd->dwell) {
+    parallel_stopped = ad9910_execute_parallel_dwell(
+      (const ad9910_parallel_sample*)cmd->data, cmd->length, cmd->repeats,
+      command_abort_requested);
+  } else {
+    const ad9910_parallel_loop loop = {
+      .begin = cmd->loop_begin,
+      .end = cmd->loop_end,
+      .repeats = cmd->repeats,
+      .stop = cmd->stop,
+      .request = command_parallel_stop_requested,
+      .abort = command_abort_requested,
+    };
+    parallel_stopped =
+      ad9910_execute_parallel_loop(cmd->data, cmd->length, &loop);
+    parallel_stop = 0;
+  }
 
   return sizeof(command_parallel);
 }
@@ -259,57 +1342,101 @@ execute_command_parallel_frequency(const command_parallel_frequency* cmd)
   return sizeof(command_parallel_frequency);
 }
 
+size_t
+execute_command_parallel_external(const command_parallel_external* cmd)
+{
+  ad9910_execute_parallel_external(cmd->address, cmd->length, cmd->repeats,
+                                   command_abort_requested);
+
+  return sizeof(command_parallel_external);
+}
+
+size_t
+execute_command_ramp_chain(const command_ramp_chain* cmd)
+{
+  /* a chain which timed out has stopped, the sequence just goes on */
+  ramp_chain_execute();
+
+  return 0;
+}
+
 void
 startup_command_clear()
 {
-  eeprom_erase(STARTUP_EEPROM);
+  store_delete(STARTUP_KEY);
+  ad9910_clear_registers();
 }
 
 void
 startup_command_execute()
 {
-  uint32_t* crc_saved = eeprom_get(STARTUP_EEPROM, 0);
-  crc_init();
-  uint32_t crc_calc = crc(eeprom_get(STARTUP_EEPROM, sizeof(crc_calc)),
-                          (eeprom_get_size(STARTUP_EEPROM) - sizeof(crc_calc)) /
-                            sizeof(uint32_t));
+  size_t len;
+  const void* data = store_get(STARTUP_KEY, &len);
 
-  /* if the crc check fails we abort */
-  if (crc_calc != *crc_saved) {
-    return;
+  if (data == NULL) {
+    data = startup_command_get_legacy(&len);
   }
 
-  uint32_t* len = eeprom_get(STARTUP_EEPROM, sizeof(crc_saved));
+  if (data == NULL) {
+    return;
+  }
 
-  struct command_queue commands = {
-    .begin = len + 1, .end = ((char*)(len + 1)) + *len, .repeat = 0,
+  const struct command_queue startup = {
+    .begin = (void*)data, .end = (char*)data + len, .repeat = 0,
   };
 
-  execute_commands(&commands);
+  execute_commands(&startup);
 }
 
-void
+int
 startup_command_save()
 {
-  startup_command_clear();
+  /* the offsets are stored with the sequence, so it has to be linked */
+  if (command_queue_link(&current->queue)) {
+    return 1;
+  }
 
-  uint32_t len = commands.end - commands.begin;
+  const struct command_queue* commands = &current->queue;
 
-  uint32_t crcsum;
+  /* only this slot is saved, at boot there is nothing to jump to */
+  for (const char* pos = commands->begin; pos < (char*)commands->end;
+       pos += get_command_length((const command*)pos)) {
+    if (((const command*)pos)->type == command_type_jump) {
+      return 1;
+    }
+  }
 
-  /* write length of the command sequence */
-  eeprom_write(STARTUP_EEPROM, sizeof(crcsum), &len, sizeof(len));
-  /* save command sequence behind it */
-  eeprom_write(STARTUP_EEPROM, sizeof(crcsum) + sizeof(len), commands.begin,
-               len);
+  return store_put(STARTUP_KEY, commands->begin,
+                   commands->end - commands->begin) ||
+         ad9910_save_registers();
+}
 
+/* before the store the startup sequence was saved in a sector on its own:
+ * the crc of the rest of the sector, the length and the sequence. If such
+ * a sequence is found it is moved into the store. */
+static const void*
+startup_command_get_legacy(size_t* len)
+{
+  const uint32_t* crc_saved = eeprom_get(STARTUP_LEGACY_EEPROM, 0);
   crc_init();
-  crcsum =
-    crc(eeprom_get(STARTUP_EEPROM, sizeof(crcsum)),
-        (eeprom_get_size(STARTUP_EEPROM) - sizeof(crcsum)) / sizeof(uint32_t));
+  const uint32_t crc_calc =
+    crc(eeprom_get(STARTUP_LEGACY_EEPROM, sizeof(uint32_t)),
+        (eeprom_get_size(STARTUP_LEGACY_EEPROM) - sizeof(uint32_t)) /
+          sizeof(uint32_t));
 
-  /* save crc at the begining */
-  eeprom_write(STARTUP_EEPROM, 0, &crcsum, sizeof(crcsum));
+  /* if the crc check fails there is no sequence */
+  if (crc_calc != *crc_saved) {
+    return NULL;
+  }
+
+  const uint32_t* legacy_len = eeprom_get(STARTUP_LEGACY_EEPROM, 4);
+  if (store_put(STARTUP_KEY, legacy_len + 1, *legacy_len)) {
+    return NULL;
+  }
+
+  eeprom_erase(STARTUP_LEGACY_EEPROM);
+
+  return store_get(STARTUP_KEY, len);
 }
 
 static size_t
@@ -323,23 +1450,59 @@ get_command_length(const command* cmd)
     case command_type_register:
       len += sizeof(command_register);
       break;
+    case command_type_register_add:
+      len += sizeof(command_register_add);
+      break;
+    case command_type_register_scale:
+      len += sizeof(command_register_scale);
+      break;
     case command_type_pin:
       len += sizeof(command_pin);
       break;
     case command_type_wait:
       len += sizeof(command_wait);
       break;
+    case command_type_parallel:
+      len += sizeof(command_parallel);
+      break;
+    case command_type_parallel_frequency:
+      len += sizeof(command_parallel_frequency);
+      break;
+    case command_type_parallel_external:
+      len += sizeof(command_parallel_external);
+      break;
+    case command_type_loop:
+      len += sizeof(command_loop);
+      break;
+    case command_type_sub:
+      len += sizeof(command_sub);
+      break;
+    case command_type_call:
+      len += sizeof(command_call);
+      break;
+    case command_type_if:
+      len += sizeof(command_if);
+      break;
+    case command_type_else:
+      len += sizeof(command_else);
+      break;
+    case command_type_jump:
+      len += sizeof(command_jump);
+      break;
   }
 
   return len;
 }
 
+/* the command which ends at offset in the selected sequence */
 static const command*
-find_last_command()
+find_command_before(size_t offset)
 {
-  for (const void* cur = commands.begin; cur < commands.end;) {
+  const struct command_queue* commands = &current->queue;
+  const void* const pos = commands->begin + offset;
+  for (const void* cur = commands->begin; cur < pos;) {
     size_t len = get_command_length(cur);
-    if (cur + len == commands.end) {
+    if (cur + len == pos) {
       return cur;
     }
 
@@ -348,3 +1511,12 @@ find_last_command()
 
   return NULL;
 }
+
+/* register changes are grouped in front of the spi write sending them */
+static int
+command_is_register_write(const command* cmd)
+{
+  return cmd->type == command_type_register ||
+         cmd->type == command_type_register_add ||
+         cmd->type == command_type_register_scale;
+}
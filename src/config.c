@@ -2,8 +2,13 @@
 
 #include "crc.h"
 #include "eeprom.h"
+#include "store.h"
 
-#define CONFIG_EEPROM eeprom_block1
+#define CONFIG_KEY "config"
+
+/* before the store the configuration had a sector on its own, the crc of
+ * the configuration followed by it */
+#define CONFIG_LEGACY_EEPROM eeprom_block1
 
 static const struct config default_config = {
   .ethernet =
@@ -14,41 +19,50 @@ static const struct config default_config = {
     },
 };
 
-static uint32_t calculate_config_crc(const struct config*);
+static const struct config* config_get_legacy(void);
 
 const struct config*
 config_get()
 {
-  uint32_t* crc_stored = eeprom_get(CONFIG_EEPROM, 0);
+  size_t len;
+  const struct config* conf = store_get(CONFIG_KEY, &len);
+
+  if (conf != NULL && len == sizeof(struct config)) {
+    return conf;
+  }
 
-  const struct config* conf = eeprom_get(CONFIG_EEPROM, sizeof(uint32_t));
+  /* if there is no valid configuration we take over the one from the old
+   * location or reset it to the default configuration */
+  const struct config* legacy = config_get_legacy();
+  config_write(legacy ? legacy : &default_config);
 
-  uint32_t crc_calc = calculate_config_crc(conf);
+  conf = store_get(CONFIG_KEY, &len);
 
-  /* if the crc check fails we reset the config back to the default
-   * configuration */
-  if (*crc_stored != crc_calc) {
-    config_write(&default_config);
+  /* the old sector is erased once the store has a copy, then it can't be
+   * taken over again */
+  if (legacy != NULL && conf != NULL) {
+    eeprom_erase(CONFIG_LEGACY_EEPROM);
   }
 
-  return conf;
+  return conf != NULL ? conf : &default_config;
 }
 
 void
 config_write(const struct config* conf)
 {
-  eeprom_erase(CONFIG_EEPROM);
-
-  uint32_t crcsum = calculate_config_crc(conf);
-
-  eeprom_write(CONFIG_EEPROM, 0, &crcsum, sizeof(uint32_t));
-  eeprom_write(CONFIG_EEPROM, sizeof(uint32_t), conf, sizeof(struct config));
+  store_put(CONFIG_KEY, conf, sizeof(struct config));
 }
 
-static uint32_t
-calculate_config_crc(const struct config* conf)
+static const struct config*
+config_get_legacy()
 {
+  const uint32_t* crc_stored = eeprom_get(CONFIG_LEGACY_EEPROM, 0);
+  const struct config* conf =
+    eeprom_get(CONFIG_LEGACY_EEPROM, sizeof(uint32_t));
+
   crc_init();
+  const uint32_t crc_calc =
+    crc((const uint32_t*)conf, sizeof(struct config) / sizeof(uint32_t));
 
-  return crc((const uint32_t*)conf, sizeof(struct config) / sizeof(uint32_t));
+  return *crc_stored == crc_calc ? conf : NULL;
 }
@@ -1,13 +1,27 @@
 #include "eeprom.h"
 
+#include <string.h>
+
 int
 eeprom_write(enum eeprom_id id, uint16_t addr, const void* data, size_t len)
 {
   FLASH_Unlock();
-  for (size_t i = 0; i < len; i++) {
+  for (size_t i = 0; i < len;) {
     FLASH_WaitForLastOperation();
-    FLASH_Status status = FLASH_ProgramByte((uint32_t)eeprom_get(id, addr + i),
-                                            ((volatile uint8_t*)data)[i]);
+
+    const uint32_t address = (uint32_t)eeprom_get(id, addr + i);
+    FLASH_Status status;
+
+    /* whole words are programmed at once, which is four times faster */
+    if ((address & 3) == 0 && len - i >= sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, (const uint8_t*)data + i, sizeof(word));
+      status = FLASH_ProgramWord(address, word);
+      i += sizeof(uint32_t);
+    } else {
+      status = FLASH_ProgramByte(address, ((volatile uint8_t*)data)[i]);
+      i++;
+    }
 
     if (status != FLASH_COMPLETE) {
       FLASH_Lock();
@@ -1,10 +1,13 @@
 #include "ethernet.h"
 
+#include "binary.h"
 #include "commands.h"
 #include "config.h"
+#include "events.h"
 #include "gpio.h"
 #include "scpi.h"
 #include "timing.h"
+#include "upload.h"
 #include "util.h"
 
 #include <ctype.h>
@@ -12,15 +15,39 @@
 #include <lwip/stats.h>
 #include <lwip/tcp.h>
 #include <lwip/tcp_impl.h>
+#include <misc.h>
 #include <netif/etharp.h>
 #include <stdlib.h>
 #include <stm32f4x7_eth.h>
 #include <stm32f4xx_rcc.h>
 #include <stm32f4xx_syscfg.h>
 #include <string.h>
+#include <strings.h>
 
 #define DP83848_PHY_ADDRESS 0x01 /* Relative to STM324xG-EVAL Board */
 
+/* From 33500B: 5024 SCPI telnet, 5025 SCPI socket */
+#define SCPI_PORT 5024
+
+/* responses are collected in a buffer of one segment */
+#define ETHERNET_OUTPUT_SIZE TCP_MSS
+
+/* time in ms a response may wait for space in the send buffer before the
+ * connection is aborted, the client stopped reading or disappeared */
+#define ETHERNET_WRITE_TIMEOUT 5000
+
+/* longest message without its binary block. Longer messages are dropped
+ * with an input buffer overrun, before they could close the receive
+ * window, which is only opened again once a message is processed */
+#define ETHERNET_MESSAGE_MAX (4 * TCP_MSS)
+
+/* incomplete input held in this many pbufs is copied into fewer ones, so a
+ * message typed in small segments doesn't use up the pbuf pool */
+#define ETHERNET_COMPACT_PBUFS 4
+
+/* receive descriptor the driver will hand to lwIP next */
+extern __IO ETH_DMADESCTypeDef* DMARxDescToGet;
+
 enum server_states
 {
   ES_NONE = 0,
@@ -31,9 +58,11 @@ enum server_states
 
 enum server_flags
 {
-  ES_ENDOFLINE = 0x01,
+  ES_BLOCK = 0x01,
   ES_DONE = 0x02,
   ES_DATA = 0x04,
+  ES_INPUT = 0x08, /* input arrived which wasn't scanned for messages */
+  ES_DISCARD = 0x10, /* the input up to the next newline is dropped */
 };
 
 /**
@@ -43,26 +72,32 @@ enum server_flags
  */
 struct server_state
 {
+  size_t id; /* of the SCPI context */
   uint8_t state;
   uint8_t flags;
   struct tcp_pcb* pcb;
   struct pbuf* pin;
   size_t pin_offset;
+  /* message currently parsed and the length of its binary block */
+  const char* message;
+  size_t block_length;
   struct pbuf* pout;
+  /* response to the message which is currently processed */
+  char out[ETHERNET_OUTPUT_SIZE];
+  size_t out_len;
   struct binary_data* binary_target;
   uint32_t last_activity;
 };
 
-static struct server_state es = {
-  .state = ES_NONE,
-  .flags = 0,
-  .pcb = NULL,
-  .pin = NULL,
-  .pin_offset = 0,
-  .pout = NULL,
-  .binary_target = NULL,
-  .last_activity = 0,
-};
+static struct server_state connections[ETHERNET_CONNECTIONS];
+
+/* connection whose message is processed, responses and binary blocks
+ * belong to it */
+static struct server_state* current = NULL;
+
+/* set by the receive interrupt, the frames are handed to lwIP in the main
+ * loop because lwIP can't be called from interrupts */
+static volatile int rx_pending = 1;
 
 static struct netif gnetif;
 static struct tcp_pcb* g_pcb;
@@ -74,8 +109,22 @@ static void ethernet_link_callback(struct netif*);
 static void lwip_init(void);
 static void lwip_periodic_handle(uint32_t localtime);
 
-static void ethernet_clear_packet(void);
-static void ethernet_next_packet(void);
+static void ethernet_clear_packet(struct server_state*);
+static void ethernet_poll(void);
+static void ethernet_sleep(void);
+static int ethernet_wait_data(struct server_state*);
+static void ethernet_consume(struct server_state*, size_t len);
+static size_t ethernet_find_message(struct server_state*);
+static int ethernet_skip_line(struct server_state*);
+static void ethernet_compact(struct server_state*);
+static int ethernet_block_header(struct server_state*, size_t offset);
+static int ethernet_is_query(const struct server_state*, size_t len);
+static int ethernet_is_abort(const struct server_state*, size_t len);
+static int ethernet_process_message(struct server_state*, int queries);
+static err_t ethernet_write(struct server_state*, const char* data,
+                            size_t len, u8_t flags);
+static void ethernet_flush(struct server_state*);
+static void ethernet_receive_stop(struct pbuf*);
 
 static int server_init(void);
 static err_t server_accept_callback(void* arg, struct tcp_pcb* newpcb,
@@ -85,8 +134,10 @@ static err_t server_recv_callback(void* arg, struct tcp_pcb* pcb,
 static void server_err_callback(void* arg, err_t err);
 static err_t server_poll_callback(void* arg, struct tcp_pcb* pcb);
 static err_t server_sent_callback(void* arg, struct tcp_pcb* pcb, u16_t len);
-static void server_send(struct tcp_pcb* tpcb);
-static void server_connection_close(struct tcp_pcb* pcb);
+static void server_send(struct server_state*, struct tcp_pcb* tpcb);
+static void server_connection_close(struct server_state*,
+                                    struct tcp_pcb* pcb);
+static void server_reset(struct server_state*);
 
 void
 ethernet_init()
@@ -105,6 +156,12 @@ ethernet_init()
 
   server_init();
 
+  binary_init();
+
+  upload_init();
+
+  events_init();
+
   scpi_init();
 }
 
@@ -150,9 +207,10 @@ ethernet_gpio_init()
 }
 
 err_t
-ethernet_queue(const char* data, uint16_t length)
+ethernet_copy_queue(const char* data, uint16_t length)
 {
-  if (es.pcb == NULL) {
+  struct server_state* es = current;
+  if (es == NULL || es->pcb == NULL) {
     return 0;
   }
 
@@ -160,122 +218,518 @@ ethernet_queue(const char* data, uint16_t length)
     length = strlen(data);
   }
 
-  return tcp_write(es.pcb, data, length, 0);
+  /* the fragments of a response are collected and sent together once the
+   * message is processed */
+  while (length > 0) {
+    if (es->out_len == sizeof(es->out)) {
+      const err_t err = ethernet_write(
+        es, es->out, es->out_len, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+      es->out_len = 0;
+      if (err != ERR_OK) {
+        return err;
+      }
+    }
+
+    const size_t n = min(length, sizeof(es->out) - es->out_len);
+    memcpy(es->out + es->out_len, data, n);
+    es->out_len += n;
+    data += n;
+    length -= n;
+  }
+
+  return ERR_OK;
 }
 
-err_t
-ethernet_copy_queue(const char* data, uint16_t length)
+/* hands data to lwIP. If the send buffer is full the data which was
+ * already queued is sent and acknowledged first, so large responses don't
+ * get lost. If that doesn't make progress for ETHERNET_WRITE_TIMEOUT the
+ * connection is aborted */
+static err_t
+ethernet_write(struct server_state* es, const char* data, size_t len,
+               u8_t flags)
 {
-  if (es.pcb == NULL) {
-    return 0;
+  uint32_t progress = LocalTime;
+
+  while (len > 0) {
+    if (es->pcb == NULL) {
+      return ERR_CONN;
+    }
+
+    const size_t n = min(len, tcp_sndbuf(es->pcb));
+    const err_t err = n > 0 ? tcp_write(es->pcb, data, n, flags) : ERR_MEM;
+
+    if (err == ERR_MEM) {
+      if (LocalTime - progress > ETHERNET_WRITE_TIMEOUT) {
+        /* the error callback resets the connection */
+        tcp_abort(es->pcb);
+        return ERR_ABRT;
+      }
+
+      tcp_output(es->pcb);
+      ethernet_sleep();
+      ethernet_poll();
+      continue;
+    }
+
+    if (err != ERR_OK) {
+      return err;
+    }
+
+    data += n;
+    len -= n;
+    progress = LocalTime;
   }
 
-  if (length == 0) {
-    length = strlen(data);
+  return ERR_OK;
+}
+
+/* sends the collected response right away instead of waiting for the next
+ * lwIP timer */
+static void
+ethernet_flush(struct server_state* es)
+{
+  if (es->pcb == NULL) {
+    es->out_len = 0;
+    return;
+  }
+
+  if (es->out_len > 0) {
+    ethernet_write(es, es->out, es->out_len, TCP_WRITE_FLAG_COPY);
+    es->out_len = 0;
   }
 
-  return tcp_write(es.pcb, data, length, TCP_WRITE_FLAG_COPY);
+  if (es->pcb != NULL) {
+    tcp_output(es->pcb);
+  }
 }
 
-size_t
-ethernet_copy_data(void* dest, size_t len, size_t offset)
+int
+ethernet_receive_block(const char* start, size_t len, ethernet_sink sink,
+                       void* arg)
 {
+  struct server_state* es = current;
+
+  /* the message is only consumed after it was parsed, so the block starts
+   * at the same offset from the current input position */
+  ethernet_consume(es, start - es->message);
+
+  es->flags |= ES_BLOCK;
+
+  int err = 0;
   size_t i = 0;
   while (i < len) {
-    size_t copy_len = min(es.pin->len - offset, len - i);
-    memcpy(dest + i, es.pin->payload + offset, copy_len);
-    i += copy_len;
-    offset = 0;
-    if (i < len) {
-      ethernet_next_packet();
+    /* the client disconnected before sending the whole block */
+    if (ethernet_wait_data(es)) {
+      return 1;
     }
+
+    const size_t n = min(es->pin->len - es->pin_offset, len - i);
+    if (!err) {
+      err = sink((const char*)es->pin->payload + es->pin_offset, n, i, arg);
+    }
+    i += n;
+
+    ethernet_consume(es, n);
   }
 
-  return i;
+  return err;
+}
+
+static int
+ethernet_copy_sink(const void* data, size_t len, size_t offset, void* dest)
+{
+  memcpy((char*)dest + offset, data, len);
+
+  return 0;
+}
+
+int
+ethernet_copy_data(void* dest, size_t len, const char* start)
+{
+  return ethernet_receive_block(start, len, ethernet_copy_sink, dest);
+}
+
+/* looks at the frames the DMA already received without handing them to
+ * lwIP, only the first segment of a message is checked */
+enum scpi_stop
+ethernet_stop_pending()
+{
+  __IO ETH_DMADESCTypeDef* desc = DMARxDescToGet;
+  for (int i = 0; i < ETH_RXBUFNB; ++i) {
+    const uint32_t status = desc->Status;
+    if (status & ETH_DMARxDesc_OWN) {
+      break;
+    }
+
+    const uint8_t* frame = (const uint8_t*)desc->Buffer1Addr;
+    desc = (__IO ETH_DMADESCTypeDef*)desc->Buffer2NextDescAddr;
+
+    /* only check the first segment of IPv4 TCP frames */
+    if (!(status & ETH_DMARxDesc_FS) || frame[12] != 0x08 ||
+        frame[13] != 0x00 || frame[23] != IP_PROTO_TCP) {
+      continue;
+    }
+
+    const uint8_t* ip = frame + 14;
+    const size_t ip_header = (ip[0] & 0x0F) * 4;
+    const size_t ip_length = (ip[2] << 8) | ip[3];
+    const uint8_t* tcp = ip + ip_header;
+    const size_t tcp_header = (tcp[12] >> 4) * 4;
+    const uint16_t port = (tcp[2] << 8) | tcp[3];
+
+    if (port != SCPI_PORT || ip_length <= ip_header + tcp_header) {
+      continue;
+    }
+
+    const enum scpi_stop stop = scpi_is_abort(
+      (const char*)tcp + tcp_header, ip_length - ip_header - tcp_header);
+    if (stop != scpi_stop_none) {
+      return stop;
+    }
+  }
+
+  return scpi_stop_none;
+}
+
+/* a stop of the running sequence takes effect as soon as lwIP hands it
+ * over. The main loop might not get to the message before the sequencer
+ * interrupt continues, it is still processed like any other message */
+static void
+ethernet_receive_stop(struct pbuf* p)
+{
+  char msg[32];
+  if (!commands_running() || p->tot_len > sizeof(msg)) {
+    return;
+  }
+
+  pbuf_copy_partial(p, msg, p->tot_len, 0);
+
+  switch (scpi_is_abort(msg, p->tot_len)) {
+    case scpi_stop_abort:
+      commands_abort();
+      break;
+    case scpi_stop_parallel:
+      commands_parallel_stop();
+      break;
+    default:
+      break;
+  }
 }
 
 void
 ethernet_loop()
 {
+  size_t next = 0;
+
   for (;;) {
-    ethernet_next_packet();
+    ethernet_poll();
+
+    events_process();
+
+    binary_process();
+
+    /* queries don't change the state of the device. They are answered
+     * before the commands of other clients, so status requests of one
+     * client aren't held up by a long upload of another one. They are
+     * also the only messages answered while a sequence runs, besides the
+     * abort */
+    for (size_t i = 0; i < ETHERNET_CONNECTIONS; ++i) {
+      while (ethernet_process_message(&connections[i], 1)) {
+      }
+    }
+
+    /* the clients take turns with one message each, so their commands are
+     * executed one after another */
+    struct server_state* es = NULL;
+    for (size_t i = 0; i < ETHERNET_CONNECTIONS && es == NULL; ++i) {
+      const size_t id = (next + i) % ETHERNET_CONNECTIONS;
+      if (connections[id].flags & ES_INPUT) {
+        es = &connections[id];
+      }
+    }
+
+    if (es != NULL && !commands_running()) {
+      ethernet_process_message(es, 0);
+      next = (es->id + 1) % ETHERNET_CONNECTIONS;
+    } else if (!command_execute_flag) {
+      ethernet_sleep();
+    }
 
     if (command_execute_flag) {
       commands_execute();
       command_execute_flag = 0;
     }
-
-    scpi_process(es.pin->payload, es.pin->len);
   }
 }
 
-size_t
-ethernet_get_data(char* buf, size_t len)
+/* hands the next message of the connection to the parser if it is
+ * complete, with queries set only if it consists of queries. A message
+ * lying in a single pbuf is parsed in place, only messages spanning
+ * several pbufs are copied to make them contiguous.
+ *
+ * @return 1 if a message was processed */
+static int
+ethernet_process_message(struct server_state* es, int queries)
 {
-  size_t i = 0;
+  if (!(es->flags & ES_INPUT)) {
+    return 0;
+  }
 
-  /* this is our main ethernet loop. This will be called by the parser if
-   * it needs more data and we will be stuck here until that data is
-   * available.
-   */
-  do {
-    if (ETH_CheckFrameReceived()) {
-      TM_GPIO_TogglePinValue(GPIOD, GPIO_PIN_12);
-      /* Read a received packet from the Ethernet buffers and send it to the
-       * lwIP for handling */
-      ethernetif_input(&gnetif);
+  if ((es->flags & ES_DISCARD) && !ethernet_skip_line(es)) {
+    es->flags &= ~ES_INPUT;
+    return 0;
+  }
+
+  const size_t len = ethernet_find_message(es);
+  if (len == 0) {
+    if (es->pin != NULL &&
+        es->pin->tot_len - es->pin_offset >= ETHERNET_MESSAGE_MAX) {
+      scpi_input_overrun(es->id);
+      es->flags |= ES_DISCARD;
+      return 1;
     }
 
-    lwip_periodic_handle(LocalTime);
+    ethernet_compact(es);
+    es->flags &= ~ES_INPUT;
+    return 0;
+  }
+
+  if (queries && !ethernet_is_query(es, len) && !ethernet_is_abort(es, len)) {
+    return 0;
+  }
+
+  current = es;
 
-    /* if we already found the end of the current command the don't return
-     * any new data */
-    if (es.flags & ES_ENDOFLINE) {
-      return 0;
+  struct pbuf* msg;
+  if (es->pin_offset + len <= es->pin->len) {
+    /* keep the pbuf while it is parsed, reading a binary block consumes
+     * the input behind it */
+    msg = es->pin;
+    pbuf_ref(msg);
+    es->message = (char*)msg->payload + es->pin_offset;
+  } else {
+    msg = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    if (msg == NULL) {
+      scpi_input_overrun(es->id);
+      ethernet_consume(es, len + es->block_length);
+      current = NULL;
+      return 1;
     }
-  } while (es.pin == NULL);
 
-  while (i < len && !(es.flags & ES_ENDOFLINE)) {
+    pbuf_copy_partial(es->pin, msg->payload, len, es->pin_offset);
+    es->message = msg->payload;
+  }
 
-    const char* p = es.pin->payload;
+  es->flags &= ~ES_BLOCK;
 
-    size_t max = min(len, es.pin->len - es.pin_offset);
-    while (i < max) {
-      buf[i] = p[es.pin_offset];
-      i++;
-      es.pin_offset++;
+  scpi_process(es->id, (char*)es->message, len);
+
+  ethernet_flush(es);
+
+  /* a command which reads its binary block already consumed the message,
+   * otherwise the block is skipped */
+  if (!(es->flags & ES_BLOCK)) {
+    ethernet_consume(es, len + es->block_length);
+  }
+
+  pbuf_free(msg);
+
+  current = NULL;
+
+  return 1;
+}
 
-      /* if we parsed an end of line character we say the buffer has ended */
-      if (p[es.pin_offset - 1] == '\n' || p[es.pin_offset - 1] == '#') {
-        es.flags |= ES_ENDOFLINE;
-        break;
+/* checks if every command of the message is a query. Only complete
+ * messages without a binary block count. *OPC? waits for the running
+ * sequence like a command, so clients can block until it is finished */
+static int
+ethernet_is_query(const struct server_state* es, size_t len)
+{
+  int query = 0;
+  char header[4];
+  size_t header_len = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    const uint8_t c = pbuf_get_at(es->pin, es->pin_offset + i);
+    if (c == '?') {
+      query = 1;
+    } else if (c == ';' || c == '\n') {
+      if (!query || (header_len == sizeof(header) &&
+                     strncasecmp(header, "*OPC", sizeof(header)) == 0)) {
+        return 0;
       }
+      query = 0;
+      header_len = 0;
+      continue;
     }
 
-    if (es.pin->len == es.pin_offset) {
-      /* we parsed every byte in that buffer */
-      struct pbuf* ptr = es.pin;
+    if (header_len < sizeof(header) && !(header_len == 0 && isspace(c))) {
+      header[header_len++] = c;
+    }
+  }
 
-      es.pin = es.pin->next;
-      es.pin_offset = 0;
+  /* a message ending with a block header has a command with data */
+  return pbuf_get_at(es->pin, es->pin_offset + len - 1) == '\n';
+}
 
-      if (es.pin != NULL) {
-        /* increment reference count */
-        pbuf_ref(es.pin);
-      }
+static int
+ethernet_is_abort(const struct server_state* es, size_t len)
+{
+  char msg[32];
+  if (len > sizeof(msg)) {
+    return 0;
+  }
 
-      /* free old buffer */
-      pbuf_free(ptr);
+  pbuf_copy_partial(es->pin, msg, len, es->pin_offset);
+
+  return scpi_is_abort(msg, len);
+}
 
-      if (es.pin == NULL) {
-        break;
+/* length of the next message from the input position including its
+ * terminator or 0 if it isn't complete yet. A message ends with a newline
+ * or with the header of a binary block, the block data is read by the
+ * command itself and may contain any character */
+static size_t
+ethernet_find_message(struct server_state* es)
+{
+  es->block_length = 0;
+
+  size_t pos = 0;
+  for (struct pbuf* q = es->pin; q != NULL; pos += q->len, q = q->next) {
+    const char* p = q->payload;
+    const char* begin = p + (q == es->pin ? es->pin_offset : 0);
+    const char* newline = memchr(begin, '\n', p + q->len - begin);
+    const char* end = newline != NULL ? newline : p + q->len;
+
+    /* '#' also starts numbers in other bases, only a digit after it makes
+     * it a block */
+    for (const char* hash = begin;
+         (hash = memchr(hash, '#', end - hash)) != NULL; ++hash) {
+      const int header = ethernet_block_header(es, pos + (hash - p));
+      if (header < 0) {
+        return 0;
+      }
+      if (header > 0) {
+        return pos + (hash - p) + header - es->pin_offset;
       }
     }
+
+    if (newline != NULL) {
+      return pos + (newline - p) + 1 - es->pin_offset;
+    }
+  }
+
+  return 0;
+}
+
+/* drops the input up to and including the next newline, the end of a
+ * message which was too long. Returns 1 once the newline was found and 0
+ * if all input was dropped without finding it */
+static int
+ethernet_skip_line(struct server_state* es)
+{
+  size_t pos = 0;
+  for (struct pbuf* q = es->pin; q != NULL; pos += q->len, q = q->next) {
+    const char* p = q->payload;
+    const char* begin = p + (q == es->pin ? es->pin_offset : 0);
+    const char* newline = memchr(begin, '\n', p + q->len - begin);
+
+    if (newline != NULL) {
+      ethernet_consume(es, pos + (newline - p) + 1 - es->pin_offset);
+      es->flags &= ~ES_DISCARD;
+      return 1;
+    }
+  }
+
+  ethernet_consume(es, pos - es->pin_offset);
+
+  return 0;
+}
+
+/* copies the pending input into as few pool pbufs as possible */
+static void
+ethernet_compact(struct server_state* es)
+{
+  if (es->pin == NULL || pbuf_clen(es->pin) < ETHERNET_COMPACT_PBUFS) {
+    return;
+  }
+
+  const size_t len = es->pin->tot_len - es->pin_offset;
+  struct pbuf* p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+  if (p == NULL) {
+    return;
+  }
+
+  if (pbuf_clen(p) >= pbuf_clen(es->pin)) {
+    pbuf_free(p);
+    return;
+  }
+
+  size_t offset = es->pin_offset;
+  for (struct pbuf* q = p; q != NULL; offset += q->len, q = q->next) {
+    pbuf_copy_partial(es->pin, q->payload, q->len, offset);
+  }
+
+  pbuf_free(es->pin);
+  es->pin = p;
+  es->pin_offset = 0;
+}
+
+/* length of the block header at offset from the start of es->pin, 0 if
+ * there is none and -1 if it didn't arrive completely */
+static int
+ethernet_block_header(struct server_state* es, size_t offset)
+{
+  if (offset + 1 >= es->pin->tot_len) {
+    return -1;
+  }
+
+  const uint8_t digits = pbuf_get_at(es->pin, offset + 1);
+  if (digits < '1' || digits > '9') {
+    return 0;
+  }
+
+  const int header = 2 + digits - '0';
+  if (offset + header > es->pin->tot_len) {
+    return -1;
+  }
+
+  size_t length = 0;
+  for (int i = 2; i < header; ++i) {
+    const uint8_t c = pbuf_get_at(es->pin, offset + i);
+    if (!isdigit(c)) {
+      return 0;
+    }
+    length = length * 10 + c - '0';
   }
 
-  tcp_recved(es.pcb, i);
+  es->block_length = length;
 
-  return i;
+  return header;
+}
+
+/* moves the input position forward, waiting for data if necessary, and
+ * opens the receive window again */
+static void
+ethernet_consume(struct server_state* es, size_t len)
+{
+  while (len > 0) {
+    if (ethernet_wait_data(es)) {
+      return;
+    }
+
+    const size_t n = min(es->pin->len - es->pin_offset, len);
+    es->pin_offset += n;
+    len -= n;
+
+    if (es->pcb != NULL) {
+      tcp_recved(es->pcb, n);
+    }
+
+    if (es->pin_offset == es->pin->len) {
+      ethernet_clear_packet(es);
+    }
+  }
 }
 
 static void
@@ -345,6 +799,28 @@ ethernet_dma_init()
 
   /* Configure Ethernet */
   ETH_Init(&ETH_InitStructure, DP83848_PHY_ADDRESS);
+
+  /* the receive interrupt only wakes up the main loop, so it gets the
+   * lowest priority */
+  ETH_DMAITConfig(ETH_DMA_IT_NIS | ETH_DMA_IT_R, ENABLE);
+
+  NVIC_InitTypeDef nvic_init = {
+    .NVIC_IRQChannel = ETH_IRQn,
+    .NVIC_IRQChannelPreemptionPriority = 0x0F,
+    .NVIC_IRQChannelSubPriority = 0x00,
+    .NVIC_IRQChannelCmd = ENABLE,
+  };
+  NVIC_Init(&nvic_init);
+}
+
+void
+ethernet_interrupt_handler()
+{
+  if (ETH_GetDMAITStatus(ETH_DMA_IT_R) != RESET) {
+    rx_pending = 1;
+  }
+
+  ETH_DMAClearITPendingBit(ETH_DMA_IT_NIS | ETH_DMA_IT_R);
 }
 
 static void
@@ -554,6 +1030,11 @@ lwip_periodic_handle(uint32_t localtime)
 static int
 server_init()
 {
+  for (size_t i = 0; i < ETHERNET_CONNECTIONS; ++i) {
+    connections[i].id = i;
+    server_reset(&connections[i]);
+  }
+
   g_pcb = tcp_new();
 
   if (g_pcb == NULL) {
@@ -561,7 +1042,7 @@ server_init()
     return 1;
   }
 
-  err_t err = tcp_bind(g_pcb, IP_ADDR_ANY, 5024);
+  err_t err = tcp_bind(g_pcb, IP_ADDR_ANY, SCPI_PORT);
 
   if (err != ERR_OK) {
     memp_free(MEMP_TCP_PCB, g_pcb);
@@ -593,14 +1074,36 @@ server_accept_callback(void* arg, struct tcp_pcb* newpcb, err_t err)
   LWIP_UNUSED_ARG(arg);
   LWIP_UNUSED_ARG(err);
 
-  es.state = ES_ACCEPTED;
-  es.pcb = newpcb;
-  es.pin = NULL;
-  es.pin_offset = 0;
-  es.pout = NULL;
-  es.last_activity = LocalTime;
+  /* a slot whose client disconnected while its message is processed is
+   * only handed out again once the message is finished, the parser and
+   * the input position still belong to the old client. It still counts as
+   * free, so accepting stays enabled */
+  struct server_state* es = NULL;
+  size_t free_slots = 0;
+  for (size_t i = 0; i < ETHERNET_CONNECTIONS; ++i) {
+    if (connections[i].state != ES_NONE) {
+      continue;
+    }
+
+    if (es == NULL && &connections[i] != current) {
+      es = &connections[i];
+    } else {
+      free_slots++;
+    }
+  }
+
+  /* lwIP aborts the connection */
+  if (es == NULL) {
+    return ERR_MEM;
+  }
+
+  es->state = ES_ACCEPTED;
+  es->pcb = newpcb;
+  es->last_activity = LocalTime;
 
-  tcp_arg(newpcb, &es);
+  scpi_connect(es->id);
+
+  tcp_arg(newpcb, es);
 
   tcp_recv(newpcb, server_recv_callback);
 
@@ -608,9 +1111,11 @@ server_accept_callback(void* arg, struct tcp_pcb* newpcb, err_t err)
 
   tcp_poll(newpcb, server_poll_callback, 1);
 
-  /* disable accept callback as long as we do have an open connection.
-   * This automatically rejects incoming messages */
-  tcp_accept(g_pcb, NULL);
+  /* disable accept callback as long as all connections are in use. This
+   * automatically rejects incoming messages */
+  if (free_slots == 0) {
+    tcp_accept(g_pcb, NULL);
+  }
 
   tcp_accepted(newpcb);
 
@@ -630,21 +1135,23 @@ server_accept_callback(void* arg, struct tcp_pcb* newpcb, err_t err)
 static err_t
 server_recv_callback(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err)
 {
-  es.last_activity = LocalTime;
+  struct server_state* es = arg;
+
+  es->last_activity = LocalTime;
 
   /* if we receive an empty tcp frame from the client we close the
    * connection */
   if (p == NULL) {
-    es.state = ES_CLOSING;
+    es->state = ES_CLOSING;
 
-    if (es.pout == NULL) {
+    if (es->pout == NULL) {
       /* if we're done sending, we close connection */
-      server_connection_close(pcb);
+      server_connection_close(es, pcb);
     } else {
       /* if we're not done with sending we acknoledge the send packet and
        * send remaining data */
       tcp_sent(pcb, server_sent_callback);
-      server_send(pcb);
+      server_send(es, pcb);
     }
 
     return ERR_OK;
@@ -657,12 +1164,15 @@ server_recv_callback(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err)
     return err;
   }
 
-  if (es.state == ES_ACCEPTED) {
+  ethernet_receive_stop(p);
+
+  if (es->state == ES_ACCEPTED) {
     /* first data chunk in p->payload */
-    es.state = ES_RECEIVING;
+    es->state = ES_RECEIVING;
 
     /* store reference to incoming pbuf (chain) */
-    es.pin = p;
+    es->pin = p;
+    es->flags |= ES_INPUT;
 
     /* initialize callback */
     tcp_sent(pcb, server_sent_callback);
@@ -670,14 +1180,16 @@ server_recv_callback(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err)
     return ERR_OK;
   }
 
-  if (es.state == ES_RECEIVING) {
+  if (es->state == ES_RECEIVING) {
     /* more data from client and previous data has been processed */
-    if (es.pin != NULL) {
-      /* chain original and new data */
-      pbuf_chain(es.pin, p);
+    if (es->pin != NULL) {
+      /* chain original and new data. pbuf_chain would take a second
+       * reference on p, which is never released */
+      pbuf_cat(es->pin, p);
     } else {
-      es.pin = p;
+      es->pin = p;
     }
+    es->flags |= ES_INPUT;
 
     return ERR_OK;
   }
@@ -696,9 +1208,11 @@ server_err_callback(void* arg, err_t err)
 {
   LWIP_UNUSED_ARG(err);
 
-  if (arg != NULL) {
-    mem_free(arg);
-  }
+  /* lwIP already freed the pcb, the state is static and only reset */
+  server_reset(arg);
+
+  /* accept connections again */
+  tcp_accept(g_pcb, server_accept_callback);
 }
 
 /**
@@ -711,12 +1225,14 @@ server_err_callback(void* arg, err_t err)
 static err_t
 server_poll_callback(void* arg, struct tcp_pcb* pcb)
 {
-  if (es.pout != NULL) {
+  struct server_state* es = arg;
+
+  if (es->pout != NULL) {
     /* there is remaining data to be send, try that */
-    server_send(pcb);
+    server_send(es, pcb);
   } else {
-    if (es.state == ES_CLOSING) {
-      server_connection_close(pcb);
+    if (es->state == ES_CLOSING) {
+      server_connection_close(es, pcb);
     }
   }
   return ERR_OK;
@@ -736,14 +1252,16 @@ server_sent_callback(void* arg, struct tcp_pcb* pcb, u16_t len)
 {
   LWIP_UNUSED_ARG(len);
 
-  if (es.pout != NULL) {
+  struct server_state* es = arg;
+
+  if (es->pout != NULL) {
     /* still got pbufs to send */
-    server_send(pcb);
+    server_send(es, pcb);
   } else {
     /* if we have nothing to send and client closed connection we close
      * too */
-    if (es.state == ES_CLOSING) {
-      server_connection_close(pcb);
+    if (es->state == ES_CLOSING) {
+      server_connection_close(es, pcb);
     }
   }
 
@@ -753,23 +1271,23 @@ server_sent_callback(void* arg, struct tcp_pcb* pcb, u16_t len)
 /**
  * This function is used to send data to the tcp connetion
  *
- * @param pcb: pointer on the tcp_pcb connection
  * @param es: pointer on server state structure
+ * @param pcb: pointer on the tcp_pcb connection
  * @retval None
  */
 static void
-server_send(struct tcp_pcb* pcb)
+server_send(struct server_state* es, struct tcp_pcb* pcb)
 {
-  while ((es.pout != NULL) && es.pout->len <= tcp_sndbuf(pcb)) {
+  while ((es->pout != NULL) && es->pout->len <= tcp_sndbuf(pcb)) {
     /* get pointer on pbuf from structure */
-    struct pbuf* ptr = es.pout;
+    struct pbuf* ptr = es->pout;
 
     /* enqueue data for transmission */
     err_t wr_err = tcp_write(pcb, ptr->payload, ptr->len, 1);
 
     if (wr_err == ERR_MEM) {
       /* we are low on memory, try later / harder, defer to poll */
-      es.pout = ptr;
+      es->pout = ptr;
     }
 
     /* stop if we hit an error */
@@ -778,23 +1296,23 @@ server_send(struct tcp_pcb* pcb)
     }
 
     /* continue with next pbuf in chain (if any) */
-    es.pout = ptr->next;
+    es->pout = ptr->next;
 
-    if (es.pout != NULL) {
-      /* increment reference count for es.p */
-      pbuf_ref(es.pout);
+    if (es->pout != NULL) {
+      /* increment reference count for es->p */
+      pbuf_ref(es->pout);
     }
 
-    /* free pbuf: will free pbufs up to es.p, because es.p has a
+    /* free pbuf: will free pbufs up to es->p, because es->p has a
      * reference count > 0 (we just incremented it) */
     pbuf_free(ptr);
   }
 
-  es.last_activity = LocalTime;
+  es->last_activity = LocalTime;
 }
 
 static void
-server_connection_close(struct tcp_pcb* pcb)
+server_connection_close(struct server_state* es, struct tcp_pcb* pcb)
 {
   if (pcb == NULL) {
     return;
@@ -812,51 +1330,107 @@ server_connection_close(struct tcp_pcb* pcb)
 
   /* TODO free binary_target if it is in use */
 
-  es.pcb = NULL;
-  es.state = ES_NONE;
+  server_reset(es);
 
   /* accept connections again */
   tcp_accept(g_pcb, server_accept_callback);
 }
 
+/* frees the slot for the next client. Input which wasn't processed yet is
+ * dropped */
+static void
+server_reset(struct server_state* es)
+{
+  if (es->pin != NULL) {
+    pbuf_free(es->pin);
+  }
+
+  es->state = ES_NONE;
+  es->flags = 0;
+  es->pcb = NULL;
+  es->pin = NULL;
+  es->pin_offset = 0;
+  es->message = NULL;
+  es->block_length = 0;
+  es->pout = NULL;
+  es->out_len = 0;
+  es->binary_target = NULL;
+}
+
 void
 ethernet_data_next(struct binary_data* data)
 {
-  es.binary_target = data;
-  es.flags |= ES_DATA;
+  if (current == NULL) {
+    return;
+  }
+
+  current->binary_target = data;
+  current->flags |= ES_DATA;
 }
 
 static void
-ethernet_clear_packet()
+ethernet_clear_packet(struct server_state* es)
 {
   /* free the previous packet */
-  struct pbuf* ptr = es.pin;
+  struct pbuf* ptr = es->pin;
 
   if (ptr == NULL)
     return;
 
-  es.pin = es.pin->next;
-  es.pin_offset = 0;
+  es->pin = es->pin->next;
+  es->pin_offset = 0;
 
-  if (es.pin != NULL) {
-    pbuf_ref(es.pin);
+  if (es->pin != NULL) {
+    pbuf_ref(es->pin);
   }
 
   pbuf_free(ptr);
 }
 
 static void
-ethernet_next_packet()
+ethernet_poll()
 {
-  ethernet_clear_packet();
+  if (rx_pending) {
+    rx_pending = 0;
 
-  do {
-    if (ETH_CheckFrameReceived()) {
-      /* Read a received packet from the Ethernet buffers and send it to the
-       * lwIP for handling */
+    /* Read the received packets from the Ethernet buffers and send them to
+     * the lwIP for handling */
+    while (ETH_CheckFrameReceived()) {
       ethernetif_input(&gnetif);
     }
+  }
+
+  lwip_periodic_handle(LocalTime);
+}
+
+/* sleeps until the next interrupt, at the latest until the next SysTick,
+ * which also drives the lwIP timers */
+static void
+ethernet_sleep()
+{
+  /* with interrupts disabled a frame or an event arriving after the check
+   * still ends the WFI */
+  __disable_irq();
+  if (!rx_pending && !events_pending() && !binary_pending()) {
+    __WFI();
+  }
+  __enable_irq();
+}
+
+/* @return 0 if input is available, 1 if the client disconnected */
+static int
+ethernet_wait_data(struct server_state* es)
+{
+  ethernet_poll();
+
+  while (es->pin == NULL) {
+    if (es->pcb == NULL) {
+      return 1;
+    }
 
-    lwip_periodic_handle(LocalTime);
-  } while (es.pin == NULL);
+    ethernet_sleep();
+    ethernet_poll();
+  }
+
+  return 0;
 }
@@ -0,0 +1,191 @@
+#include "events.h"
+
+#include "scpi.h"
+#include "timing.h"
+
+#include <lwip/memp.h>
+#include <lwip/tcp.h>
+#include <stdio.h>
+
+/* the producers are interrupts of different priorities, which may
+ * interrupt each other. A slot is reserved by advancing head and handed
+ * to the main loop by setting ready once it is filled */
+static struct
+{
+  struct event event;
+  volatile uint32_t ready;
+} events[EVENTS_QUEUE_SIZE];
+
+static volatile uint32_t events_head = 0;
+static volatile uint32_t events_tail = 0;
+static volatile uint32_t events_lost = 0;
+static uint32_t events_lost_reported = 0;
+
+static struct tcp_pcb* listen_pcb;
+static struct tcp_pcb* push_pcb = NULL;
+
+static const char* const event_names[] = {
+  [event_sequence_done] = "DONE",
+  [event_sequence_aborted] = "ABORTED",
+  [event_pll_lost] = "PLL_LOST",
+};
+
+static int events_get(struct event*);
+static err_t events_accept_callback(void*, struct tcp_pcb*, err_t);
+static err_t events_recv_callback(void*, struct tcp_pcb*, struct pbuf*, err_t);
+static void events_err_callback(void*, err_t);
+
+int
+events_init()
+{
+  listen_pcb = tcp_new();
+  if (listen_pcb == NULL) {
+    return 1;
+  }
+
+  if (tcp_bind(listen_pcb, IP_ADDR_ANY, EVENTS_PORT) != ERR_OK) {
+    memp_free(MEMP_TCP_PCB, listen_pcb);
+    return 1;
+  }
+
+  listen_pcb = tcp_listen(listen_pcb);
+  tcp_accept(listen_pcb, events_accept_callback);
+
+  return 0;
+}
+
+void
+events_post(enum event_type type)
+{
+  uint32_t head = events_head;
+
+  do {
+    if (head - events_tail >= EVENTS_QUEUE_SIZE) {
+      __atomic_fetch_add(&events_lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&events_head, &head, head + 1, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  const size_t i = head % EVENTS_QUEUE_SIZE;
+  events[i].event.type = type;
+  events[i].event.time = LocalTime;
+  __atomic_store_n(&events[i].ready, 1, __ATOMIC_RELEASE);
+}
+
+int
+events_pending()
+{
+  return events[events_tail % EVENTS_QUEUE_SIZE].ready ||
+         events_lost != events_lost_reported;
+}
+
+/* takes the oldest event out of the ring, only called by the main loop */
+static int
+events_get(struct event* event)
+{
+  const size_t i = events_tail % EVENTS_QUEUE_SIZE;
+
+  if (!__atomic_load_n(&events[i].ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  *event = events[i].event;
+  events[i].ready = 0;
+  __atomic_store_n(&events_tail, events_tail + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+void
+events_process()
+{
+  struct event event;
+  char buf[32];
+
+  while (events_get(&event)) {
+    scpi_event(event.type);
+
+    const int len = snprintf(buf, sizeof(buf), "%s,%lu\n",
+                             event_names[event.type],
+                             (unsigned long)event.time);
+    events_push(buf, len);
+  }
+
+  const uint32_t lost = events_lost;
+  if (lost != events_lost_reported) {
+    events_lost_reported = lost;
+
+    const int len = snprintf(buf, sizeof(buf), "LOST,%lu\n",
+                             (unsigned long)lost);
+    events_push(buf, len);
+  }
+}
+
+void
+events_push(const char* data, size_t len)
+{
+  /* events are dropped rather than blocking the main loop */
+  if (push_pcb == NULL || tcp_sndbuf(push_pcb) < len) {
+    return;
+  }
+
+  tcp_write(push_pcb, data, len, TCP_WRITE_FLAG_COPY);
+  tcp_output(push_pcb);
+}
+
+static err_t
+events_accept_callback(void* arg, struct tcp_pcb* newpcb, err_t err)
+{
+  LWIP_UNUSED_ARG(arg);
+  LWIP_UNUSED_ARG(err);
+
+  push_pcb = newpcb;
+
+  tcp_recv(newpcb, events_recv_callback);
+  tcp_err(newpcb, events_err_callback);
+
+  /* one client at a time */
+  tcp_accept(listen_pcb, NULL);
+
+  tcp_accepted(newpcb);
+
+  return ERR_OK;
+}
+
+static err_t
+events_recv_callback(void* arg, struct tcp_pcb* pcb, struct pbuf* p,
+                     err_t err)
+{
+  LWIP_UNUSED_ARG(arg);
+
+  /* the client closed the connection */
+  if (p == NULL) {
+    tcp_recv(pcb, NULL);
+    tcp_err(pcb, NULL);
+    tcp_close(pcb);
+
+    push_pcb = NULL;
+    tcp_accept(listen_pcb, events_accept_callback);
+    return ERR_OK;
+  }
+
+  /* the client isn't expected to send anything */
+  if (err == ERR_OK) {
+    tcp_recved(pcb, p->tot_len);
+  }
+  pbuf_free(p);
+
+  return err;
+}
+
+static void
+events_err_callback(void* arg, err_t err)
+{
+  LWIP_UNUSED_ARG(arg);
+  LWIP_UNUSED_ARG(err);
+
+  /* lwIP already freed the pcb */
+  push_pcb = NULL;
+  tcp_accept(listen_pcb, events_accept_callback);
+}
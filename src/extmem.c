@@ -0,0 +1,446 @@
+#include "extmem.h"
+
+#include "gpio.h"
+#include "timing.h"
+#include "util.h"
+
+#include <stm32f4xx_dma.h>
+#include <stm32f4xx_rcc.h>
+#include <stm32f4xx_spi.h>
+#include <tm_stm32f4_gpio.h>
+
+/**
+ * The external memory is connected to SPI3 (PC10 - PC12) which isn't used
+ * by the DDS or the ethernet interface. Both the 23LC SRAM and the 25
+ * series NOR flash chips share the same read command, only writing
+ * differs.
+ *
+ * For streaming the memory is read in bursts via DMA into a ring buffer.
+ * SPI3_RX is mapped to DMA1 stream 0 and SPI3_TX to DMA1 stream 5, both on
+ * channel 0. The transmit stream just clocks out dummy bytes.
+ */
+
+#define EXTMEM_SPI SPI3
+#define EXTMEM_DMA_RX DMA1_Stream0
+#define EXTMEM_DMA_TX DMA1_Stream5
+#define EXTMEM_DMA_RX_FLAGS                                                    \
+  (DMA_FLAG_TCIF0 | DMA_FLAG_HTIF0 | DMA_FLAG_TEIF0 | DMA_FLAG_DMEIF0 |       \
+   DMA_FLAG_FEIF0)
+#define EXTMEM_DMA_TX_FLAGS                                                    \
+  (DMA_FLAG_TCIF5 | DMA_FLAG_HTIF5 | DMA_FLAG_TEIF5 | DMA_FLAG_DMEIF5 |       \
+   DMA_FLAG_FEIF5)
+
+enum
+{
+  extmem_cmd_write = 0x02,
+  extmem_cmd_read = 0x03,
+  extmem_cmd_read_status = 0x05,
+  extmem_cmd_write_enable = 0x06,
+  extmem_cmd_sector_erase = 0x20,
+  extmem_status_busy = 0x01,
+  extmem_flash_page = 256,
+  /* SPI3 runs from APB1 (42 MHz), most SRAMs are limited to 20 MHz */
+  extmem_spi_prescaler = 4,
+  extmem_spi_clock = CORE_CLOCK_SPEED / 4 / extmem_spi_prescaler,
+  /* read command plus 24 bit address */
+  extmem_read_overhead = 4,
+  /* don't start a read for less samples than this if we can avoid it,
+   * otherwise the command overhead dominates */
+  extmem_min_burst = 256,
+};
+
+static extmem_type type = extmem_type_sram;
+
+static struct
+{
+  uint16_t ring[EXTMEM_RING_SAMPLES];
+  uint32_t base;
+  uint32_t samples;
+  /* sample index in the waveform where the next burst starts */
+  uint32_t source;
+  uint64_t total;
+  /* counters of consumed, requested and received samples */
+  uint64_t read;
+  uint64_t requested;
+  uint64_t filled;
+  /* size of the running burst, 0 if idle */
+  uint32_t active;
+  uint32_t underruns;
+} stream;
+
+static const uint8_t dummy = 0;
+
+static uint8_t extmem_transfer(uint8_t);
+static void extmem_command(uint8_t cmd, uint32_t address);
+static void extmem_wait_ready(void);
+static int extmem_store(uint32_t address, const void* data, size_t len,
+                        int erase);
+static void extmem_erase_sector(uint32_t address);
+static void extmem_dma_init(void);
+static void extmem_stream_service(void);
+static void extmem_stream_finish(void);
+
+void
+extmem_init()
+{
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_SPI3, ENABLE);
+
+  TM_GPIO_InitAlternate(GPIOC, GPIO_PIN_10 | GPIO_PIN_11 | GPIO_PIN_12,
+                        TM_GPIO_OType_PP, TM_GPIO_PuPd_NOPULL,
+                        TM_GPIO_Speed_High, GPIO_AF_SPI3);
+
+  gpio_set_high(EXTMEM_CS);
+
+  SPI_InitTypeDef spi_init;
+  SPI_StructInit(&spi_init);
+
+  spi_init.SPI_DataSize = SPI_DataSize_8b;
+  spi_init.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_4;
+  spi_init.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+  spi_init.SPI_FirstBit = SPI_FirstBit_MSB;
+  spi_init.SPI_Mode = SPI_Mode_Master;
+  spi_init.SPI_NSS = SPI_NSS_Soft;
+  /* SPI mode 0, supported by all of the memory chips */
+  spi_init.SPI_CPOL = SPI_CPOL_Low;
+  spi_init.SPI_CPHA = SPI_CPHA_1Edge;
+
+  SPI_Init(EXTMEM_SPI, &spi_init);
+  SPI_Cmd(EXTMEM_SPI, ENABLE);
+
+  extmem_dma_init();
+}
+
+void
+extmem_set_type(extmem_type t)
+{
+  type = t;
+}
+
+extmem_type
+extmem_get_type()
+{
+  return type;
+}
+
+int
+extmem_write(uint32_t address, const void* data, size_t len)
+{
+  return extmem_store(address, data, len, 1);
+}
+
+int
+extmem_program(uint32_t address, const void* data, size_t len)
+{
+  return extmem_store(address, data, len, 0);
+}
+
+int
+extmem_erase(uint32_t address)
+{
+  if (address >= EXTMEM_SIZE) {
+    return 1;
+  }
+
+  if (type == extmem_type_flash) {
+    extmem_erase_sector(address - address % EXTMEM_FLASH_SECTOR);
+  }
+
+  return 0;
+}
+
+int
+extmem_read(uint32_t address, void* data, size_t len)
+{
+  if (address > EXTMEM_SIZE || len > EXTMEM_SIZE - address) {
+    return 1;
+  }
+
+  uint8_t* ptr = data;
+
+  gpio_set_low(EXTMEM_CS);
+  extmem_command(extmem_cmd_read, address);
+  for (size_t i = 0; i < len; ++i) {
+    ptr[i] = extmem_transfer(0);
+  }
+  gpio_set_high(EXTMEM_CS);
+
+  return 0;
+}
+
+float
+extmem_max_sample_rate()
+{
+  /* in the worst case every burst only transfers the minimum amount of
+   * samples and we pay for the read command every time */
+  const float bits =
+    8 * (extmem_read_overhead + extmem_min_burst * sizeof(uint16_t));
+
+  return extmem_min_burst * ((float)extmem_spi_clock) / bits;
+}
+
+void
+extmem_stream_start(uint32_t address, uint32_t samples, uint64_t total)
+{
+  extmem_stream_stop();
+
+  stream.base = address;
+  stream.samples = samples;
+  stream.source = 0;
+  stream.total = total;
+  stream.read = 0;
+  stream.requested = 0;
+  stream.filled = 0;
+  stream.underruns = 0;
+
+  /* prefill the ring buffer. The loop ends once no new burst could be
+   * started because the buffer is full or everything has been read */
+  do {
+    extmem_stream_service();
+  } while (stream.active);
+}
+
+int
+extmem_stream_pop(uint16_t* value)
+{
+  extmem_stream_service();
+
+  uint64_t available = stream.filled;
+  if (stream.active) {
+    /* data of the running burst can already be used */
+    const uint32_t missing = DMA_GetCurrDataCounter(EXTMEM_DMA_RX);
+    available += (stream.active * sizeof(uint16_t) - missing) / 2;
+  }
+
+  if (stream.read >= available) {
+    return 0;
+  }
+
+  *value = stream.ring[stream.read % EXTMEM_RING_SAMPLES];
+  stream.read++;
+
+  return 1;
+}
+
+void
+extmem_stream_underrun()
+{
+  stream.underruns++;
+}
+
+void
+extmem_stream_stop()
+{
+  if (stream.active) {
+    DMA_Cmd(EXTMEM_DMA_TX, DISABLE);
+    DMA_Cmd(EXTMEM_DMA_RX, DISABLE);
+    while (EXTMEM_SPI->SR & SPI_SR_BSY) {
+    }
+    gpio_set_high(EXTMEM_CS);
+    /* discard anything left in the receive register */
+    (void)EXTMEM_SPI->DR;
+    stream.active = 0;
+  }
+}
+
+uint32_t
+extmem_stream_get_underruns()
+{
+  return stream.underruns;
+}
+
+static void
+extmem_stream_service()
+{
+  if (stream.active) {
+    if (DMA_GetFlagStatus(EXTMEM_DMA_RX, DMA_FLAG_TCIF0) == RESET) {
+      return;
+    }
+
+    extmem_stream_finish();
+  }
+
+  if (stream.requested >= stream.total) {
+    return;
+  }
+
+  const uint32_t pos = stream.requested % EXTMEM_RING_SAMPLES;
+
+  /* a burst has to be contiguous in the ring buffer and in the memory */
+  uint32_t n = EXTMEM_RING_SAMPLES - pos;
+  n = min(n, stream.samples - stream.source);
+  n = min(n, stream.total - stream.requested);
+
+  const uint64_t space =
+    stream.read + EXTMEM_RING_SAMPLES - stream.requested;
+  if (space < n) {
+    if (space < extmem_min_burst) {
+      return;
+    }
+    n = space;
+  }
+
+  const uint32_t address = stream.base + stream.source * sizeof(uint16_t);
+
+  gpio_set_low(EXTMEM_CS);
+  extmem_command(extmem_cmd_read, address);
+
+  DMA_ClearFlag(EXTMEM_DMA_RX, EXTMEM_DMA_RX_FLAGS);
+  DMA_ClearFlag(EXTMEM_DMA_TX, EXTMEM_DMA_TX_FLAGS);
+
+  EXTMEM_DMA_RX->M0AR = (uint32_t)(stream.ring + pos);
+  EXTMEM_DMA_RX->NDTR = n * sizeof(uint16_t);
+  EXTMEM_DMA_TX->NDTR = n * sizeof(uint16_t);
+
+  /* enable the receiver first, otherwise we might miss the first byte */
+  DMA_Cmd(EXTMEM_DMA_RX, ENABLE);
+  DMA_Cmd(EXTMEM_DMA_TX, ENABLE);
+
+  stream.active = n;
+  stream.requested += n;
+  stream.source += n;
+  if (stream.source == stream.samples) {
+    stream.source = 0;
+  }
+}
+
+static void
+extmem_stream_finish()
+{
+  /* the last byte has been received, so the bus is idle by now */
+  while (EXTMEM_SPI->SR & SPI_SR_BSY) {
+  }
+  gpio_set_high(EXTMEM_CS);
+
+  stream.filled += stream.active;
+  stream.active = 0;
+}
+
+static void
+extmem_dma_init()
+{
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+
+  DMA_InitTypeDef dma_init;
+  DMA_StructInit(&dma_init);
+
+  dma_init.DMA_Channel = DMA_Channel_0;
+  dma_init.DMA_PeripheralBaseAddr = (uint32_t)&EXTMEM_SPI->DR;
+  dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  dma_init.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  dma_init.DMA_Mode = DMA_Mode_Normal;
+  dma_init.DMA_Priority = DMA_Priority_High;
+  dma_init.DMA_FIFOMode = DMA_FIFOMode_Disable;
+
+  /* receive into the ring buffer, address and length are set per burst */
+  DMA_DeInit(EXTMEM_DMA_RX);
+  dma_init.DMA_DIR = DMA_DIR_PeripheralToMemory;
+  dma_init.DMA_Memory0BaseAddr = (uint32_t)stream.ring;
+  dma_init.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  dma_init.DMA_BufferSize = 1;
+  DMA_Init(EXTMEM_DMA_RX, &dma_init);
+
+  /* transmit always sends the same dummy byte */
+  DMA_DeInit(EXTMEM_DMA_TX);
+  dma_init.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+  dma_init.DMA_Memory0BaseAddr = (uint32_t)&dummy;
+  dma_init.DMA_MemoryInc = DMA_MemoryInc_Disable;
+  DMA_Init(EXTMEM_DMA_TX, &dma_init);
+
+  SPI_I2S_DMACmd(EXTMEM_SPI, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, ENABLE);
+}
+
+static uint8_t
+extmem_transfer(uint8_t data)
+{
+  while ((EXTMEM_SPI->SR & SPI_SR_TXE) == 0) {
+  }
+
+  EXTMEM_SPI->DR = data;
+
+  while ((EXTMEM_SPI->SR & SPI_SR_RXNE) == 0) {
+  }
+
+  return EXTMEM_SPI->DR;
+}
+
+static void
+extmem_command(uint8_t cmd, uint32_t address)
+{
+  extmem_transfer(cmd);
+  extmem_transfer(address >> 16);
+  extmem_transfer(address >> 8);
+  extmem_transfer(address);
+}
+
+static void
+extmem_wait_ready()
+{
+  uint8_t status;
+  do {
+    gpio_set_low(EXTMEM_CS);
+    extmem_transfer(extmem_cmd_read_status);
+    status = extmem_transfer(0);
+    gpio_set_high(EXTMEM_CS);
+  } while (status & extmem_status_busy);
+}
+
+/* erase selects whether flash sectors are erased when the write reaches
+ * their first byte */
+static int
+extmem_store(uint32_t address, const void* data, size_t len, int erase)
+{
+  if (address > EXTMEM_SIZE || len > EXTMEM_SIZE - address) {
+    return 1;
+  }
+
+  const uint8_t* ptr = data;
+
+  while (len > 0) {
+    size_t n = len;
+
+    if (type == extmem_type_flash) {
+      if (erase && address % EXTMEM_FLASH_SECTOR == 0) {
+        extmem_erase_sector(address);
+      }
+
+      /* page programming wraps around at the page boundary */
+      n = min(n, extmem_flash_page - address % extmem_flash_page);
+
+      gpio_set_low(EXTMEM_CS);
+      extmem_transfer(extmem_cmd_write_enable);
+      gpio_set_high(EXTMEM_CS);
+    }
+
+    gpio_set_low(EXTMEM_CS);
+    extmem_command(extmem_cmd_write, address);
+    for (size_t i = 0; i < n; ++i) {
+      extmem_transfer(ptr[i]);
+    }
+    gpio_set_high(EXTMEM_CS);
+
+    if (type == extmem_type_flash) {
+      extmem_wait_ready();
+    }
+
+    address += n;
+    ptr += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static void
+extmem_erase_sector(uint32_t address)
+{
+  gpio_set_low(EXTMEM_CS);
+  extmem_transfer(extmem_cmd_write_enable);
+  gpio_set_high(EXTMEM_CS);
+
+  gpio_set_low(EXTMEM_CS);
+  extmem_command(extmem_cmd_sector_erase, address);
+  gpio_set_high(EXTMEM_CS);
+
+  extmem_wait_ready();
+}
@@ -37,6 +37,11 @@ gpio_init()
   gpio_init_output(DRCTL);
   gpio_init_output(DRHOLD);
   gpio_init_input(DROVER);
+  /* OSK is only driven once OSK:PIN is executed, the line isn't confirmed
+   * on every board revision */
+  gpio_init_input(OSK);
+
+  gpio_init_output_pullup(EXTMEM_CS);
 
   gpio_init_output(TX_ENABLE);
   gpio_init_output(PARALLEL_F0);
@@ -1,17 +1,25 @@
 #include "interrupts.h"
 
+#include "commands.h"
 #include "ethernet.h"
+#include "events.h"
 #include "gpio.h"
+#include "ramp.h"
 #include "timing.h"
 
 #include <misc.h>
 #include <stddef.h>
 #include <stm32f4xx.h>
+#include <stm32f4xx_dma.h>
 #include <stm32f4xx_exti.h>
 #include <stm32f4xx_rcc.h>
 #include <stm32f4xx_syscfg.h>
 
 void EXTI0_IRQHandler(void);
+void EXTI1_IRQHandler(void);
+void DMA2_Stream3_IRQHandler(void);
+void ETH_IRQHandler(void);
+void TIM5_IRQHandler(void);
 void EXTI15_10_IRQHandler(void);
 void NMI_Handler(void);
 void HardFault_Handler(void);
@@ -91,13 +99,53 @@ EXTI0_IRQHandler()
   }
 }
 
+void
+EXTI1_IRQHandler()
+{
+  /* DROVER, the current ramp of a ramp chain reached its limit */
+  if (EXTI_GetITStatus(EXTI_Line1) != RESET) {
+    EXTI_ClearITPendingBit(EXTI_Line1);
+    ramp_chain_drover_handler();
+  }
+}
+
+void
+DMA2_Stream3_IRQHandler()
+{
+  /* the next segment of a ramp chain has been sent to the DDS */
+  if (DMA_GetITStatus(DMA2_Stream3, DMA_IT_TCIF3) != RESET) {
+    DMA_ClearITPendingBit(DMA2_Stream3, DMA_IT_TCIF3);
+    ramp_chain_dma_handler();
+  }
+}
+
+void
+ETH_IRQHandler()
+{
+  /* a frame was received, the main loop hands it to lwIP */
+  ethernet_interrupt_handler();
+}
+
+void
+TIM5_IRQHandler()
+{
+  /* a wait of the running sequence ended or it was started */
+  commands_timer_handler();
+}
+
 void
 EXTI15_10_IRQHandler()
 {
+  /* the trigger input, a sequence is waiting for it */
+  if (EXTI_GetITStatus(EXTI_Line11) != RESET) {
+    EXTI_ClearITPendingBit(EXTI_Line11);
+    commands_trigger_handler();
+  }
+
   /* this should only be called if the PLL has lost it's lock signal */
   if (EXTI_GetITStatus(EXTI_Line15) != RESET) {
-    static const char msg[] = "DDS lost PLL signal. Output will be wrong.\n";
-    ethernet_queue(msg, sizeof(msg));
+    /* lwIP can't be called from here, the main loop reports it */
+    events_post(event_pll_lost);
     EXTI_ClearITPendingBit(EXTI_Line15);
   }
 }
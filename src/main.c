@@ -1,6 +1,10 @@
 #include "ad9910.h"
+#include "boot.h"
+#include "commands.h"
 #include "ethernet.h"
+#include "extmem.h"
 #include "gpio.h"
+#include "store.h"
 #include "timing.h"
 
 int
@@ -14,11 +18,26 @@ main(void)
      */
   sysclock_init();
 
+  boot_timing_init();
+
+  store_init();
+  boot_timing_mark(boot_phase_store);
+
   ad9910_init();
+  boot_timing_mark(boot_phase_dds);
+
+  extmem_init();
+  boot_timing_mark(boot_phase_extmem);
 
   gpio_set_high(LED_ORANGE);
 
+  /* the network comes up while the PLL of the AD9910 is locking */
   ethernet_init();
+  boot_timing_mark(boot_phase_ethernet);
+
+  ad9910_init_finish();
+
+  commands_init();
 
   ethernet_loop();
 
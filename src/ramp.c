@@ -0,0 +1,595 @@
+#include "ramp.h"
+
+#include "ad9910.h"
+#include "gpio.h"
+#include "spi.h"
+#include "timing.h"
+#include "util.h"
+
+#include <math.h>
+#include <misc.h>
+#include <string.h>
+#include <stm32f4xx_exti.h>
+#include <stm32f4xx_rcc.h>
+#include <stm32f4xx_syscfg.h>
+
+/* the ramp limit (64 bit), step (64 bit) and rate (32 bit) registers plus
+ * one instruction byte each */
+#define RAMP_FRAME_SIZE 23
+
+static ramp_segment chain[RAMP_CHAIN_LENGTH];
+static size_t chain_length = 0;
+static uint32_t chain_start = 0;
+
+/* SPI frames and directions of the segments, built before the chain is
+ * started so the interrupt only has to hand them to the DMA */
+static uint8_t frames[RAMP_CHAIN_LENGTH][RAMP_FRAME_SIZE];
+static uint8_t rising[RAMP_CHAIN_LENGTH];
+static size_t frame_count = 0;
+
+/* segment which is currently transferred or loaded next */
+static volatile size_t chain_next = 0;
+static volatile int chain_running = 0;
+
+struct ramp_function
+{
+  ramp_shape shape;
+  double start;
+  double stop;
+  double duration;
+  double steepness;
+};
+
+struct ramp_points
+{
+  const char* data;
+  double scale;
+};
+
+static void ramp_function_curve(size_t i, const void* arg, double* time,
+                                double* value);
+static void ramp_points_curve(size_t i, const void* arg, double* time,
+                              double* value);
+static int ramp_emit_segment(double from, double to, double duration,
+                             double max_error);
+static int ramp_emit_hold(uint32_t value, double duration, double max_error);
+static void ramp_build_frame(uint8_t* buf, uint64_t limit, uint64_t step,
+                             uint32_t rate);
+static void ramp_load_segment(size_t);
+static void ramp_irq_enable(int);
+static void ramp_chain_stop(void);
+
+void
+ramp_chain_clear()
+{
+  chain_length = 0;
+}
+
+void
+ramp_chain_set_start(uint32_t start)
+{
+  chain_start = start;
+}
+
+uint32_t
+ramp_chain_get_start()
+{
+  return chain_start;
+}
+
+int
+ramp_chain_append(const ramp_segment* segment)
+{
+  if (chain_length >= RAMP_CHAIN_LENGTH || segment->step == 0 ||
+      segment->rate == 0) {
+    return 1;
+  }
+
+  chain[chain_length++] = *segment;
+
+  return 0;
+}
+
+size_t
+ramp_chain_length()
+{
+  return chain_length;
+}
+
+const ramp_segment*
+ramp_chain_get(size_t i)
+{
+  return i < chain_length ? chain + i : NULL;
+}
+
+int
+ramp_chain_execute()
+{
+  uint64_t limit = 0, step = 0;
+  uint32_t rate = 0;
+  double duration = 0;
+
+  /* segments without a span would never raise DROVER, skip them */
+  frame_count = 0;
+  uint32_t from = chain_start;
+  for (size_t i = 0; i < chain_length; ++i) {
+    const ramp_segment* seg = chain + i;
+    if (seg->target == from) {
+      continue;
+    }
+
+    const int up = seg->target > from;
+    const uint64_t upper = up ? seg->target : from;
+    const uint64_t lower = up ? from : seg->target;
+
+    limit = (upper << 32) | lower;
+    step = ((uint64_t)seg->step << 32) | seg->step;
+    rate = ((uint32_t)seg->rate << 16) | seg->rate;
+
+    ramp_build_frame(frames[frame_count], limit, step, rate);
+    rising[frame_count] = up;
+    frame_count++;
+
+    duration += ramp_duration(upper - lower, seg->step, seg->rate);
+
+    from = seg->target;
+  }
+
+  if (frame_count == 0) {
+    return 0;
+  }
+
+  const uint32_t timeout =
+    min(ceil(duration * 1000), UINT32_MAX - RAMP_CHAIN_TIMEOUT) +
+    RAMP_CHAIN_TIMEOUT;
+
+  /* the ramp has to dwell at the limits until the next segment arrives */
+  ad9910_set_value(ad9910_digital_ramp_enable, 1);
+  ad9910_set_value(ad9910_digital_ramp_no_dwell_high, 0);
+  ad9910_set_value(ad9910_digital_ramp_no_dwell_low, 0);
+  ad9910_update_reg(&ad9910_regs.cfr2);
+
+  /* move the accumulator to the start value. With both limits at the
+   * start value and the largest step the ramp gets there in one step */
+  static uint8_t preamble[RAMP_FRAME_SIZE];
+  ramp_build_frame(preamble, ((uint64_t)chain_start << 32) | chain_start,
+                   UINT64_MAX, 0x00010001);
+  spi_write_multi(preamble, sizeof(preamble));
+  ad9910_io_update();
+
+  const uint32_t start = LocalTime;
+
+  gpio_set_high(DRCTL);
+  while (!gpio_get(DROVER)) {
+    if (LocalTime - start > RAMP_CHAIN_TIMEOUT) {
+      return 1;
+    }
+  }
+
+  spi_dma_init(1);
+  ramp_irq_enable(1);
+
+  /* DROVER is already high, the first segment has to be started here */
+  chain_running = 1;
+  ramp_load_segment(0);
+
+  int err = 0;
+  while (chain_running) {
+    /* a lost DROVER edge or DMA interrupt would stall the chain forever */
+    if (LocalTime - start > timeout) {
+      err = 1;
+      break;
+    }
+  }
+
+  ramp_chain_stop();
+
+  /* keep the shadow registers in sync with the last segment */
+  ad9910_regs.ramp_limit.value = limit;
+  ad9910_regs.ramp_step.value = step;
+  ad9910_regs.ramp_rate.value = rate;
+
+  return err;
+}
+
+int
+ramp_solve(uint32_t span, double duration, ramp_solution* solution)
+{
+  const uint64_t ticks = nearbyint(duration / RAMP_CLOCK_PERIOD);
+
+  if (span == 0 || ticks == 0) {
+    return 1;
+  }
+
+  /* the slowest ramp possible. Ramps longer than that can't be reached
+   * with any rate and are clamped to it */
+  const uint64_t longest = (uint64_t)span * 0xFFFF;
+  uint64_t best_error = longest > ticks ? longest - ticks : ticks - longest;
+  uint64_t best_overshoot = 0;
+  solution->step = 1;
+  solution->rate = 0xFFFF;
+
+  for (uint32_t rate = 1; rate <= 0xFFFF; ++rate) {
+    /* most ramps are shorter than 2^32 ticks (17s), where a 32 bit
+     * division is a lot faster */
+    const uint64_t steps = ticks <= UINT32_MAX ? (uint32_t)ticks / rate
+                                                : ticks / rate;
+
+    /* try the number of steps just below and above the ideal value */
+    for (uint64_t n = steps; n <= steps + 1; ++n) {
+      if (n == 0 || n > span) {
+        continue;
+      }
+
+      const uint32_t step = (span - 1) / (uint32_t)n + 1;
+      const uint32_t actual = (span - 1) / step + 1;
+      const uint64_t time = (uint64_t)actual * rate;
+      const uint64_t error = time > ticks ? time - ticks : ticks - time;
+      const uint64_t overshoot = (uint64_t)actual * step - span;
+
+      if (error < best_error ||
+          (error == best_error && overshoot < best_overshoot)) {
+        best_error = error;
+        best_overshoot = overshoot;
+        solution->step = step;
+        solution->rate = rate;
+      }
+    }
+
+    if (best_error == 0 && best_overshoot == 0) {
+      break;
+    }
+  }
+
+  solution->duration = ramp_duration(span, solution->step, solution->rate);
+
+  return 0;
+}
+
+int
+ramp_solve_osk(uint16_t amplitude, double duration, ramp_solution* solution)
+{
+  const uint64_t ticks = nearbyint(duration / RAMP_CLOCK_PERIOD);
+
+  if (amplitude == 0 || ticks == 0) {
+    return 1;
+  }
+
+  uint64_t best_error = UINT64_MAX;
+
+  for (uint32_t step = 1; step <= 8; step <<= 1) {
+    const uint32_t steps = (amplitude - 1) / step + 1;
+    const uint64_t rate = min(max((ticks + steps / 2) / steps, 1), 0xFFFF);
+    const uint64_t time = rate * steps;
+    const uint64_t error = time > ticks ? time - ticks : ticks - time;
+
+    if (error < best_error) {
+      best_error = error;
+      solution->step = step;
+      solution->rate = rate;
+    }
+  }
+
+  solution->duration = ramp_duration(amplitude, solution->step, solution->rate);
+
+  return 0;
+}
+
+double
+ramp_duration(uint32_t span, uint32_t step, uint16_t rate)
+{
+  if (step == 0) {
+    return INFINITY;
+  }
+
+  const uint32_t steps = span ? (span - 1) / step + 1 : 0;
+
+  return ((double)steps) * rate * RAMP_CLOCK_PERIOD;
+}
+
+int
+ramp_chain_compile(ramp_curve curve, const void* arg, size_t points,
+                   double max_error)
+{
+  ramp_chain_clear();
+
+  if (points < 2) {
+    return 1;
+  }
+
+  double start_time, start_value;
+  curve(0, arg, &start_time, &start_value);
+  ramp_chain_set_start(nearbyint(start_value));
+
+  /* greedy fit: starting at the end of the previous segment all slopes
+   * which pass every following point within the error form an interval.
+   * The segment is extended until that interval becomes empty. */
+  double low = -INFINITY, high = INFINITY;
+  double last_time = start_time;
+
+  for (size_t i = 1; i < points; ++i) {
+    double t, v;
+    curve(i, arg, &t, &v);
+
+    const double dt = t - start_time;
+    double l = (v - max_error - start_value) / dt;
+    double h = (v + max_error - start_value) / dt;
+
+    if (max(low, l) > min(high, h)) {
+      /* end the segment at the previous point with the slope in the
+       * middle of the allowed interval */
+      const double slope = (low + high) / 2;
+      const double end = start_value + slope * (last_time - start_time);
+      if (ramp_emit_segment(start_value, end, last_time - start_time,
+                            max_error)) {
+        return 1;
+      }
+
+      start_time = last_time;
+      start_value = end;
+
+      l = (v - max_error - start_value) / (t - start_time);
+      h = (v + max_error - start_value) / (t - start_time);
+      low = -INFINITY;
+      high = INFINITY;
+    }
+
+    low = max(low, l);
+    high = min(high, h);
+    last_time = t;
+  }
+
+  const double slope = (low + high) / 2;
+  const double end = start_value + slope * (last_time - start_time);
+
+  return ramp_emit_segment(start_value, end, last_time - start_time,
+                           max_error);
+}
+
+int
+ramp_chain_compile_function(ramp_shape shape, double start, double stop,
+                            double duration, double steepness,
+                            double max_error)
+{
+  if (duration <= 0 || max_error <= 0) {
+    return 1;
+  }
+
+  if (shape == ramp_shape_exponential && (start <= 0 || stop <= 0)) {
+    return 1;
+  }
+
+  if (shape == ramp_shape_tanh && steepness <= 0) {
+    return 1;
+  }
+
+  const struct ramp_function function = {
+    .shape = shape,
+    .start = start,
+    .stop = stop,
+    .duration = duration,
+    .steepness = steepness,
+  };
+
+  return ramp_chain_compile(ramp_function_curve, &function,
+                            RAMP_COMPILE_SAMPLES, max_error);
+}
+
+int
+ramp_chain_compile_points(const void* data, size_t points, double scale,
+                          double max_error)
+{
+  const struct ramp_points arg = {.data = data, .scale = scale };
+
+  if (max_error <= 0) {
+    return 1;
+  }
+
+  double last = -INFINITY;
+  for (size_t i = 0; i < points; ++i) {
+    double t, v;
+    ramp_points_curve(i, &arg, &t, &v);
+    if (t <= last) {
+      return 1;
+    }
+    last = t;
+  }
+
+  return ramp_chain_compile(ramp_points_curve, &arg, points, max_error);
+}
+
+void
+ramp_chain_drover_handler()
+{
+  if (!chain_running) {
+    return;
+  }
+
+  if (chain_next < frame_count) {
+    ramp_load_segment(chain_next);
+  } else {
+    chain_running = 0;
+  }
+}
+
+void
+ramp_chain_dma_handler()
+{
+  spi_dma_finish();
+
+  /* activate the new limits before changing the direction, otherwise the
+   * accumulator would start moving towards the old limit */
+  ad9910_io_update();
+  gpio_set(DRCTL, rising[chain_next]);
+
+  chain_next++;
+}
+
+/* stops reacting to DROVER and hands SPI1 back to register writes */
+static void
+ramp_chain_stop()
+{
+  chain_running = 0;
+  ramp_irq_enable(0);
+  spi_dma_deinit();
+}
+
+static void
+ramp_load_segment(size_t i)
+{
+  chain_next = i;
+  spi_write_dma(frames[i], RAMP_FRAME_SIZE);
+}
+
+static void
+ramp_function_curve(size_t i, const void* arg, double* time, double* value)
+{
+  const struct ramp_function* f = arg;
+  const double x = ((double)i) / (RAMP_COMPILE_SAMPLES - 1);
+
+  *time = x * f->duration;
+
+  switch (f->shape) {
+    case ramp_shape_linear:
+      *value = f->start + (f->stop - f->start) * x;
+      break;
+    case ramp_shape_exponential:
+      *value = f->start * pow(f->stop / f->start, x);
+      break;
+    case ramp_shape_tanh:
+      *value = f->start +
+               (f->stop - f->start) *
+                 (tanh(f->steepness * (2 * x - 1)) / tanh(f->steepness) + 1) /
+                 2;
+      break;
+  }
+}
+
+static void
+ramp_points_curve(size_t i, const void* arg, double* time, double* value)
+{
+  const struct ramp_points* p = arg;
+
+  /* the block is not necessarily aligned for floats */
+  float point[2];
+  memcpy(point, p->data + i * sizeof(point), sizeof(point));
+
+  *time = point[0];
+  *value = point[1] * p->scale;
+}
+
+static int
+ramp_emit_segment(double from, double to, double duration, double max_error)
+{
+  const double limit = UINT32_MAX;
+  const uint32_t begin = nearbyint(min(max(from, 0), limit));
+  const uint32_t end = nearbyint(min(max(to, 0), limit));
+
+  if (begin == end) {
+    return ramp_emit_hold(begin, duration, max_error);
+  }
+
+  const uint32_t delta = end > begin ? end - begin : begin - end;
+  ramp_solution solution;
+  if (ramp_solve(delta, duration, &solution)) {
+    return 1;
+  }
+
+  const ramp_segment segment = {
+    .target = end, .step = solution.step, .rate = solution.rate,
+  };
+
+  return ramp_chain_append(&segment);
+}
+
+/* a ramp needs a span to raise DROVER, so a flat segment is held with
+ * pairs of ramps away from the value and back. Their span is the smallest
+ * one filling the time at the slowest rate, but never more than max_error
+ * (at least one LSB). The chain is too short if that needs too many */
+static int
+ramp_emit_hold(uint32_t value, double duration, double max_error)
+{
+  const uint64_t ticks = nearbyint(duration / RAMP_CLOCK_PERIOD);
+  if (ticks < 2) {
+    return 0;
+  }
+
+  /* steps of the slowest ramp which fill the time */
+  const uint64_t steps = (ticks + 0xFFFE) / 0xFFFF;
+  const uint32_t span = max(min(steps, floor(max_error)), 1);
+  uint64_t count = (steps + span - 1) / span;
+  /* the hold ends where it started */
+  count += count % 2;
+
+  if (count > RAMP_CHAIN_LENGTH - chain_length) {
+    return 1;
+  }
+
+  /* move away from the value towards the side with room */
+  const uint32_t other = value <= UINT32_MAX - span ? value + span
+                                                    : value - span;
+
+  for (uint64_t i = 0; i < count; ++i) {
+    ramp_solution solution;
+    if (ramp_solve(span, duration / count, &solution)) {
+      return 1;
+    }
+
+    const ramp_segment segment = {
+      .target = i % 2 ? value : other,
+      .step = solution.step,
+      .rate = solution.rate,
+    };
+    if (ramp_chain_append(&segment)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+ramp_build_frame(uint8_t* buf, uint64_t limit, uint64_t step, uint32_t rate)
+{
+  ad9910_register regs[] = {
+    {.address = ad9910_regs.ramp_limit.address,
+     .value = limit,
+     .size = ad9910_regs.ramp_limit.size },
+    {.address = ad9910_regs.ramp_step.address,
+     .value = step,
+     .size = ad9910_regs.ramp_step.size },
+    {.address = ad9910_regs.ramp_rate.address,
+     .value = rate,
+     .size = ad9910_regs.ramp_rate.size },
+  };
+
+  for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i) {
+    buf += ad9910_build_reg_frame(regs + i, buf);
+  }
+}
+
+static void
+ramp_irq_enable(int enable)
+{
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+
+  /* DROVER is on PD1 */
+  SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOD, EXTI_PinSource1);
+
+  EXTI_InitTypeDef exti_init = {
+    .EXTI_Line = EXTI_Line1,
+    .EXTI_Mode = EXTI_Mode_Interrupt,
+    .EXTI_Trigger = EXTI_Trigger_Rising,
+    .EXTI_LineCmd = enable ? ENABLE : DISABLE,
+  };
+  EXTI_Init(&exti_init);
+  EXTI_ClearITPendingBit(EXTI_Line1);
+
+  NVIC_InitTypeDef nvic_init = {
+    .NVIC_IRQChannel = EXTI1_IRQn,
+    .NVIC_IRQChannelPreemptionPriority = 0x00,
+    .NVIC_IRQChannelSubPriority = 0x00,
+    .NVIC_IRQChannelCmd = enable ? ENABLE : DISABLE,
+  };
+  NVIC_Init(&nvic_init);
+}
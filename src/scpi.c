@@ -1,22 +1,28 @@
 #include "scpi.h"
 
+#include "boot.h"
 #include "commands.h"
 #include "config.h"
 #include "ethernet.h"
+#include "events.h"
+#include "extmem.h"
 #include "gpio.h"
+#include "ramp.h"
+#include "store.h"
+#include "timing.h"
+#include "util.h"
 
 #define USE_FULL_ERROR_LIST 1
 
+#include <ctype.h>
 #include <math.h>
 #include <scpi/scpi.h>
 #include <stdio.h>
+#include <strings.h>
 
-enum scpi_mode
-{
-  scpi_mode_normal,
-  scpi_mode_program,
-  scpi_mode_execute
-};
+/* device specific bits of the status registers */
+#define SCPI_OPER_SEQUENCE 0x0100 /* a sequence ended */
+#define SCPI_QUES_PLL 0x0100      /* the PLL lost its lock */
 
 static enum scpi_mode current_mode = scpi_mode_normal;
 
@@ -27,59 +33,164 @@ static const scpi_choice_def_t scpi_mode_choices[] = {
   SCPI_CHOICE_LIST_END
 };
 
+static const scpi_choice_def_t sequence_state_choices[] = {
+  { "IDLE", command_run_idle },
+  { "BUSY", command_run_busy },
+  { "WAIT", command_run_wait },
+  { "TRIGger", command_run_trigger },
+  SCPI_CHOICE_LIST_END
+};
+
+enum parallel_source
+{
+  parallel_source_internal,
+  parallel_source_external
+};
+
+static const scpi_choice_def_t parallel_source_choices[] = {
+  { "INTernal", parallel_source_internal },
+  { "EXTernal", parallel_source_external },
+  SCPI_CHOICE_LIST_END
+};
+
 #define PARALLEL_BUF_SIZE (1024 * 60)
+/* waveforms are saved in the flash store as this prefix and their name */
+#define PARALLEL_KEY_PREFIX "par:"
+/* saved with the samples of a waveform */
+struct parallel_head
+{
+  uint32_t dwell;
+};
 struct parallel
 {
   uint16_t buffer[PARALLEL_BUF_SIZE / sizeof(uint16_t)];
-  size_t length;
+  size_t length; /* in bytes */
   size_t repeats;
+  int dwell;
+  enum parallel_source source;
+  /* loop region in samples, an end of 0 loops the whole buffer */
+  size_t loop_begin;
+  size_t loop_end;
+  int stop;
+  /* waveform location in the external memory */
+  uint32_t external_address;
+  uint32_t external_length; /* in samples */
 };
 
 struct parallel parallel = {
   .buffer = { 0 },
   .length = 0,
   .repeats = 0,
+  .dwell = 0,
+  .source = parallel_source_internal,
+  .loop_begin = 0,
+  .loop_end = 0,
+  .stop = 0,
+  .external_address = 0,
+  .external_length = 0,
 };
 
-static char scpi_input_buffer[SCPI_INPUT_BUFFER_LENGTH];
-static scpi_error_t scpi_error_queue_data[SCPI_ERROR_QUEUE_SIZE];
+static scpi_error_t
+  scpi_error_queue_data[ETHERNET_CONNECTIONS][SCPI_ERROR_QUEUE_SIZE];
 
 /* be systematic and lazy */
 #define SCPI_PATTERNS_BOTH(F)                                                  \
   F("MODE", mode)                                                              \
+  F("OSK:AMPLitude", osk_amplitude)                                            \
+  F("OSK:DURation", osk_duration)                                              \
+  F("OSK:MODE", osk_mode)                                                      \
+  F("OSK:PIN", osk_pin)                                                        \
+  F("OSK:RATE", osk_rate)                                                      \
+  F("OSK[:STATe]", osk_state)                                                  \
+  F("OSK:STEP", osk_step)                                                      \
   F("OUTput:STATe", output_state)                                              \
   F("OUTput:AMPLitude", output_amplitude)                                      \
   F("OUTput:FREQuency", output_frequency)                                      \
   F("PARallel:DATa", parallel_data)                                            \
+  F("PARallel:DWELl", parallel_dwell)                                          \
+  F("PARallel:EXTernal:ADDRess", parallel_external_address)                    \
+  F("PARallel:EXTernal:DATa", parallel_external_data)                          \
+  F("PARallel:EXTernal:LENgth", parallel_external_length)                      \
+  F("PARallel:EXTernal:TYPE", parallel_external_type)                          \
+  F("PARallel:FMGain", parallel_fm_gain)                                       \
   F("PARallel:FREQuency", parallel_frequency)                                  \
+  F("PARallel:LOOP:BEGin", parallel_loop_begin)                               \
+  F("PARallel:LOOP:END", parallel_loop_end)                                    \
+  F("PARallel:LOOP:STOP", parallel_loop_stop)                                  \
   F("PARallel:NCYCles", parallel_ncycles)                                      \
+  F("PARallel:SOURce", parallel_source)                                        \
   F("PARallel:STATe", parallel_state)                                          \
+  F("PARallel:STOP", parallel_stop)                                            \
   F("PARallel:TARget", parallel_target)                                        \
   F("RAMP:BOUNDary:MAXimum", ramp_boundary_maximum)                            \
   F("RAMP:BOUNDary:MINimum", ramp_boundary_minimum)                            \
+  F("RAMP:CHAin:STARt", ramp_chain_start)                                      \
   F("RAMP:DIRection", ramp_direction)                                          \
+  F("RAMP:DURation:DOWN", ramp_duration_down)                                  \
+  F("RAMP:DURation[:UP]", ramp_duration_up)                                    \
   F("RAMP:MODE", ramp_mode)                                                    \
   F("RAMP:RATE:DOWN", ramp_rate_down)                                          \
   F("RAMP:RATE:UP", ramp_rate_up)                                              \
+  F("RAMP:SPAN", ramp_span)                                                    \
   F("RAMP:STEP:DOWN", ramp_step_down)                                          \
   F("RAMP:STEP:UP", ramp_step_up)                                              \
   F("RAMP:TARget", ramp_target)                                                \
   F("SEQuence:NCYCles", sequence_ncycles)                                      \
+  F("SEQuence:SELect", sequence_select)                                        \
+  F("STATus:OPERation:ENABle", status_operation_enable)                        \
   F("SYSTem:NETwork:ADDRess", system_network_address)                          \
   F("SYSTem:NETwork:GATEway", system_network_gateway)                          \
   F("SYSTem:NETwork:SUBmask", system_network_submask)
 
 #define SCPI_PATTERNS_NO_QUERY(F)                                              \
+  F("PARallel:DATa:FREQuency", parallel_data_frequency)                        \
+  F("PARallel:DATa:POLar", parallel_data_polar)                                \
+  F("PARallel:LOAD", parallel_load)                                            \
+  F("PARallel:SAVE", parallel_save)                                            \
+  F("RAMP:CHAin:APPend", ramp_chain_append)                                    \
+  F("RAMP:CHAin:CLEar", ramp_chain_clear)                                      \
+  F("RAMP:CHAin:EXECute", ramp_chain_execute)                                  \
+  F("RAMP:COMPile:FUNCtion", ramp_compile_function)                            \
+  F("RAMP:COMPile:POINts", ramp_compile_points)                                \
+  F("SEQuence:ABORt", sequence_abort)                                          \
+  F("SEQuence:CALL", sequence_call)                                            \
   F("SEQuence:CLEAR", sequence_clear)                                          \
+  F("SEQuence:DELete", sequence_delete)                                        \
+  F("SEQuence:ELSE", sequence_else)                                            \
+  F("SEQuence:ENDif", sequence_endif)                                          \
+  F("SEQuence:IF", sequence_if)                                                \
+  F("SEQuence:INCRement", sequence_increment)                                  \
+  F("SEQuence:JUMP", sequence_jump)                                            \
+  F("SEQuence:LOAD", sequence_load)                                            \
+  F("SEQuence:LOOP", sequence_loop)                                            \
+  F("SEQuence:LOOP:END", sequence_loop_end)                                    \
+  F("SEQuence:RETurn", sequence_return)                                        \
+  F("SEQuence:SAVE", sequence_save)                                            \
+  F("SEQuence:SCALe", sequence_scale)                                          \
+  F("SEQuence:STEP:APPend", sequence_step_append)                              \
+  F("SEQuence:STEP#:DELete", sequence_step_delete)                             \
+  F("SEQuence:STEP#:INSert", sequence_step_insert)                             \
+  F("SEQuence:STEP#:REPLace", sequence_step_replace)                           \
+  F("SEQuence:SUBroutine", sequence_subroutine)                                \
   F("STARTup:CLEAR", startup_clear)                                            \
   F("STARTup:SAVE", startup_save)                                              \
+  F("SYSTem:NETwork:BENChmark", system_network_benchmark)                      \
   F("TRIGger:SEND", trigger_send)                                              \
   F("TRIGger:WAIT", trigger_wait)                                              \
   F("WAIT", wait)
 
 #define SCPI_PATTERNS_ONLY_QUERY(F)                                            \
   F("*TST", test)                                                              \
+  F("PARallel:EXTernal:RATE", parallel_external_rate)                          \
+  F("PARallel:EXTernal:UNDerrun", parallel_external_underrun)                  \
+  F("RAMP:CHAin:COUNt", ramp_chain_count)                                      \
+  F("RAMP:SOLVe", ramp_solve)                                                  \
   F("REGister", register)                                                      \
+  F("SEQuence:CATalog", sequence_catalog)                                      \
+  F("SEQuence:STATus", sequence_status)                                        \
+  F("SEQuence:STEP:COUNt", sequence_step_count)                                \
+  F("STATus:OPERation[:EVENt]", status_operation_event)                        \
+  F("SYSTem:BOOT", system_boot)                                                \
   F("SYSTem:PLL", system_pll)
 
 #define SCPI_PATTERNS(F)                                                       \
@@ -118,6 +229,13 @@ static const scpi_command_t scpi_commands[] = {
   /* Required SCPI commands (SCPI std V1999.0 4.2.1) */
   {.pattern = "SYSTem:ERRor[:NEXT]?", .callback = SCPI_SystemErrorNextQ },
   {.pattern = "SYSTem:ERRor:COUNt?", .callback = SCPI_SystemErrorCountQ },
+  {.pattern = "STATus:QUEStionable[:EVENt]?",
+   .callback = SCPI_StatusQuestionableEventQ },
+  {.pattern = "STATus:QUEStionable:ENABle",
+   .callback = SCPI_StatusQuestionableEnable },
+  {.pattern = "STATus:QUEStionable:ENABle?",
+   .callback = SCPI_StatusQuestionableEnableQ },
+  {.pattern = "STATus:PRESet", .callback = SCPI_StatusPreset },
   {.pattern = "SYSTem:VERSion?", .callback = SCPI_SystemVersionQ },
 
   SCPI_PATTERNS(SCPI_CALLBACK_LIST) SCPI_CMD_LIST_END
@@ -128,6 +246,9 @@ static scpi_result_t scpi_param_amplitude(scpi_t*, uint32_t*);
 static scpi_result_t scpi_param_ramp(scpi_t*, uint32_t*);
 static scpi_result_t scpi_param_ramp_rate(scpi_t*, uint32_t*);
 static scpi_result_t scpi_param_ip_address(scpi_t*, uint8_t[4]);
+static scpi_result_t scpi_param_ramp_value(scpi_t*, double*, double*,
+                                           scpi_bool_t);
+static scpi_result_t scpi_param_time(scpi_t*, double*, scpi_bool_t);
 
 static scpi_result_t scpi_print_unit(scpi_t*, float, scpi_unit_t);
 static scpi_result_t scpi_print_amplitude(scpi_t*, float);
@@ -144,41 +265,48 @@ static scpi_result_t scpi_parse_register_command(
   scpi_t*, const ad9910_register_bit*, scpi_result_t (*)(scpi_t*, uint32_t*));
 static scpi_result_t scpi_parse_pin_command(scpi_t*, const gpio_pin);
 
+static scpi_result_t scpi_control(scpi_t*, scpi_ctrl_name_t, scpi_reg_val_t);
 static int scpi_error(scpi_t* context, int_fast16_t err);
 static size_t scpi_write(scpi_t* context, const char* data, size_t len);
 
 static void scpi_process_wait(uint32_t time);
 static void scpi_process_trigger(void);
 
-static void scpi_process_command_register(const command_register*);
+static void scpi_process_command_register_add(const command_register_add*);
+static void scpi_process_command_register_scale(const command_register_scale*);
 static void scpi_process_command_pin(const command_pin*);
-static void scpi_process_command_trigger(const command_trigger*);
-static void scpi_process_command_update(const command_update*);
-static void scpi_process_command_wait(const command_wait*);
 static void scpi_process_command_parallel(const command_parallel*);
+static void scpi_process_command_parallel_external(
+  const command_parallel_external*);
+static void scpi_process_command_ramp_chain(const command_ramp_chain*);
 
 /* this struct defines the main communictation functions used by the
  * library. Write is mandatory, all others are optional */
 static scpi_interface_t scpi_interface = {
-  .control = NULL,
+  .control = scpi_control,
   .error = scpi_error,
   .flush = NULL,
   .reset = NULL,
   .write = scpi_write,
 };
 
-/* this struct contains all necessary information for the SCPI library */
-static scpi_t scpi_context = {
-  .cmdlist = scpi_commands,
-  .buffer =
-    {
-      .length = SCPI_INPUT_BUFFER_LENGTH,
-      .data = scpi_input_buffer,
-    },
-  .interface = &scpi_interface,
-  .units = scpi_units_def,
-  .idn = { "LOREM-IPSUM", "CamDDS", NULL, "2016-07-19" },
-};
+/* every connection has its own parser state and error queue */
+static scpi_t scpi_contexts[ETHERNET_CONNECTIONS];
+
+/* raw sockets have no service request line, it is pushed to the event
+ * client instead */
+static scpi_result_t
+scpi_control(scpi_t* context, scpi_ctrl_name_t ctrl, scpi_reg_val_t val)
+{
+  if (ctrl == SCPI_CTRL_SRQ) {
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "SRQ,%d,%u\n",
+                             (int)(context - scpi_contexts), (unsigned)val);
+    events_push(buf, len);
+  }
+
+  return SCPI_RES_OK;
+}
 
 static int
 scpi_error(scpi_t* context, int_fast16_t err)
@@ -205,16 +333,88 @@ scpi_write(scpi_t* context, const char* data, size_t len)
 void
 scpi_init()
 {
-  SCPI_Init(&scpi_context, scpi_commands, &scpi_interface, scpi_units_def,
-            "LOREM-IPSUM", "CamDDS", NULL, "2016-04-26", scpi_input_buffer,
-            SCPI_INPUT_BUFFER_LENGTH, scpi_error_queue_data,
-            SCPI_ERROR_QUEUE_SIZE);
+  for (size_t i = 0; i < ETHERNET_CONNECTIONS; ++i) {
+    SCPI_Init(&scpi_contexts[i], scpi_commands, &scpi_interface,
+              scpi_units_def, "LOREM-IPSUM", "CamDDS", NULL, "2016-04-26",
+              NULL, 0, scpi_error_queue_data[i], SCPI_ERROR_QUEUE_SIZE);
+  }
+}
+
+void
+scpi_connect(size_t connection)
+{
+  SCPI_ErrorClear(&scpi_contexts[connection]);
 }
 
 int
-scpi_process(char* data, int len)
+scpi_process(size_t connection, char* data, int len)
+{
+  return SCPI_Parse(&scpi_contexts[connection], data, len);
+}
+
+void
+scpi_event(enum event_type type)
+{
+  for (size_t i = 0; i < ETHERNET_CONNECTIONS; ++i) {
+    switch (type) {
+      case event_sequence_done:
+      case event_sequence_aborted:
+        SCPI_RegSetBits(&scpi_contexts[i], SCPI_REG_OPER, SCPI_OPER_SEQUENCE);
+        break;
+      case event_pll_lost:
+        SCPI_RegSetBits(&scpi_contexts[i], SCPI_REG_QUES, SCPI_QUES_PLL);
+        break;
+    }
+  }
+}
+
+enum scpi_stop
+scpi_is_abort(const char* data, size_t len)
+{
+  static const struct
+  {
+    const char* header;
+    enum scpi_stop stop;
+  } headers[] = {
+    { "SEQ:ABOR", scpi_stop_abort },
+    { "SEQ:ABORT", scpi_stop_abort },
+    { "SEQUENCE:ABOR", scpi_stop_abort },
+    { "SEQUENCE:ABORT", scpi_stop_abort },
+    { "PAR:STOP", scpi_stop_parallel },
+    { "PARALLEL:STOP", scpi_stop_parallel },
+  };
+
+  const char* end = data + len;
+  while (data < end && (isspace((unsigned char)*data) || *data == ':')) {
+    data++;
+  }
+
+  size_t header = 0;
+  while (data + header < end && !isspace((unsigned char)data[header])) {
+    header++;
+  }
+
+  /* only whitespace may follow, no further commands */
+  for (const char* p = data + header; p < end; ++p) {
+    if (!isspace((unsigned char)*p)) {
+      return scpi_stop_none;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(headers) / sizeof(*headers); ++i) {
+    if (strlen(headers[i].header) == header &&
+        strncasecmp(data, headers[i].header, header) == 0) {
+      return headers[i].stop;
+    }
+  }
+
+  return scpi_stop_none;
+}
+
+void
+scpi_input_overrun(size_t connection)
 {
-  return SCPI_Parse(&scpi_context, data, len);
+  SCPI_ErrorPush(&scpi_contexts[connection], SCPI_ERROR_INPUT_BUFFER_OVERRUN);
 }
 
 /* this should return 0 if everything is ok, 1 if some error exists */
@@ -234,16 +434,59 @@ scpi_callback_mode(scpi_t* context)
     return SCPI_RES_ERR;
   }
 
-  current_mode = value;
+  /* optionally a stored sequence other than the selected one is run */
+  const char* name = NULL;
+  size_t len = 0;
+  if (value == scpi_mode_execute &&
+      !SCPI_ParamCharacters(context, &name, &len, FALSE)) {
+    name = NULL;
+  }
 
-  if (current_mode == scpi_mode_execute) {
-    command_execute_flag = 1;
-    current_mode = scpi_mode_normal;
+  switch (scpi_set_mode(value, name, len)) {
+    case 1:
+      SCPI_ErrorPush(context, SCPI_ERROR_PROGRAM_SYNTAX_ERROR);
+      return SCPI_RES_ERR;
+    case 2:
+      SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+      return SCPI_RES_ERR;
   }
 
   return SCPI_RES_OK;
 }
 
+int
+scpi_set_mode(enum scpi_mode mode, const char* name, size_t len)
+{
+  current_mode = mode;
+
+  /* an insertion position only lasts until the programming is finished */
+  commands_step_append();
+
+  if (current_mode != scpi_mode_execute) {
+    return 0;
+  }
+
+  current_mode = scpi_mode_normal;
+
+  if (commands_link()) {
+    return 1;
+  }
+
+  if (name != NULL && commands_execute_select(name, len)) {
+    return 2;
+  }
+
+  command_execute_flag = 1;
+
+  return 0;
+}
+
+enum scpi_mode
+scpi_get_mode()
+{
+  return current_mode;
+}
+
 static scpi_result_t
 scpi_callback_mode_q(scpi_t* context)
 {
@@ -269,600 +512,2179 @@ scpi_callback_parallel_data(scpi_t* context)
     return SCPI_RES_ERR;
   }
 
-  parallel.length = len;
+  parallel.length = 0;
+
+  if (ethernet_copy_data(parallel.buffer, len, ptr)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
 
-  len = ethernet_copy_data(parallel.buffer, len,
-                           (context->param_list.lex_state.pos -
-                            context->param_list.cmd_raw.data - len));
+  parallel.length = len;
 
   SCPI_ResultUInt32(context, len);
 
   return SCPI_RES_OK;
 }
 
+/* builds the store key of a named waveform */
 static scpi_result_t
-scpi_callback_parallel_data_q(scpi_t* context)
+scpi_param_parallel_key(scpi_t* context, char key[STORE_CHUNKED_KEY_LENGTH])
 {
-  SCPI_ResultArbitraryBlock(context, parallel.buffer, parallel.length);
+  const char* name;
+  size_t len;
+  if (!SCPI_ParamCharacters(context, &name, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (len == 0 ||
+      len >= STORE_CHUNKED_KEY_LENGTH - strlen(PARALLEL_KEY_PREFIX)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+    return SCPI_RES_ERR;
+  }
+
+  strcpy(key, PARALLEL_KEY_PREFIX);
+  strncat(key, name, len);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_parallel_frequency(scpi_t* context)
+scpi_callback_parallel_load(scpi_t* context)
 {
-  scpi_number_t value;
-  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value, TRUE)) {
-    return SCPI_RES_ERR;
-  }
-
-  if (!value.special || value.unit != SCPI_UNIT_HERTZ) {
-    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+  char key[STORE_CHUNKED_KEY_LENGTH];
+  if (scpi_param_parallel_key(context, key) != SCPI_RES_OK) {
     return SCPI_RES_ERR;
   }
 
-  if (value.value < 0 || value.value > 1e6) {
-    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+  struct parallel_head head;
+  size_t len;
+  if (store_get_chunked(key, &head, sizeof(head), parallel.buffer,
+                        sizeof(parallel.buffer), &len)) {
+    /* a broken waveform may have been copied in part */
+    parallel.length = 0;
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
     return SCPI_RES_ERR;
   }
 
-  switch (current_mode) {
-    default:
-      ad9910_set_parallel_frequency(value.value);
-      break;
-    case scpi_mode_program: {
-      /* TODO parallel frequency command */
-      const command_parallel_frequency cmd = {
-        .frequency = value.value,
-      };
-      command_queue_parallel_frequency(&cmd);
-      break;
-    }
-  }
+  parallel.length = len;
+  parallel.dwell = head.dwell;
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_parallel_frequency_q(scpi_t* context)
-{
-  return scpi_print_frequency(context, ad9910_get_parallel_frequency());
-}
-
-static scpi_result_t
-scpi_callback_parallel_ncycles(scpi_t* context)
+scpi_callback_parallel_save(scpi_t* context)
 {
-  uint32_t value;
-  if (SCPI_ParamUInt32(context, &value, true) != SCPI_RES_OK) {
+  char key[STORE_CHUNKED_KEY_LENGTH];
+  if (scpi_param_parallel_key(context, key) != SCPI_RES_OK) {
     return SCPI_RES_ERR;
   }
 
-  parallel.repeats = value;
+  /* waveforms are split into chunks, they can be larger than a sector */
+  const struct parallel_head head = {.dwell = parallel.dwell };
+  if (store_put_chunked(key, &head, sizeof(head), parallel.buffer,
+                        parallel.length)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_MEDIA_FULL);
+    return SCPI_RES_ERR;
+  }
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_parallel_ncycles_q(scpi_t* context)
+scpi_callback_parallel_data_q(scpi_t* context)
 {
-  SCPI_ResultUInt32(context, parallel.repeats);
+  SCPI_ResultArbitraryBlock(context, parallel.buffer, parallel.length);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_parallel_state(scpi_t* context)
+scpi_callback_parallel_data_frequency(scpi_t* context)
 {
-  scpi_bool_t value;
-  if (SCPI_ParamBool(context, &value, true) != SCPI_RES_OK) {
+  uint32_t base;
+  if (scpi_param_frequency(context, &base) != SCPI_RES_OK) {
     return SCPI_RES_ERR;
   }
 
-  const command_parallel cmd = {
-    .data = parallel.buffer,
-    .length = parallel.length,
-    .repeats = parallel.repeats,
-  };
-  scpi_process_command_parallel(&cmd);
+  const char* ptr;
+  size_t len;
+  if (!SCPI_ParamArbitraryBlock(context, &ptr, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (len > PARALLEL_BUF_SIZE) {
+    SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
+    return SCPI_RES_ERR;
+  }
+
+  /* the samples are 32 bit floats, dwell pairs aren't supported */
+  if (len % sizeof(float) || parallel.dwell) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  /* the buffer is overwritten, the old waveform is gone in any case */
+  parallel.length = 0;
+
+  if (ethernet_copy_data(parallel.buffer, len, ptr)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  const size_t samples = len / sizeof(float);
+
+  uint32_t ftw;
+  const int gain =
+    ad9910_pack_parallel_frequency(base, parallel.buffer, samples, &ftw);
+  if (gain < 0) {
+    parallel.length = 0;
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  parallel.length = samples * sizeof(uint16_t);
+
+  const command_register gain_cmd = {.reg = &ad9910_fm_gain, .value = gain };
+  scpi_process_command_register(&gain_cmd);
+
+  const command_register ftw_cmd = {.reg = &ad9910_ftw, .value = ftw };
+  scpi_process_command_register(&ftw_cmd);
+
+  SCPI_ResultUInt32(context, len);
 
   return SCPI_RES_OK;
 }
 
-static scpi_result_t
-scpi_callback_parallel_state_q(scpi_t* context)
+enum parallel_polar_format
 {
-  return scpi_print_register(context, &ad9910_parallel_data_port_enable,
-                             scpi_print_boolean);
-}
+  parallel_polar_raw,
+  parallel_polar_physical
+};
 
-static const scpi_choice_def_t parallel_target_choices[] = {
-  { "FREQuency", ad9910_parallel_frequency },
-  { "AMPLitude", ad9910_parallel_amplitude },
-  { "PHASe", ad9910_parallel_phase },
-  { "POLar", ad9910_parallel_polar },
+static const scpi_choice_def_t parallel_polar_choices[] = {
+  { "RAW", parallel_polar_raw },
+  { "PHYSical", parallel_polar_physical },
   SCPI_CHOICE_LIST_END
 };
 
 static scpi_result_t
-scpi_callback_parallel_target(scpi_t* context)
+scpi_callback_parallel_data_polar(scpi_t* context)
 {
-  int32_t value;
-  if (!SCPI_ParamChoice(context, parallel_target_choices, &value, TRUE)) {
+  int32_t format;
+  if (!SCPI_ParamChoice(context, parallel_polar_choices, &format, TRUE)) {
     return SCPI_RES_ERR;
   }
 
-  const command_pin t0cmd = {
-    .pin = PARALLEL_F0, .value = value & 0x1,
-  };
-  scpi_process_command_pin(&t0cmd);
+  const char* ptr;
+  size_t len;
+  if (!SCPI_ParamArbitraryBlock(context, &ptr, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  const command_pin t1cmd = {
-    .pin = PARALLEL_F1, .value = !!(value & 0x2),
-  };
-  scpi_process_command_pin(&t1cmd);
+  if (len > PARALLEL_BUF_SIZE) {
+    SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
+    return SCPI_RES_ERR;
+  }
 
-  return SCPI_RES_OK;
-}
+  /* raw pairs are two 16 bit values, physical pairs two 32 bit floats */
+  const size_t pair_size =
+    format == parallel_polar_raw ? 2 * sizeof(uint16_t) : 2 * sizeof(float);
 
-static scpi_result_t
-scpi_callback_parallel_target_q(scpi_t* context)
-{
-  parallel_mode mode = gpio_get(PARALLEL_F0) | (gpio_get(PARALLEL_F1) << 1);
+  if (len % pair_size || parallel.dwell) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
 
-  const char* name;
-  SCPI_ChoiceToName(parallel_target_choices, mode, &name);
+  parallel.length = 0;
 
-  SCPI_ResultCharacters(context, name, strlen(name));
+  if (ethernet_copy_data(parallel.buffer, len, ptr)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  const size_t samples = len / pair_size;
+
+  if (format == parallel_polar_raw) {
+    ad9910_pack_parallel_polar_raw(parallel.buffer, samples);
+  } else {
+    ad9910_pack_parallel_polar(parallel.buffer, samples);
+  }
+
+  parallel.length = samples * sizeof(uint16_t);
+
+  SCPI_ResultUInt32(context, len);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_output_state(scpi_t* context)
+scpi_callback_parallel_dwell(scpi_t* context)
 {
-  return scpi_parse_pin_command(context, RF_SWITCH);
-}
+  scpi_bool_t value;
+  if (!SCPI_ParamBool(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-static scpi_result_t
-scpi_callback_output_state_q(scpi_t* context)
-{
-  return scpi_print_pin(context, RF_SWITCH);
+  parallel.dwell = value;
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_output_frequency(scpi_t* context)
+scpi_callback_parallel_dwell_q(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_profile_frequency,
-                                     scpi_param_frequency);
+  SCPI_ResultBool(context, parallel.dwell);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_output_frequency_q(scpi_t* context)
+scpi_callback_parallel_external_address(scpi_t* context)
 {
-  uint32_t freq = ad9910_get_profile_value(0, ad9910_profile_frequency);
+  uint32_t value;
+  if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  return scpi_print_frequency(context, ad9910_backconvert_frequency(freq));
+  /* samples are 16 bit wide */
+  if (value >= EXTMEM_SIZE || value % sizeof(uint16_t)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  parallel.external_address = value;
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_output_amplitude(scpi_t* context)
+scpi_callback_parallel_external_address_q(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_profile_amplitude,
-                                     scpi_param_amplitude);
+  SCPI_ResultUInt32(context, parallel.external_address);
+
+  return SCPI_RES_OK;
 }
 
-static scpi_result_t
-scpi_callback_output_amplitude_q(scpi_t* context)
+static int
+scpi_extmem_sink(const void* data, size_t len, size_t offset, void* address)
 {
-  uint32_t ampl = ad9910_get_profile_value(0, ad9910_profile_amplitude);
-
-  return scpi_print_amplitude(context, ad9910_backconvert_amplitude(ampl));
+  return extmem_write(*(const uint32_t*)address + offset, data, len);
 }
 
 static scpi_result_t
-scpi_callback_ramp_boundary_minimum(scpi_t* context)
+scpi_callback_parallel_external_data(scpi_t* context)
+{
+  uint32_t address;
+  if (!SCPI_ParamUInt32(context, &address, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  const char* ptr;
+  size_t len;
+  if (!SCPI_ParamArbitraryBlock(context, &ptr, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (address > EXTMEM_SIZE || len > EXTMEM_SIZE - address) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  /* the data is written to the memory while it is received, so the size
+   * is only limited by the memory */
+  if (ethernet_receive_block(ptr, len, scpi_extmem_sink, &address)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  SCPI_ResultUInt32(context, len);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_data_q(scpi_t* context)
+{
+  uint32_t address, len;
+  if (!SCPI_ParamUInt32(context, &address, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+  if (!SCPI_ParamUInt32(context, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (len > PARALLEL_BUF_SIZE) {
+    SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
+    return SCPI_RES_ERR;
+  }
+
+  /* a running sequence may stream from the memory */
+  if (commands_running()) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  if (address > EXTMEM_SIZE || len > EXTMEM_SIZE - address) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  /* read in pieces, the waveform in the parallel buffer is kept */
+  char buf[256];
+  SCPI_ResultArbitraryBlockHeader(context, len);
+  for (uint32_t i = 0; i < len; i += sizeof(buf)) {
+    const size_t n = min(len - i, sizeof(buf));
+    extmem_read(address + i, buf, n);
+    SCPI_ResultArbitraryBlockData(context, buf, n);
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_length(scpi_t* context)
+{
+  uint32_t value;
+  if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  parallel.external_length = value;
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_length_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, parallel.external_length);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_rate_q(scpi_t* context)
+{
+  return scpi_print_frequency(context, extmem_max_sample_rate());
+}
+
+static const scpi_choice_def_t extmem_type_choices[] = {
+  { "SRAM", extmem_type_sram },
+  { "FLASh", extmem_type_flash },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_parallel_external_type(scpi_t* context)
+{
+  int32_t value;
+  if (!SCPI_ParamChoice(context, extmem_type_choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  extmem_set_type(value);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_type_q(scpi_t* context)
+{
+  const char* name;
+  SCPI_ChoiceToName(extmem_type_choices, extmem_get_type(), &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_external_underrun_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, extmem_stream_get_underruns());
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_fm_gain(scpi_t* context)
+{
+  uint32_t value;
+  if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value > 15) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register cmd = {.reg = &ad9910_fm_gain, .value = value };
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_fm_gain_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, ad9910_get_value(ad9910_fm_gain));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_frequency(scpi_t* context)
+{
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (!value.special || value.unit != SCPI_UNIT_HERTZ) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  if (value.value < 0 || value.value > 1e6) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  switch (current_mode) {
+    default:
+      ad9910_set_parallel_frequency(value.value);
+      break;
+    case scpi_mode_program: {
+      /* TODO parallel frequency command */
+      const command_parallel_frequency cmd = {
+        .frequency = value.value,
+      };
+      command_queue_parallel_frequency(&cmd);
+      break;
+    }
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_frequency_q(scpi_t* context)
+{
+  return scpi_print_frequency(context, ad9910_get_parallel_frequency());
+}
+
+static scpi_result_t
+scpi_callback_parallel_loop_begin(scpi_t* context)
+{
+  uint32_t value;
+  if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  /* the loop region must not be empty, it would repeat nothing */
+  if (parallel.loop_end != 0 && value >= parallel.loop_end) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  parallel.loop_begin = value;
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_loop_begin_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, parallel.loop_begin);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_loop_end(scpi_t* context)
+{
+  uint32_t value;
+  if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value != 0 && value <= parallel.loop_begin) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  parallel.loop_end = value;
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_loop_end_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, parallel.loop_end);
+
+  return SCPI_RES_OK;
+}
+
+static const scpi_choice_def_t parallel_stop_choices[] = {
+  { "NONE", 0 },
+  { "TRIGger", ad9910_parallel_stop_trigger },
+  { "NETwork", ad9910_parallel_stop_request },
+  { "ANY", ad9910_parallel_stop_trigger | ad9910_parallel_stop_request },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_parallel_loop_stop(scpi_t* context)
+{
+  int32_t value;
+  if (!SCPI_ParamChoice(context, parallel_stop_choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  parallel.stop = value;
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_loop_stop_q(scpi_t* context)
+{
+  const char* name;
+  SCPI_ChoiceToName(parallel_stop_choices, parallel.stop, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_ncycles(scpi_t* context)
+{
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value.special) {
+    if (value.tag != SCPI_NUM_INF) {
+      SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+      return SCPI_RES_ERR;
+    }
+
+    parallel.repeats = AD9910_PARALLEL_FOREVER;
+  } else {
+    if (value.value < 0 || value.value > UINT32_MAX) {
+      SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return SCPI_RES_ERR;
+    }
+
+    parallel.repeats = value.value;
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_ncycles_q(scpi_t* context)
+{
+  if (parallel.repeats == AD9910_PARALLEL_FOREVER) {
+    SCPI_ResultCharacters(context, "INF", 3);
+  } else {
+    SCPI_ResultUInt32(context, parallel.repeats);
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_source(scpi_t* context)
+{
+  int32_t value;
+  if (!SCPI_ParamChoice(context, parallel_source_choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  parallel.source = value;
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_source_q(scpi_t* context)
+{
+  const char* name;
+  SCPI_ChoiceToName(parallel_source_choices, parallel.source, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_state(scpi_t* context)
+{
+  scpi_bool_t value;
+  if (SCPI_ParamBool(context, &value, true) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  if (parallel.repeats == AD9910_PARALLEL_FOREVER && parallel.stop == 0) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  if (parallel.source == parallel_source_external) {
+    /* the external memory only holds plain values and doesn't support
+     * loop points */
+    if (parallel.dwell || parallel.repeats == AD9910_PARALLEL_FOREVER) {
+      SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+      return SCPI_RES_ERR;
+    }
+
+    if (parallel.external_length >
+        (EXTMEM_SIZE - parallel.external_address) / sizeof(uint16_t)) {
+      SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return SCPI_RES_ERR;
+    }
+
+    const command_parallel_external cmd = {
+      .address = parallel.external_address,
+      .length = parallel.external_length,
+      .repeats = parallel.repeats,
+    };
+    scpi_process_command_parallel_external(&cmd);
+
+    return SCPI_RES_OK;
+  }
+
+  /* the buffer either holds plain values or value/dwell pairs */
+  const size_t sample_size =
+    parallel.dwell ? sizeof(ad9910_parallel_sample) : sizeof(uint16_t);
+
+  const size_t length = parallel.length / sample_size;
+  const size_t loop_end = parallel.loop_end ? parallel.loop_end : length;
+
+  /* the end defaults to the buffer length, which may have shrunk */
+  if (parallel.loop_begin >= loop_end || loop_end > length) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  /* dwell playback always loops the whole buffer a fixed number of times */
+  if (parallel.dwell &&
+      (parallel.loop_begin != 0 || loop_end != length ||
+       parallel.repeats == AD9910_PARALLEL_FOREVER)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  /* the hold time of every sample has to fit into the 32 bit timer */
+  if (parallel.dwell) {
+    const ad9910_parallel_sample* samples =
+      (const ad9910_parallel_sample*)parallel.buffer;
+    const uint32_t max_dwell = ad9910_get_parallel_max_dwell();
+    for (size_t i = 0; i < length; ++i) {
+      if (samples[i].dwell > max_dwell) {
+        SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return SCPI_RES_ERR;
+      }
+    }
+  }
+
+  const command_parallel cmd = {
+    .data = parallel.buffer,
+    .length = length,
+    .repeats = parallel.repeats,
+    .dwell = parallel.dwell,
+    .loop_begin = parallel.loop_begin,
+    .loop_end = loop_end,
+    .stop = parallel.stop,
+  };
+  scpi_process_command_parallel(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_stop(scpi_t* context)
+{
+  /* a playback started directly has already been stopped when its loop
+   * noticed this command arriving, one in a running sequence is stopped
+   * once it gets to check its stop condition */
+  commands_parallel_stop();
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_stop_q(scpi_t* context)
+{
+  SCPI_ResultBool(context, commands_parallel_stopped());
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_state_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_parallel_data_port_enable,
+                             scpi_print_boolean);
+}
+
+static const scpi_choice_def_t parallel_target_choices[] = {
+  { "FREQuency", ad9910_parallel_frequency },
+  { "AMPLitude", ad9910_parallel_amplitude },
+  { "PHASe", ad9910_parallel_phase },
+  { "POLar", ad9910_parallel_polar },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_parallel_target(scpi_t* context)
+{
+  int32_t value;
+  if (!SCPI_ParamChoice(context, parallel_target_choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  const command_pin t0cmd = {
+    .pin = PARALLEL_F0, .value = value & 0x1,
+  };
+  scpi_process_command_pin(&t0cmd);
+
+  const command_pin t1cmd = {
+    .pin = PARALLEL_F1, .value = !!(value & 0x2),
+  };
+  scpi_process_command_pin(&t1cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_parallel_target_q(scpi_t* context)
+{
+  parallel_mode mode = gpio_get(PARALLEL_F0) | (gpio_get(PARALLEL_F1) << 1);
+
+  const char* name;
+  SCPI_ChoiceToName(parallel_target_choices, mode, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_output_state(scpi_t* context)
+{
+  return scpi_parse_pin_command(context, RF_SWITCH);
+}
+
+static scpi_result_t
+scpi_callback_output_state_q(scpi_t* context)
+{
+  return scpi_print_pin(context, RF_SWITCH);
+}
+
+static scpi_result_t
+scpi_callback_output_frequency(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_profile_frequency,
+                                     scpi_param_frequency);
+}
+
+static scpi_result_t
+scpi_callback_output_frequency_q(scpi_t* context)
+{
+  uint32_t freq = ad9910_get_profile_value(0, ad9910_profile_frequency);
+
+  return scpi_print_frequency(context, ad9910_backconvert_frequency(freq));
+}
+
+static scpi_result_t
+scpi_callback_output_amplitude(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_profile_amplitude,
+                                     scpi_param_amplitude);
+}
+
+static scpi_result_t
+scpi_callback_output_amplitude_q(scpi_t* context)
+{
+  uint32_t ampl = ad9910_get_profile_value(0, ad9910_profile_amplitude);
+
+  return scpi_print_amplitude(context, ad9910_backconvert_amplitude(ampl));
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_append(scpi_t* context)
+{
+  uint32_t target, step, rate;
+  if (scpi_param_ramp(context, &target) != SCPI_RES_OK ||
+      scpi_param_ramp(context, &step) != SCPI_RES_OK ||
+      scpi_param_ramp_rate(context, &rate) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  const ramp_segment segment = {
+    .target = target, .step = step, .rate = rate,
+  };
+
+  if (ramp_chain_append(&segment)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_clear(scpi_t* context)
+{
+  ramp_chain_clear();
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_count_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, ramp_chain_length());
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_execute(scpi_t* context)
+{
+  if (current_mode == scpi_mode_program) {
+    scpi_process_command_ramp_chain(NULL);
+  } else if (ramp_chain_execute()) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_start(scpi_t* context)
+{
+  uint32_t value;
+  if (scpi_param_ramp(context, &value) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  ramp_chain_set_start(value);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_chain_start_q(scpi_t* context)
+{
+  return scpi_print_ramp(context, ramp_chain_get_start());
+}
+
+static const scpi_choice_def_t ramp_shape_choices[] = {
+  { "LINear", ramp_shape_linear },
+  { "EXPonential", ramp_shape_exponential },
+  { "TANH", ramp_shape_tanh },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_ramp_compile_function(scpi_t* context)
+{
+  int32_t shape;
+  if (!SCPI_ParamChoice(context, ramp_shape_choices, &shape, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  double start, stop, error, scale;
+  if (scpi_param_ramp_value(context, &start, &scale, TRUE) != SCPI_RES_OK ||
+      scpi_param_ramp_value(context, &stop, &scale, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  double duration;
+  if (scpi_param_time(context, &duration, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  if (scpi_param_ramp_value(context, &error, &scale, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  double steepness = 2;
+  SCPI_ParamDouble(context, &steepness, FALSE);
+
+  if (ramp_chain_compile_function(shape, start, stop, duration,
+                                  steepness, error)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  SCPI_ResultUInt32(context, ramp_chain_length());
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_compile_points(scpi_t* context)
+{
+  /* the unit of the error also applies to the values of the points */
+  double error, scale;
+  if (scpi_param_ramp_value(context, &error, &scale, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  const char* ptr;
+  size_t len;
+  if (!SCPI_ParamArbitraryBlock(context, &ptr, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (len > PARALLEL_BUF_SIZE) {
+    SCPI_ErrorPush(context, SCPI_ERROR_TOO_MUCH_DATA);
+    return SCPI_RES_ERR;
+  }
+
+  if (len % (2 * sizeof(float))) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  /* the points are staged in the parallel buffer */
+  parallel.length = 0;
+
+  if (ethernet_copy_data(parallel.buffer, len, ptr)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  if (ramp_chain_compile_points(parallel.buffer, len / (2 * sizeof(float)),
+                                scale, error)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  SCPI_ResultUInt32(context, ramp_chain_length());
+
+  return SCPI_RES_OK;
+}
+
+static uint32_t
+scpi_ramp_span()
+{
+  const uint32_t upper = ad9910_get_value(ad9910_ramp_upper_limit);
+  const uint32_t lower = ad9910_get_value(ad9910_ramp_lower_limit);
+
+  return upper > lower ? upper - lower : 0;
+}
+
+static scpi_result_t
+scpi_parse_ramp_duration(scpi_t* context, const ad9910_register_bit* step,
+                         const ad9910_register_bit* rate)
+{
+  double duration;
+  if (scpi_param_time(context, &duration, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  ramp_solution solution;
+  if (ramp_solve(scpi_ramp_span(), duration, &solution)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register step_cmd = {.reg = step, .value = solution.step };
+  scpi_process_command_register(&step_cmd);
+
+  const command_register rate_cmd = {.reg = rate, .value = solution.rate };
+  scpi_process_command_register(&rate_cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_duration_down(scpi_t* context)
+{
+  return scpi_parse_ramp_duration(context, &ad9910_ramp_decrement_step,
+                                  &ad9910_ramp_negative_rate);
+}
+
+static scpi_result_t
+scpi_callback_ramp_duration_down_q(scpi_t* context)
+{
+  SCPI_ResultDouble(
+    context,
+    ramp_duration(scpi_ramp_span(),
+                  ad9910_get_value(ad9910_ramp_decrement_step),
+                  ad9910_get_value(ad9910_ramp_negative_rate)));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_duration_up(scpi_t* context)
+{
+  return scpi_parse_ramp_duration(context, &ad9910_ramp_increment_step,
+                                  &ad9910_ramp_positive_rate);
+}
+
+static scpi_result_t
+scpi_callback_ramp_duration_up_q(scpi_t* context)
+{
+  SCPI_ResultDouble(
+    context,
+    ramp_duration(scpi_ramp_span(),
+                  ad9910_get_value(ad9910_ramp_increment_step),
+                  ad9910_get_value(ad9910_ramp_positive_rate)));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_solve_q(scpi_t* context)
+{
+  /* any number of span/duration pairs, every pair is answered with
+   * step, rate and the achieved duration */
+  for (int first = 1;; first = 0) {
+    double span, scale;
+    if (scpi_param_ramp_value(context, &span, &scale, first) !=
+        SCPI_RES_OK) {
+      return SCPI_ParamErrorOccurred(context) ? SCPI_RES_ERR : SCPI_RES_OK;
+    }
+
+    double duration;
+    if (scpi_param_time(context, &duration, TRUE) != SCPI_RES_OK) {
+      return SCPI_RES_ERR;
+    }
+
+    ramp_solution solution;
+    if (span < 1 || span > UINT32_MAX ||
+        ramp_solve(nearbyint(span), duration, &solution)) {
+      SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+      return SCPI_RES_ERR;
+    }
+
+    SCPI_ResultUInt32(context, solution.step);
+    SCPI_ResultUInt32(context, solution.rate);
+    SCPI_ResultDouble(context, solution.duration);
+  }
+}
+
+static scpi_result_t
+scpi_callback_ramp_span(scpi_t* context)
+{
+  uint32_t span;
+  if (scpi_param_ramp(context, &span) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  const uint32_t lower = ad9910_get_value(ad9910_ramp_lower_limit);
+  if (span > UINT32_MAX - lower) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register cmd = {.reg = &ad9910_ramp_upper_limit,
+                                .value = lower + span };
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_span_q(scpi_t* context)
+{
+  return scpi_print_ramp(context, scpi_ramp_span());
+}
+
+static scpi_result_t
+scpi_callback_ramp_boundary_minimum(scpi_t* context)
 {
   return scpi_parse_register_command(context, &ad9910_ramp_lower_limit,
                                      scpi_param_ramp);
 }
 
 static scpi_result_t
-scpi_callback_ramp_boundary_minimum_q(scpi_t* context)
+scpi_callback_ramp_boundary_minimum_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_ramp_lower_limit,
+                             scpi_print_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_boundary_maximum(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_ramp_upper_limit,
+                                     scpi_param_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_boundary_maximum_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_ramp_upper_limit,
+                             scpi_print_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_step_up(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_ramp_increment_step,
+                                     scpi_param_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_step_up_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_ramp_increment_step,
+                             scpi_print_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_step_down(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_ramp_decrement_step,
+                                     scpi_param_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_step_down_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_ramp_decrement_step,
+                             scpi_print_ramp);
+}
+
+static scpi_result_t
+scpi_callback_ramp_rate_up(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_ramp_positive_rate,
+                                     scpi_param_ramp_rate);
+}
+
+static scpi_result_t
+scpi_callback_ramp_rate_up_q(scpi_t* context)
+{
+  return scpi_print_frequency(
+    context,
+    ad9910_backconvert_frequency(ad9910_get_value(ad9910_ramp_positive_rate)));
+}
+
+static scpi_result_t
+scpi_callback_ramp_rate_down(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_ramp_negative_rate,
+                                     scpi_param_ramp_rate);
+}
+
+static scpi_result_t
+scpi_callback_ramp_rate_down_q(scpi_t* context)
+{
+  return scpi_print_frequency(
+    context,
+    ad9910_backconvert_frequency(ad9910_get_value(ad9910_ramp_negative_rate)));
+}
+
+static scpi_result_t
+scpi_callback_osk_amplitude(scpi_t* context)
+{
+  return scpi_parse_register_command(context, &ad9910_amplitude_scale_factor,
+                                     scpi_param_amplitude);
+}
+
+static scpi_result_t
+scpi_callback_osk_amplitude_q(scpi_t* context)
+{
+  const uint32_t ampl = ad9910_get_value(ad9910_amplitude_scale_factor);
+
+  return scpi_print_amplitude(context, ad9910_backconvert_amplitude(ampl));
+}
+
+/* the duration of the automatic OSK ramp between 0 and the OSK amplitude */
+static scpi_result_t
+scpi_callback_osk_duration(scpi_t* context)
+{
+  double duration;
+  if (scpi_param_time(context, &duration, TRUE) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  ramp_solution solution;
+  if (ramp_solve_osk(ad9910_get_value(ad9910_amplitude_scale_factor),
+                     duration, &solution)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  /* the step size register holds log2 of the step */
+  const command_register step_cmd = {.reg = &ad9910_amplitude_step_size,
+                                     .value = __builtin_ctz(solution.step) };
+  scpi_process_command_register(&step_cmd);
+
+  const command_register rate_cmd = {.reg = &ad9910_amplitude_ramp_rate,
+                                     .value = solution.rate };
+  scpi_process_command_register(&rate_cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_duration_q(scpi_t* context)
+{
+  SCPI_ResultDouble(
+    context,
+    ramp_duration(ad9910_get_value(ad9910_amplitude_scale_factor),
+                  1 << ad9910_get_value(ad9910_amplitude_step_size),
+                  ad9910_get_value(ad9910_amplitude_ramp_rate)));
+
+  return SCPI_RES_OK;
+}
+
+enum osk_mode
+{
+  osk_mode_manual = 0,
+  osk_mode_automatic = 1,
+};
+
+static const scpi_choice_def_t osk_mode_choices[] = {
+  { "MANual", osk_mode_manual },
+  { "AUTOmatic", osk_mode_automatic },
+  SCPI_CHOICE_LIST_END
+};
+
+/* set by OSK:MODE, in programming mode the registers only change when the
+ * sequence runs */
+static int osk_mode_selected = 0;
+
+static scpi_result_t
+scpi_callback_osk_mode(scpi_t* context)
+{
+  int32_t value;
+  if (!SCPI_ParamChoice(context, osk_mode_choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  osk_mode_selected = 1;
+
+  /* in manual mode the OSK pin switches between 0 and the OSK amplitude,
+   * in automatic mode it starts the amplitude ramp */
+  command_register cmd = {.reg = &ad9910_select_auto_osk, .value = value };
+  scpi_process_command_register(&cmd);
+
+  cmd.reg = &ad9910_manual_osk_external_control;
+  cmd.value = value == osk_mode_manual;
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_mode_q(scpi_t* context)
+{
+  const enum osk_mode mode = ad9910_get_value(ad9910_select_auto_osk);
+
+  const char* name;
+  SCPI_ChoiceToName(osk_mode_choices, mode, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_pin(scpi_t* context)
+{
+  /* without an OSK mode the pin has no effect, a startup sequence may have
+   * selected one */
+  if (!osk_mode_selected && !ad9910_get_value(ad9910_select_auto_osk) &&
+      !ad9910_get_value(ad9910_manual_osk_external_control)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);
+    return SCPI_RES_ERR;
+  }
+
+  return scpi_parse_pin_command(context, OSK);
+}
+
+static scpi_result_t
+scpi_callback_osk_pin_q(scpi_t* context)
+{
+  return scpi_print_pin(context, OSK);
+}
+
+static scpi_result_t
+scpi_callback_osk_rate(scpi_t* context)
+{
+  uint32_t rate;
+  if (scpi_param_ramp_rate(context, &rate) != SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  if (rate == 0) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register cmd = {.reg = &ad9910_amplitude_ramp_rate,
+                                .value = rate };
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_rate_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, ad9910_get_value(ad9910_amplitude_ramp_rate));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_state(scpi_t* context)
+{
+  scpi_bool_t value;
+  if (!SCPI_ParamBool(context, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  const command_register cmd = {.reg = &ad9910_osk_enable, .value = value };
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_state_q(scpi_t* context)
+{
+  return scpi_print_register(context, &ad9910_osk_enable, scpi_print_boolean);
+}
+
+static scpi_result_t
+scpi_callback_osk_step(scpi_t* context)
+{
+  uint32_t step;
+  if (!SCPI_ParamUInt32(context, &step, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (step != 1 && step != 2 && step != 4 && step != 8) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register cmd = {.reg = &ad9910_amplitude_step_size,
+                                .value = __builtin_ctz(step) };
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_osk_step_q(scpi_t* context)
+{
+  SCPI_ResultUInt32(context, 1 << ad9910_get_value(ad9910_amplitude_step_size));
+
+  return SCPI_RES_OK;
+}
+
+/* these values match the value one gets from calculating
+ * low | (high << 1)
+ * i.e. low is the first bit, high the second. */
+enum ramp_mode
+{
+  ramp_mode_single = 0,
+  ramp_mode_sawtooth_down = 1,
+  ramp_mode_sawtooth_up = 2,
+  ramp_mode_oscillating = 3,
+};
+
+static const scpi_choice_def_t ramp_mode_choices[] = {
+  { "SINGle", ramp_mode_single },
+  { "DOWNSAWtooth", ramp_mode_sawtooth_down },
+  { "UPSAWtooth", ramp_mode_sawtooth_up },
+  { "OSCillating", ramp_mode_oscillating },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_ramp_mode(scpi_t* context)
+{
+  int32_t value;
+  if (SCPI_ParamChoice(context, ramp_mode_choices, &value, TRUE) !=
+      SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  int low = value & 0x1;
+  int high = value & 0x2;
+
+  command_register cmd = {.reg = &ad9910_digital_ramp_no_dwell_high,
+                          .value = high };
+  scpi_process_command_register(&cmd);
+
+  cmd.reg = &ad9910_digital_ramp_no_dwell_low;
+  cmd.value = low;
+  scpi_process_command_register(&cmd);
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_mode_q(scpi_t* context)
+{
+  const uint32_t low = ad9910_get_value(ad9910_digital_ramp_no_dwell_low);
+  const uint32_t high = ad9910_get_value(ad9910_digital_ramp_no_dwell_high);
+  const enum ramp_mode mode = low | (high << 1);
+
+  const char* name;
+  SCPI_ChoiceToName(ramp_mode_choices, mode, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_direction(scpi_t* context)
+{
+  return scpi_parse_pin_command(context, DRCTL);
+}
+
+static scpi_result_t
+scpi_callback_ramp_direction_q(scpi_t* context)
+{
+  return scpi_print_pin(context, DRCTL);
+}
+
+enum
+{
+  ramp_target_off = 0xFF
+};
+
+static const scpi_choice_def_t ramp_target_choices[] = {
+  { "OFF", ramp_target_off },
+  { "AMPLitude", ad9910_ramp_dest_amplitude },
+  { "FREQuency", ad9910_ramp_dest_frequency },
+  { "PHASe", ad9910_ramp_dest_phase },
+  SCPI_CHOICE_LIST_END
+};
+
+static scpi_result_t
+scpi_callback_ramp_target(scpi_t* context)
+{
+  int32_t value;
+  if (SCPI_ParamChoice(context, ramp_target_choices, &value, TRUE) !=
+      SCPI_RES_OK) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value == ramp_target_off) {
+    command_register cmd = {.reg = &ad9910_digital_ramp_enable, .value = 0 };
+    scpi_process_command_register(&cmd);
+  } else {
+    command_register cmd = {.reg = &ad9910_digital_ramp_destination,
+                            .value = value };
+    scpi_process_command_register(&cmd);
+    command_register cmd2 = {.reg = &ad9910_digital_ramp_enable, .value = 1 };
+    scpi_process_command_register(&cmd2);
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_ramp_target_q(scpi_t* context)
+{
+  int enabled = ad9910_get_value(ad9910_digital_ramp_enable);
+
+  uint32_t value;
+  if (enabled) {
+    value = ad9910_get_value(ad9910_digital_ramp_destination);
+  } else {
+    value = ramp_target_off;
+  }
+
+  const char* name;
+  SCPI_ChoiceToName(ramp_target_choices, value, &name);
+
+  SCPI_ResultCharacters(context, name, strlen(name));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_register_q(scpi_t* context)
+{
+  struct reg_print_helper
+  {
+    ad9910_register* reg;
+    const char* name;
+  };
+
+  static const struct reg_print_helper print_helper[] = {
+    { &ad9910_regs.cfr1, "CFR1:" },
+    { &ad9910_regs.cfr2, "CFR2:" },
+    { &ad9910_regs.cfr3, "CFR3:" },
+    { &ad9910_regs.aux_dac_ctl, "AUX DAC CTL:" },
+    { &ad9910_regs.io_update_rate, "IO UPDATE RATE:" },
+    { &ad9910_regs.ftw, "FTW:" },
+    { &ad9910_regs.pow, "POW:" },
+    { &ad9910_regs.asf, "ASF:" },
+    { &ad9910_regs.multichip_sync, "MULTICHIP SYNC:" },
+    { &ad9910_regs.ramp_limit, "RAMP LIMIT:" },
+    { &ad9910_regs.ramp_step, "RAMP STEP:" },
+    { &ad9910_regs.ramp_rate, "RAMP RATE:" },
+    { &ad9910_regs.prof0, "PROFILE 0:" },
+    { &ad9910_regs.prof1, "PROFILE 1:" },
+    { &ad9910_regs.prof2, "PROFILE 2:" },
+    { &ad9910_regs.prof3, "PROFILE 3:" },
+    { &ad9910_regs.prof4, "PROFILE 4:" },
+    { &ad9910_regs.prof5, "PROFILE 5:" },
+    { &ad9910_regs.prof6, "PROFILE 6:" },
+    { &ad9910_regs.prof7, "PROFILE 7:" },
+    { NULL, NULL }
+  };
+
+  static const char header[] =
+    "Register:               DDS              Shadow";
+
+  SCPI_ResultCharacters(context, header, sizeof(header));
+
+  char buf[60];
+  for (const struct reg_print_helper* helper = print_helper;
+       helper->reg != NULL; helper++) {
+    size_t len =
+      snprintf(buf, sizeof(buf), "\n%-16s0x%.16llx 0x%.16llx", helper->name,
+               ad9910_read_register(helper->reg), helper->reg->value);
+    SCPI_ResultCharacters(context, buf, len);
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_system_pll_q(scpi_t* context)
+{
+  return scpi_print_pin(context, PLL_LOCK);
+}
+
+static scpi_result_t
+scpi_callback_system_boot_q(scpi_t* context)
+{
+  for (boot_phase i = 0; i < boot_phase_count; ++i) {
+    SCPI_ResultText(context, boot_phase_name(i));
+    SCPI_ResultDouble(context, boot_timing_get(i) * 1e-6);
+  }
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_startup_clear(scpi_t* context)
 {
-  return scpi_print_register(context, &ad9910_ramp_lower_limit,
-                             scpi_print_ramp);
+  (void)context;
+
+  startup_command_clear();
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_boundary_maximum(scpi_t* context)
+scpi_callback_startup_save(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_ramp_upper_limit,
-                                     scpi_param_ramp);
+  if (startup_command_save()) {
+    SCPI_ErrorPush(context, SCPI_ERROR_PROGRAM_SYNTAX_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  return SCPI_RES_OK;
+}
+
+static int
+scpi_discard_sink(const void* data, size_t len, size_t offset, void* arg)
+{
+  return 0;
 }
 
+/* receives a binary block without storing it and returns the achieved
+ * rate in MB/s */
 static scpi_result_t
-scpi_callback_ramp_boundary_maximum_q(scpi_t* context)
+scpi_callback_system_network_benchmark(scpi_t* context)
 {
-  return scpi_print_register(context, &ad9910_ramp_upper_limit,
-                             scpi_print_ramp);
+  const char* ptr;
+  size_t len;
+  if (!SCPI_ParamArbitraryBlock(context, &ptr, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  const uint32_t start = LocalTime;
+
+  if (ethernet_receive_block(ptr, len, scpi_discard_sink, NULL)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_EXECUTION_ERROR);
+    return SCPI_RES_ERR;
+  }
+
+  const uint32_t time = LocalTime - start;
+
+  SCPI_ResultDouble(context, len / (max(time, 1) * 1e-3) * 1e-6);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_step_up(scpi_t* context)
+scpi_callback_system_network_address(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_ramp_increment_step,
-                                     scpi_param_ramp);
+  struct config conf;
+  memcpy(&conf, config_get(), sizeof(struct config));
+
+  if (!scpi_param_ip_address(context, conf.ethernet.address)) {
+    return SCPI_RES_ERR;
+  }
+
+  config_write(&conf);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_step_up_q(scpi_t* context)
+scpi_callback_system_network_submask(scpi_t* context)
 {
-  return scpi_print_register(context, &ad9910_ramp_increment_step,
-                             scpi_print_ramp);
+  struct config conf;
+  memcpy(&conf, config_get(), sizeof(struct config));
+
+  if (!scpi_param_ip_address(context, conf.ethernet.submask)) {
+    return SCPI_RES_ERR;
+  }
+
+  config_write(&conf);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_step_down(scpi_t* context)
+scpi_callback_system_network_gateway(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_ramp_decrement_step,
-                                     scpi_param_ramp);
+  struct config conf;
+  memcpy(&conf, config_get(), sizeof(struct config));
+
+  if (!scpi_param_ip_address(context, conf.ethernet.submask)) {
+    return SCPI_RES_ERR;
+  }
+
+  config_write(&conf);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_step_down_q(scpi_t* context)
+scpi_callback_system_network_address_q(scpi_t* context)
 {
-  return scpi_print_register(context, &ad9910_ramp_decrement_step,
-                             scpi_print_ramp);
+  return scpi_print_ip_address(context, config_get()->ethernet.address);
 }
 
 static scpi_result_t
-scpi_callback_ramp_rate_up(scpi_t* context)
+scpi_callback_system_network_submask_q(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_ramp_positive_rate,
-                                     scpi_param_ramp_rate);
+  return scpi_print_ip_address(context, config_get()->ethernet.submask);
 }
 
 static scpi_result_t
-scpi_callback_ramp_rate_up_q(scpi_t* context)
+scpi_callback_system_network_gateway_q(scpi_t* context)
 {
-  return scpi_print_frequency(
-    context,
-    ad9910_backconvert_frequency(ad9910_get_value(ad9910_ramp_positive_rate)));
+  return scpi_print_ip_address(context, config_get()->ethernet.gateway);
 }
 
 static scpi_result_t
-scpi_callback_ramp_rate_down(scpi_t* context)
+scpi_callback_trigger_send(scpi_t* context)
 {
-  return scpi_parse_register_command(context, &ad9910_ramp_negative_rate,
-                                     scpi_param_ramp_rate);
+  scpi_process_command_update(NULL);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_rate_down_q(scpi_t* context)
+scpi_callback_trigger_wait(scpi_t* context)
 {
-  return scpi_print_frequency(
-    context,
-    ad9910_backconvert_frequency(ad9910_get_value(ad9910_ramp_negative_rate)));
+  return scpi_callback_wait(context);
 }
 
-/* these values match the value one gets from calculating
- * low | (high << 1)
- * i.e. low is the first bit, high the second. */
-enum ramp_mode
+static scpi_result_t
+scpi_callback_wait(scpi_t* context)
 {
-  ramp_mode_single = 0,
-  ramp_mode_sawtooth_down = 1,
-  ramp_mode_sawtooth_up = 2,
-  ramp_mode_oscillating = 3,
+  enum
+  {
+    _choice_min,
+    _choice_trigger,
+  };
+
+  const scpi_choice_def_t choices[] = {
+    {.name = "MINimal", .tag = _choice_min },
+    {.name = "TRIGger", .tag = _choice_trigger },
+  };
+
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, choices, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value.special) {
+    switch (value.tag) {
+      case _choice_min:
+        scpi_process_wait(1);
+        return SCPI_RES_OK;
+      case _choice_trigger:
+        scpi_process_trigger();
+        return SCPI_RES_OK;
+    }
+  } else if (value.unit == SCPI_UNIT_SECOND) {
+    scpi_process_wait(value.value * 1000);
+    return SCPI_RES_OK;
+  } else if (value.unit == SCPI_UNIT_NONE) {
+    scpi_process_wait(value.value);
+    return SCPI_RES_OK;
+  } else {
+    SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);
+    return SCPI_RES_ERR;
+  }
+
+  return SCPI_RES_ERR;
+}
+
+/* control flow only makes sense within a sequence and is queued in
+ * programming mode only */
+#define DEFINE_QUEUE_CONTROL(cmd)                                              \
+  static scpi_result_t scpi_queue_control_##cmd(scpi_t* context,               \
+                                                const command_##cmd* command)  \
+  {                                                                            \
+    if (current_mode != scpi_mode_program) {                                   \
+      SCPI_ErrorPush(context, SCPI_ERROR_SETTINGS_CONFLICT);                   \
+      return SCPI_RES_ERR;                                                     \
+    }                                                                          \
+                                                                               \
+    if (command_queue_##cmd(command)) {                                        \
+      SCPI_ErrorPush(context, SCPI_ERROR_OUT_OF_MEMORY);                       \
+      return SCPI_RES_ERR;                                                     \
+    }                                                                          \
+                                                                               \
+    return SCPI_RES_OK;                                                        \
+  }
+
+DEFINE_QUEUE_CONTROL(loop)
+DEFINE_QUEUE_CONTROL(loop_end)
+DEFINE_QUEUE_CONTROL(sub)
+DEFINE_QUEUE_CONTROL(return)
+DEFINE_QUEUE_CONTROL(call)
+DEFINE_QUEUE_CONTROL(if)
+DEFINE_QUEUE_CONTROL(else)
+DEFINE_QUEUE_CONTROL(endif)
+DEFINE_QUEUE_CONTROL(jump)
+
+static scpi_result_t
+scpi_callback_sequence_call(scpi_t* context)
+{
+  command_call cmd = {.target = 0 };
+  if (!SCPI_ParamUInt32(context, &cmd.id, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  return scpi_queue_control_call(context, &cmd);
+}
+
+static scpi_result_t
+scpi_callback_sequence_else(scpi_t* context)
+{
+  const command_else cmd = {.end = 0 };
+
+  return scpi_queue_control_else(context, &cmd);
+}
+
+static scpi_result_t
+scpi_callback_sequence_endif(scpi_t* context)
+{
+  return scpi_queue_control_endif(context, NULL);
+}
+
+enum sequence_if_pin
+{
+  sequence_if_external = 0,
+  sequence_if_button = 1,
 };
 
-static const scpi_choice_def_t ramp_mode_choices[] = {
-  { "SINGle", ramp_mode_single },
-  { "DOWNSAWtooth", ramp_mode_sawtooth_down },
-  { "UPSAWtooth", ramp_mode_sawtooth_up },
-  { "OSCillating", ramp_mode_oscillating },
+static const scpi_choice_def_t sequence_if_choices[] = {
+  { "EXTernal", sequence_if_external },
+  { "BUTTon", sequence_if_button },
   SCPI_CHOICE_LIST_END
 };
 
 static scpi_result_t
-scpi_callback_ramp_mode(scpi_t* context)
+scpi_callback_sequence_if(scpi_t* context)
 {
-  int32_t value;
-  if (SCPI_ParamChoice(context, ramp_mode_choices, &value, TRUE) !=
-      SCPI_RES_OK) {
+  int32_t pin;
+  if (!SCPI_ParamChoice(context, sequence_if_choices, &pin, TRUE)) {
     return SCPI_RES_ERR;
   }
 
-  int low = value & 0x1;
-  int high = value & 0x2;
+  scpi_bool_t level;
+  if (!SCPI_ParamBool(context, &level, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  command_register cmd = {.reg = &ad9910_digital_ramp_no_dwell_high,
-                          .value = high };
-  scpi_process_command_register(&cmd);
+  const command_if cmd = {
+    .pin = pin == sequence_if_button ? RED_BUTTON : EXTERNAL_TRIGGER,
+    .level = level,
+    .next = 0,
+  };
 
-  cmd.reg = &ad9910_digital_ramp_no_dwell_low;
-  cmd.value = low;
-  scpi_process_command_register(&cmd);
+  return scpi_queue_control_if(context, &cmd);
+}
+
+/* register fields which can be changed by arithmetic in sequences, these
+ * are the single tone settings of profile 0 like for OUTput */
+enum sequence_target
+{
+  sequence_target_frequency,
+  sequence_target_amplitude,
+  sequence_target_phase,
+};
+
+static const scpi_choice_def_t sequence_target_choices[] = {
+  { "FREQuency", sequence_target_frequency },
+  { "AMPLitude", sequence_target_amplitude },
+  { "PHASe", sequence_target_phase },
+  SCPI_CHOICE_LIST_END
+};
+
+static const ad9910_register_bit* const sequence_target_regs[] = {
+  [sequence_target_frequency] = &ad9910_profile_frequency,
+  [sequence_target_amplitude] = &ad9910_profile_amplitude,
+  [sequence_target_phase] = &ad9910_profile_phase,
+};
+
+static scpi_result_t
+scpi_callback_sequence_increment(scpi_t* context)
+{
+  int32_t target;
+  if (!SCPI_ParamChoice(context, sequence_target_choices, &target, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value.special) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  /* steps are given in register units or in the unit of the target, they
+   * may be negative */
+  double step = value.value;
+  if (target == sequence_target_frequency && value.unit == SCPI_UNIT_HERTZ) {
+    step *= ad9910_max_frequency / 1e9;
+  } else if (target == sequence_target_phase &&
+             value.unit == SCPI_UNIT_RADIAN) {
+    step *= ad9910_max_phase / 2 / M_PI;
+  } else if (value.unit != SCPI_UNIT_NONE) {
+    SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);
+    return SCPI_RES_ERR;
+  }
+
+  step = nearbyint(step);
+  if (step < INT32_MIN || step > INT32_MAX) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  /* the phase is periodic, frequency and amplitude saturate */
+  const command_register_add cmd = {
+    .reg = sequence_target_regs[target],
+    .step = step,
+    .wrap = target == sequence_target_phase,
+  };
+  scpi_process_command_register_add(&cmd);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_mode_q(scpi_t* context)
+scpi_callback_sequence_scale(scpi_t* context)
 {
-  const uint32_t low = ad9910_get_value(ad9910_digital_ramp_no_dwell_low);
-  const uint32_t high = ad9910_get_value(ad9910_digital_ramp_no_dwell_high);
-  const enum ramp_mode mode = low | (high << 1);
+  int32_t target;
+  if (!SCPI_ParamChoice(context, sequence_target_choices, &target, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  const char* name;
-  SCPI_ChoiceToName(ramp_mode_choices, mode, &name);
+  double factor;
+  if (!SCPI_ParamDouble(context, &factor, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  SCPI_ResultCharacters(context, name, strlen(name));
+  /* Q16.16 fixed point */
+  factor = nearbyint(factor * 0x10000);
+  if (factor < 0 || factor > UINT32_MAX) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  const command_register_scale cmd = {
+    .reg = sequence_target_regs[target], .factor = factor,
+  };
+  scpi_process_command_register_scale(&cmd);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_direction(scpi_t* context)
+scpi_callback_sequence_loop(scpi_t* context)
 {
-  return scpi_parse_pin_command(context, DRCTL);
+  command_loop cmd = {.end = 0 };
+  if (!SCPI_ParamUInt32(context, &cmd.count, TRUE)) {
+    return SCPI_RES_ERR;
+  }
+
+  return scpi_queue_control_loop(context, &cmd);
 }
 
 static scpi_result_t
-scpi_callback_ramp_direction_q(scpi_t* context)
+scpi_callback_sequence_loop_end(scpi_t* context)
 {
-  return scpi_print_pin(context, DRCTL);
+  return scpi_queue_control_loop_end(context, NULL);
 }
 
-enum
+static scpi_result_t
+scpi_callback_sequence_return(scpi_t* context)
 {
-  ramp_target_off = 0xFF
-};
-
-static const scpi_choice_def_t ramp_target_choices[] = {
-  { "OFF", ramp_target_off },
-  { "AMPLitude", ad9910_ramp_dest_amplitude },
-  { "FREQuency", ad9910_ramp_dest_frequency },
-  { "PHASe", ad9910_ramp_dest_phase },
-  SCPI_CHOICE_LIST_END
-};
+  return scpi_queue_control_return(context, NULL);
+}
 
 static scpi_result_t
-scpi_callback_ramp_target(scpi_t* context)
+scpi_callback_sequence_subroutine(scpi_t* context)
 {
-  int32_t value;
-  if (SCPI_ParamChoice(context, ramp_target_choices, &value, TRUE) !=
-      SCPI_RES_OK) {
+  command_sub cmd = {.end = 0 };
+  if (!SCPI_ParamUInt32(context, &cmd.id, TRUE)) {
     return SCPI_RES_ERR;
   }
 
-  if (value == ramp_target_off) {
-    command_register cmd = {.reg = &ad9910_digital_ramp_enable, .value = 0 };
-    scpi_process_command_register(&cmd);
-  } else {
-    command_register cmd = {.reg = &ad9910_digital_ramp_destination,
-                            .value = value };
-    scpi_process_command_register(&cmd);
-    command_register cmd2 = {.reg = &ad9910_digital_ramp_enable, .value = 1 };
-    scpi_process_command_register(&cmd2);
+  return scpi_queue_control_sub(context, &cmd);
+}
+
+static scpi_result_t
+scpi_callback_sequence_catalog_q(scpi_t* context)
+{
+  for (size_t i = 0; i < COMMAND_SLOTS; ++i) {
+    const char* name;
+    size_t size;
+    if (commands_get_slot(i, &name, &size) == 0) {
+      SCPI_ResultText(context, name);
+      SCPI_ResultUInt32(context, size);
+    }
   }
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_ramp_target_q(scpi_t* context)
+scpi_callback_sequence_delete(scpi_t* context)
 {
-  int enabled = ad9910_get_value(ad9910_digital_ramp_enable);
-
-  uint32_t value;
-  if (enabled) {
-    value = ad9910_get_value(ad9910_digital_ramp_destination);
-  } else {
-    value = ramp_target_off;
-  }
-
   const char* name;
-  SCPI_ChoiceToName(ramp_target_choices, value, &name);
+  size_t len;
+  if (!SCPI_ParamCharacters(context, &name, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  SCPI_ResultCharacters(context, name, strlen(name));
+  if (commands_delete(name, len)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+    return SCPI_RES_ERR;
+  }
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_register_q(scpi_t* context)
+scpi_callback_sequence_jump(scpi_t* context)
 {
-  struct reg_print_helper
-  {
-    ad9910_register* reg;
-    const char* name;
-  };
+  const char* name;
+  size_t len;
+  if (!SCPI_ParamCharacters(context, &name, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  static const struct reg_print_helper print_helper[] = {
-    { &ad9910_regs.cfr1, "CFR1:" },
-    { &ad9910_regs.cfr2, "CFR2:" },
-    { &ad9910_regs.cfr3, "CFR3:" },
-    { &ad9910_regs.aux_dac_ctl, "AUX DAC CTL:" },
-    { &ad9910_regs.io_update_rate, "IO UPDATE RATE:" },
-    { &ad9910_regs.ftw, "FTW:" },
-    { &ad9910_regs.pow, "POW:" },
-    { &ad9910_regs.asf, "ASF:" },
-    { &ad9910_regs.multichip_sync, "MULTICHIP SYNC:" },
-    { &ad9910_regs.ramp_limit, "RAMP LIMIT:" },
-    { &ad9910_regs.ramp_step, "RAMP STEP:" },
-    { &ad9910_regs.ramp_rate, "RAMP RATE:" },
-    { &ad9910_regs.prof0, "PROFILE 0:" },
-    { &ad9910_regs.prof1, "PROFILE 1:" },
-    { &ad9910_regs.prof2, "PROFILE 2:" },
-    { &ad9910_regs.prof3, "PROFILE 3:" },
-    { &ad9910_regs.prof4, "PROFILE 4:" },
-    { &ad9910_regs.prof5, "PROFILE 5:" },
-    { &ad9910_regs.prof6, "PROFILE 6:" },
-    { &ad9910_regs.prof7, "PROFILE 7:" },
-    { NULL, NULL }
-  };
+  /* the target only has to exist when the sequence is executed */
+  command_jump cmd = {.name = { 0 } };
+  if (len == 0 || len > COMMAND_NAME_LENGTH) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+    return SCPI_RES_ERR;
+  }
+  memcpy(cmd.name, name, len);
 
-  static const char header[] =
-    "Register:               DDS              Shadow";
+  return scpi_queue_control_jump(context, &cmd);
+}
 
-  SCPI_ResultCharacters(context, header, sizeof(header));
+static scpi_result_t
+scpi_callback_sequence_load(scpi_t* context)
+{
+  const char* name;
+  size_t len;
+  if (!SCPI_ParamCharacters(context, &name, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  char buf[60];
-  for (const struct reg_print_helper* helper = print_helper;
-       helper->reg != NULL; helper++) {
-    size_t len =
-      snprintf(buf, sizeof(buf), "\n%-16s0x%.16llx 0x%.16llx", helper->name,
-               ad9910_read_register(helper->reg), helper->reg->value);
-    SCPI_ResultCharacters(context, buf, len);
+  if (commands_load(name, len)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+    return SCPI_RES_ERR;
   }
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_system_pll_q(scpi_t* context)
+scpi_callback_sequence_save(scpi_t* context)
 {
-  return scpi_print_pin(context, PLL_LOCK);
+  if (commands_save()) {
+    SCPI_ErrorPush(context, SCPI_ERROR_MEDIA_FULL);
+    return SCPI_RES_ERR;
+  }
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_startup_clear(scpi_t* context)
+scpi_callback_sequence_select(scpi_t* context)
 {
-  (void)context;
+  const char* name;
+  size_t len;
+  if (!SCPI_ParamCharacters(context, &name, &len, TRUE)) {
+    return SCPI_RES_ERR;
+  }
 
-  startup_command_clear();
+  if (commands_select(name, len)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PROGRAM_NAME);
+    return SCPI_RES_ERR;
+  }
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_startup_save(scpi_t* context)
+scpi_callback_sequence_select_q(scpi_t* context)
 {
-  (void)context;
-
-  startup_command_save();
+  SCPI_ResultText(context, commands_get_selected());
 
   return SCPI_RES_OK;
 }
 
+/* steps are numbered from 1 in the command header */
 static scpi_result_t
-scpi_callback_system_network_address(scpi_t* context)
+scpi_sequence_step(scpi_t* context, int (*action)(size_t))
 {
-  struct config conf;
-  memcpy(&conf, config_get(), sizeof(struct config));
+  int32_t step;
+  SCPI_CommandNumbers(context, &step, 1, 1);
 
-  if (!scpi_param_ip_address(context, conf.ethernet.address)) {
+  if (step < 1 || action(step - 1)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_HEADER_SUFFIX_OUTOFRANGE);
     return SCPI_RES_ERR;
   }
 
-  config_write(&conf);
-
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_system_network_submask(scpi_t* context)
+scpi_callback_sequence_step_append(scpi_t* context)
 {
-  struct config conf;
-  memcpy(&conf, config_get(), sizeof(struct config));
-
-  if (!scpi_param_ip_address(context, conf.ethernet.submask)) {
-    return SCPI_RES_ERR;
-  }
-
-  config_write(&conf);
+  commands_step_append();
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_system_network_gateway(scpi_t* context)
+scpi_callback_sequence_step_count_q(scpi_t* context)
 {
-  struct config conf;
-  memcpy(&conf, config_get(), sizeof(struct config));
-
-  if (!scpi_param_ip_address(context, conf.ethernet.submask)) {
-    return SCPI_RES_ERR;
-  }
-
-  config_write(&conf);
+  SCPI_ResultUInt32(context, commands_step_count());
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_system_network_address_q(scpi_t* context)
+scpi_callback_sequence_step_delete(scpi_t* context)
 {
-  return scpi_print_ip_address(context, config_get()->ethernet.address);
+  return scpi_sequence_step(context, commands_step_delete);
 }
 
 static scpi_result_t
-scpi_callback_system_network_submask_q(scpi_t* context)
+scpi_callback_sequence_step_insert(scpi_t* context)
 {
-  return scpi_print_ip_address(context, config_get()->ethernet.submask);
+  return scpi_sequence_step(context, commands_step_insert);
 }
 
 static scpi_result_t
-scpi_callback_system_network_gateway_q(scpi_t* context)
+scpi_callback_sequence_step_replace(scpi_t* context)
 {
-  return scpi_print_ip_address(context, config_get()->ethernet.gateway);
+  return scpi_sequence_step(context, commands_step_replace);
 }
 
 static scpi_result_t
-scpi_callback_trigger_send(scpi_t* context)
+scpi_callback_sequence_status_q(scpi_t* context)
 {
-  scpi_process_command_update(NULL);
+  struct command_status status;
+  commands_status(&status);
+
+  const char* state;
+  SCPI_ChoiceToName(sequence_state_choices, status.state, &state);
+
+  SCPI_ResultCharacters(context, state, strlen(state));
+  SCPI_ResultText(context, status.name);
+  SCPI_ResultUInt32(context, status.cycle);
+  SCPI_ResultUInt32(context, status.steps);
 
   return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_trigger_wait(scpi_t* context)
+scpi_callback_status_operation_event_q(scpi_t* context)
 {
-  return scpi_callback_wait(context);
+  /* reading the event register clears it */
+  SCPI_ResultInt32(context, SCPI_RegGet(context, SCPI_REG_OPER));
+  SCPI_RegSet(context, SCPI_REG_OPER, 0);
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
-scpi_callback_wait(scpi_t* context)
+scpi_callback_status_operation_enable(scpi_t* context)
 {
-  enum
-  {
-    _choice_min,
-    _choice_trigger,
-  };
-
-  const scpi_choice_def_t choices[] = {
-    {.name = "MINimal", .tag = _choice_min },
-    {.name = "TRIGger", .tag = _choice_trigger },
-  };
-
-  scpi_number_t value;
-  if (!SCPI_ParamNumber(context, choices, &value, TRUE)) {
+  int32_t value;
+  if (!SCPI_ParamInt32(context, &value, TRUE)) {
     return SCPI_RES_ERR;
   }
 
-  if (value.special) {
-    switch (value.tag) {
-      case _choice_min:
-        scpi_process_wait(1);
-        return SCPI_RES_OK;
-      case _choice_trigger:
-        scpi_process_trigger();
-        return SCPI_RES_OK;
-    }
-  } else if (value.unit == SCPI_UNIT_SECOND) {
-    scpi_process_wait(value.value * 1000);
-    return SCPI_RES_OK;
-  } else if (value.unit == SCPI_UNIT_NONE) {
-    scpi_process_wait(value.value);
-    return SCPI_RES_OK;
-  } else {
-    SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);
-    return SCPI_RES_ERR;
-  }
+  SCPI_RegSet(context, SCPI_REG_OPERE, value);
 
-  return SCPI_RES_ERR;
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_status_operation_enable_q(scpi_t* context)
+{
+  SCPI_ResultInt32(context, SCPI_RegGet(context, SCPI_REG_OPERE));
+
+  return SCPI_RES_OK;
+}
+
+static scpi_result_t
+scpi_callback_sequence_abort(scpi_t* context)
+{
+  (void)context;
+
+  commands_abort();
+
+  return SCPI_RES_OK;
 }
 
 static scpi_result_t
@@ -1040,6 +2862,70 @@ scpi_param_ramp_rate(scpi_t* context, uint32_t* rate)
   }
 }
 
+/* values for the ramp compiler in Hz, radians or plain register units.
+ * The value is converted to register units, scale receives the factor
+ * which was used for that */
+static scpi_result_t
+scpi_param_ramp_value(scpi_t* context, double* output, double* scale,
+                      scpi_bool_t mandatory)
+{
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value,
+                        mandatory)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value.special) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  switch (value.unit) {
+    case SCPI_UNIT_NONE:
+      *scale = 1;
+      break;
+    case SCPI_UNIT_HERTZ:
+      *scale = ad9910_precision_frequency / 1e9;
+      break;
+    case SCPI_UNIT_RADIAN:
+      *scale = ad9910_precision_frequency / (2 * M_PI);
+      break;
+    default:
+      SCPI_ErrorPush(context, SCPI_ERROR_INVALID_SUFFIX);
+      return SCPI_RES_ERR;
+  }
+
+  *output = value.value * *scale;
+
+  return SCPI_RES_OK;
+}
+
+/* durations in seconds, a number without unit is taken as seconds too */
+static scpi_result_t
+scpi_param_time(scpi_t* context, double* seconds, scpi_bool_t mandatory)
+{
+  scpi_number_t value;
+  if (!SCPI_ParamNumber(context, scpi_special_numbers_def, &value,
+                        mandatory)) {
+    return SCPI_RES_ERR;
+  }
+
+  if (value.special ||
+      (value.unit != SCPI_UNIT_NONE && value.unit != SCPI_UNIT_SECOND)) {
+    SCPI_ErrorPush(context, SCPI_ERROR_ILLEGAL_PARAMETER_VALUE);
+    return SCPI_RES_ERR;
+  }
+
+  if (value.value <= 0) {
+    SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+    return SCPI_RES_ERR;
+  }
+
+  *seconds = value.value;
+
+  return SCPI_RES_OK;
+}
+
 /* ramp parameters may be frequency, amplitude or phase depending on the
  * target. We just accept everything, it's not our problem if the user
  * request a frequency ramp from 2*pi to -10 DBM */
@@ -1258,7 +3144,7 @@ scpi_process_trigger()
 }
 
 #define DEFINE_PROCESS_COMMAND(cmd)                                            \
-  static void scpi_process_command_##cmd(const command_##cmd* command)         \
+  void scpi_process_command_##cmd(const command_##cmd* command)                \
   {                                                                            \
     switch (current_mode) {                                                    \
       default:                                                                 \
@@ -1272,7 +3158,11 @@ scpi_process_trigger()
 
 DEFINE_PROCESS_COMMAND(pin)
 DEFINE_PROCESS_COMMAND(register)
+DEFINE_PROCESS_COMMAND(register_add)
+DEFINE_PROCESS_COMMAND(register_scale)
 DEFINE_PROCESS_COMMAND(trigger)
 DEFINE_PROCESS_COMMAND(update)
 DEFINE_PROCESS_COMMAND(wait)
 DEFINE_PROCESS_COMMAND(parallel)
+DEFINE_PROCESS_COMMAND(parallel_external)
+DEFINE_PROCESS_COMMAND(ramp_chain)
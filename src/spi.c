@@ -1,5 +1,8 @@
 #include "spi.h"
 
+#include <misc.h>
+#include <stm32f4xx_dma.h>
+#include <stm32f4xx_rcc.h>
 #include <stm32f4xx_spi.h>
 #include <tm_stm32f4_gpio.h>
 
@@ -84,3 +87,83 @@ spi_write_multi(uint8_t* data, uint32_t length)
     (void)SPI1->DR;
   }
 }
+
+void
+spi_dma_init(int interrupt)
+{
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+  DMA_InitTypeDef dma_init;
+  DMA_StructInit(&dma_init);
+
+  dma_init.DMA_Channel = DMA_Channel_3;
+  dma_init.DMA_PeripheralBaseAddr = (uint32_t)&SPI1->DR;
+  dma_init.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+  dma_init.DMA_BufferSize = 1;
+  dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma_init.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  dma_init.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  dma_init.DMA_Mode = DMA_Mode_Normal;
+  dma_init.DMA_Priority = DMA_Priority_VeryHigh;
+  dma_init.DMA_FIFOMode = DMA_FIFOMode_Disable;
+
+  DMA_DeInit(DMA2_Stream3);
+  DMA_Init(DMA2_Stream3, &dma_init);
+
+  DMA_ITConfig(DMA2_Stream3, DMA_IT_TC, interrupt ? ENABLE : DISABLE);
+
+  NVIC_InitTypeDef nvic_init = {
+    .NVIC_IRQChannel = DMA2_Stream3_IRQn,
+    .NVIC_IRQChannelPreemptionPriority = 0x00,
+    .NVIC_IRQChannelSubPriority = 0x00,
+    .NVIC_IRQChannelCmd = interrupt ? ENABLE : DISABLE,
+  };
+  NVIC_Init(&nvic_init);
+
+  SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, ENABLE);
+}
+
+void
+spi_write_dma(const uint8_t* data, uint32_t length)
+{
+  spi_wait();
+
+  DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 |
+                                DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 |
+                                DMA_FLAG_FEIF3);
+
+  DMA2_Stream3->M0AR = (uint32_t)data;
+  DMA2_Stream3->NDTR = length;
+
+  DMA_Cmd(DMA2_Stream3, ENABLE);
+}
+
+void
+spi_dma_deinit()
+{
+  DMA_Cmd(DMA2_Stream3, DISABLE);
+  while (DMA_GetCmdStatus(DMA2_Stream3) == ENABLE) {
+  }
+
+  DMA_ITConfig(DMA2_Stream3, DMA_IT_TC, DISABLE);
+  NVIC_DisableIRQ(DMA2_Stream3_IRQn);
+
+  SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, DISABLE);
+
+  spi_dma_finish();
+}
+
+void
+spi_dma_finish()
+{
+  DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
+
+  /* the DMA is done as soon as the last byte is in the data register */
+  while ((SPI1->SR & SPI_SR_TXE) == 0 || (SPI1->SR & SPI_SR_BSY)) {
+  }
+
+  /* reading DR and SR clears the overrun flag */
+  (void)SPI1->DR;
+  (void)SPI1->SR;
+}
@@ -0,0 +1,508 @@
+#include "store.h"
+
+#include "crc.h"
+#include "eeprom.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define STORE_MAGIC 0x53544F52 /* "STOR" */
+#define STORE_SECTORS 3
+/* size of the chunks of a chunked value, small enough to fill up the end
+ * of a sector. The two hex digits of the chunk number limit the count */
+#define STORE_CHUNK_SIZE 2048
+#define STORE_CHUNKS_MAX 0x100
+
+/* the first words of every sector in use. The sequence number increases
+ * with every new sector, the sector with the highest one is appended to */
+struct store_sector
+{
+  uint32_t magic;
+  uint32_t sequence;
+};
+
+/* header of every record, followed by the data padded to full words. The
+ * crc covers the header words before it and the data with the padding. A
+ * record which was only partially written has a wrong crc and is skipped,
+ * the length is written first so the following records can still be
+ * found. */
+struct store_record
+{
+  uint16_t length;
+  uint16_t state;
+  char key[STORE_KEY_LENGTH];
+  uint32_t crc;
+};
+
+/* record under the key of a chunked value, followed by the header of the
+ * caller */
+struct store_chunked
+{
+  uint32_t length;
+  uint32_t chunks;
+};
+
+enum store_state
+{
+  store_state_value = 0x5A5A,
+  store_state_deleted = 0x0000,
+};
+
+/* erased flash */
+#define STORE_EMPTY 0xFFFFFFFF
+#define STORE_EMPTY_LENGTH 0xFFFF
+
+static const enum eeprom_id store_sectors[STORE_SECTORS] = {
+  eeprom_block0, eeprom_block1, eeprom_block2,
+};
+
+/* sector appended to and offset of the next record in it */
+static size_t active = 0;
+static size_t write_pos = 0;
+
+static const struct store_sector* store_sector_header(size_t);
+static int store_sector_used(size_t);
+static int store_sector_blank(size_t);
+static size_t store_sector_end(size_t);
+static const struct store_record* store_next_record(size_t, size_t*);
+static size_t store_record_size(size_t len);
+static uint32_t store_record_crc(const struct store_record*, const void*);
+static int store_record_valid(const struct store_record*);
+static const struct store_record* store_find(const char* key);
+static int store_open_sector(void);
+static int store_compact(size_t);
+static int store_append(const struct store_record*, const void*);
+static int store_write(const char*, enum store_state, const void*, size_t);
+static void store_chunk_key(char*, const char*, size_t);
+static void store_delete_chunks(const char*, size_t, size_t);
+
+void
+store_init()
+{
+  crc_init();
+
+  size_t used = 0;
+  size_t oldest = 0;
+
+  for (size_t i = 0; i < STORE_SECTORS; ++i) {
+    if (!store_sector_used(i)) {
+      continue;
+    }
+
+    if (used == 0 ||
+        store_sector_header(i)->sequence >
+          store_sector_header(active)->sequence) {
+      active = i;
+    }
+    if (used == 0 ||
+        store_sector_header(i)->sequence <
+          store_sector_header(oldest)->sequence) {
+      oldest = i;
+    }
+    used++;
+  }
+
+  if (used == 0) {
+    store_open_sector();
+    return;
+  }
+
+  write_pos = store_sector_end(active);
+
+  /* all sectors are only in use if the copying out of the oldest sector
+   * was interrupted, already copied records are not copied again */
+  if (used == STORE_SECTORS) {
+    store_compact(oldest);
+  }
+}
+
+const void*
+store_get(const char* key, size_t* len)
+{
+  const struct store_record* rec = store_find(key);
+
+  if (rec == NULL || rec->state != store_state_value) {
+    return NULL;
+  }
+
+  *len = rec->length;
+
+  return rec + 1;
+}
+
+int
+store_put(const char* key, const void* data, size_t len)
+{
+  return store_write(key, store_state_value, data, len);
+}
+
+int
+store_delete(const char* key)
+{
+  size_t len;
+  if (store_get(key, &len) == NULL) {
+    return 0;
+  }
+
+  return store_write(key, store_state_deleted, NULL, 0);
+}
+
+int
+store_put_chunked(const char* key, const void* head, size_t head_len,
+                  const void* data, size_t len)
+{
+  const size_t chunks = (len + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+  const struct store_chunked info = {.length = len, .chunks = chunks };
+  uint8_t record[sizeof(info) + STORE_CHUNKED_HEAD_LENGTH];
+
+  if (strlen(key) >= STORE_CHUNKED_KEY_LENGTH || chunks > STORE_CHUNKS_MAX ||
+      head_len > STORE_CHUNKED_HEAD_LENGTH || store_delete(key)) {
+    return 1;
+  }
+
+  /* without the record under key the old chunks are only in the way */
+  store_delete_chunks(key, 0, STORE_CHUNKS_MAX);
+
+  char chunk_key[STORE_KEY_LENGTH];
+  for (size_t i = 0; i < chunks; ++i) {
+    const size_t offset = i * STORE_CHUNK_SIZE;
+    const size_t chunk_len =
+      len - offset < STORE_CHUNK_SIZE ? len - offset : STORE_CHUNK_SIZE;
+
+    store_chunk_key(chunk_key, key, i);
+    if (store_put(chunk_key, (const uint8_t*)data + offset, chunk_len)) {
+      /* the chunks already written would only take up space */
+      store_delete_chunks(key, 0, i);
+      return 1;
+    }
+  }
+
+  memcpy(record, &info, sizeof(info));
+  memcpy(record + sizeof(info), head, head_len);
+  if (store_put(key, record, sizeof(info) + head_len)) {
+    store_delete_chunks(key, 0, chunks);
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+store_get_chunked(const char* key, void* head, size_t head_len, void* buf,
+                  size_t size, size_t* len)
+{
+  size_t record_len;
+  const uint8_t* record = store_get(key, &record_len);
+  if (record == NULL || record_len != sizeof(struct store_chunked) + head_len) {
+    return 1;
+  }
+
+  struct store_chunked info;
+  memcpy(&info, record, sizeof(info));
+  if (info.length > size) {
+    return 1;
+  }
+
+  char chunk_key[STORE_KEY_LENGTH];
+  size_t offset = 0;
+  for (size_t i = 0; i < info.chunks; ++i) {
+    store_chunk_key(chunk_key, key, i);
+
+    size_t chunk_len;
+    const void* chunk = store_get(chunk_key, &chunk_len);
+    if (chunk == NULL || chunk_len > info.length - offset) {
+      return 1;
+    }
+
+    memcpy((uint8_t*)buf + offset, chunk, chunk_len);
+    offset += chunk_len;
+  }
+
+  if (offset != info.length) {
+    return 1;
+  }
+
+  memcpy(head, record + sizeof(info), head_len);
+  *len = info.length;
+
+  return 0;
+}
+
+size_t
+store_get_free()
+{
+  const size_t size = eeprom_get_size(store_sectors[active]);
+
+  return write_pos + sizeof(struct store_record) < size
+           ? size - write_pos - sizeof(struct store_record)
+           : 0;
+}
+
+static int
+store_write(const char* key, enum store_state state, const void* data,
+            size_t len)
+{
+  if (strlen(key) >= STORE_KEY_LENGTH ||
+      sizeof(struct store_sector) + store_record_size(len) >
+        eeprom_get_size(store_sectors[active])) {
+    return 1;
+  }
+
+  struct store_record rec = {.length = len, .state = state };
+  strncpy(rec.key, key, STORE_KEY_LENGTH);
+  rec.crc = store_record_crc(&rec, data);
+
+  return store_append(&rec, data);
+}
+
+static void
+store_chunk_key(char* chunk_key, const char* key, size_t index)
+{
+  snprintf(chunk_key, STORE_KEY_LENGTH, "%s#%02x", key, (unsigned)index);
+}
+
+/* removes the chunks from begin up to end which exist */
+static void
+store_delete_chunks(const char* key, size_t begin, size_t end)
+{
+  char chunk_key[STORE_KEY_LENGTH];
+
+  for (size_t i = begin; i < end; ++i) {
+    store_chunk_key(chunk_key, key, i);
+    if (store_delete(chunk_key)) {
+      return;
+    }
+  }
+}
+
+/* writes the record to the active sector and starts a new one if it is
+ * full. The records moved into a new sector may leave too little room, then
+ * the next one is started until every sector was compacted once */
+static int
+store_append(const struct store_record* rec, const void* data)
+{
+  const size_t size = store_record_size(rec->length);
+
+  for (size_t tries = 0;
+       write_pos + size > eeprom_get_size(store_sectors[active]); ++tries) {
+    if (tries == STORE_SECTORS || store_open_sector()) {
+      return 1;
+    }
+  }
+
+  const enum eeprom_id id = store_sectors[active];
+  if (eeprom_write(id, write_pos, rec, sizeof(struct store_record)) ||
+      eeprom_write(id, write_pos + sizeof(struct store_record), data,
+                   rec->length)) {
+    /* the partially written record is skipped later on */
+    write_pos = store_sector_end(active);
+    return 1;
+  }
+
+  write_pos += size;
+
+  return 0;
+}
+
+/* continues the log in an unused sector. If this leaves no unused sector
+ * the oldest one is compacted */
+static int
+store_open_sector()
+{
+  size_t spare = STORE_SECTORS;
+  size_t used = 0;
+  size_t oldest = active;
+
+  for (size_t i = 0; i < STORE_SECTORS; ++i) {
+    if (store_sector_used(i)) {
+      used++;
+      if (store_sector_header(i)->sequence <
+          store_sector_header(oldest)->sequence) {
+        oldest = i;
+      }
+    } else if (spare == STORE_SECTORS || store_sector_blank(i)) {
+      /* prefer blank sectors, other unused sectors may still hold data in
+       * the format used before the store */
+      spare = i;
+    }
+  }
+
+  if (spare == STORE_SECTORS) {
+    return 1;
+  }
+
+  if (!store_sector_blank(spare) && eeprom_erase(store_sectors[spare])) {
+    return 1;
+  }
+
+  const struct store_sector header = {
+    .magic = STORE_MAGIC,
+    .sequence = used ? store_sector_header(active)->sequence + 1 : 0,
+  };
+
+  /* the magic is written last, so a sector is only used with a complete
+   * header */
+  const enum eeprom_id id = store_sectors[spare];
+  if (eeprom_write(id, offsetof(struct store_sector, sequence),
+                   &header.sequence, sizeof(header.sequence)) ||
+      eeprom_write(id, offsetof(struct store_sector, magic), &header.magic,
+                   sizeof(header.magic))) {
+    return 1;
+  }
+
+  active = spare;
+  write_pos = sizeof(struct store_sector);
+
+  if (used + 1 == STORE_SECTORS) {
+    return store_compact(oldest);
+  }
+
+  return 0;
+}
+
+/* copies the records of the sector which are still in use into the active
+ * sector and erases it */
+static int
+store_compact(size_t sector)
+{
+  size_t pos = sizeof(struct store_sector);
+  const struct store_record* rec;
+
+  while ((rec = store_next_record(sector, &pos)) != NULL) {
+    if (store_record_valid(rec) && rec->state == store_state_value &&
+        store_find(rec->key) == rec) {
+      if (store_append(rec, rec + 1)) {
+        return 1;
+      }
+    }
+  }
+
+  return eeprom_erase(store_sectors[sector]);
+}
+
+/* newest valid record of the key in any sector */
+static const struct store_record*
+store_find(const char* key)
+{
+  const struct store_record* found = NULL;
+  uint32_t found_sequence = 0;
+
+  for (size_t i = 0; i < STORE_SECTORS; ++i) {
+    if (!store_sector_used(i)) {
+      continue;
+    }
+
+    const uint32_t sequence = store_sector_header(i)->sequence;
+    if (found != NULL && sequence < found_sequence) {
+      continue;
+    }
+
+    size_t pos = sizeof(struct store_sector);
+    const struct store_record* rec;
+    while ((rec = store_next_record(i, &pos)) != NULL) {
+      if (strncmp(rec->key, key, STORE_KEY_LENGTH) == 0 &&
+          store_record_valid(rec)) {
+        found = rec;
+        found_sequence = sequence;
+      }
+    }
+  }
+
+  return found;
+}
+
+/* returns the record at pos and advances pos behind it, NULL at the end
+ * of the log */
+static const struct store_record*
+store_next_record(size_t sector, size_t* pos)
+{
+  const enum eeprom_id id = store_sectors[sector];
+  const size_t size = eeprom_get_size(id);
+
+  if (*pos + sizeof(struct store_record) > size) {
+    return NULL;
+  }
+
+  const struct store_record* rec = eeprom_get(id, *pos);
+  if (rec->length == STORE_EMPTY_LENGTH ||
+      *pos + store_record_size(rec->length) > size) {
+    return NULL;
+  }
+
+  *pos += store_record_size(rec->length);
+
+  return rec;
+}
+
+/* offset behind the last record of the sector. If the log ends with a
+ * broken length the sector can't be appended to anymore */
+static size_t
+store_sector_end(size_t sector)
+{
+  size_t pos = sizeof(struct store_sector);
+  while (store_next_record(sector, &pos)) {
+  }
+
+  const size_t size = eeprom_get_size(store_sectors[sector]);
+  if (pos + sizeof(struct store_record) <= size &&
+      ((const struct store_record*)eeprom_get(store_sectors[sector], pos))
+          ->length != STORE_EMPTY_LENGTH) {
+    return size;
+  }
+
+  return pos;
+}
+
+static size_t
+store_record_size(size_t len)
+{
+  return sizeof(struct store_record) + ((len + 3) & ~(size_t)3);
+}
+
+static uint32_t
+store_record_crc(const struct store_record* rec, const void* data)
+{
+  /* the padding of the data is left erased */
+  uint32_t tail = STORE_EMPTY;
+  if (rec->length & 3) {
+    memcpy(&tail, (const char*)data + (rec->length & ~3), rec->length & 3);
+  }
+
+  crc((const uint32_t*)rec, offsetof(struct store_record, crc) / 4);
+  crc_continue(data, rec->length / 4);
+
+  return crc_continue(&tail, 1);
+}
+
+static int
+store_record_valid(const struct store_record* rec)
+{
+  return rec->crc == store_record_crc(rec, rec + 1);
+}
+
+static const struct store_sector*
+store_sector_header(size_t sector)
+{
+  return eeprom_get(store_sectors[sector], 0);
+}
+
+static int
+store_sector_used(size_t sector)
+{
+  return store_sector_header(sector)->magic == STORE_MAGIC;
+}
+
+static int
+store_sector_blank(size_t sector)
+{
+  const uint32_t* cur = eeprom_get(store_sectors[sector], 0);
+  const uint32_t* end = eeprom_get_end(store_sectors[sector]);
+
+  for (; cur < end; ++cur) {
+    if (*cur != STORE_EMPTY) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
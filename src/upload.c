@@ -0,0 +1,246 @@
+#include "upload.h"
+
+#include "commands.h"
+#include "extmem.h"
+#include "util.h"
+
+#include <lwip/memp.h>
+#include <lwip/udp.h>
+#include <string.h>
+
+#define UPLOAD_MAX_CHUNKS (EXTMEM_SIZE / UPLOAD_CHUNK_SIZE)
+#define UPLOAD_MAX_SECTORS (EXTMEM_SIZE / EXTMEM_FLASH_SECTOR)
+
+struct upload_session
+{
+  uint16_t id;
+  uint32_t address;
+  uint32_t length;
+  uint32_t chunks;
+  uint16_t status; /* first error of the session */
+  /* bit set for every chunk which was written */
+  uint8_t received[UPLOAD_MAX_CHUNKS / 8];
+  /* bit set for every flash sector which was erased, relative to the
+   * sector of address */
+  uint8_t erased[UPLOAD_MAX_SECTORS / 8];
+};
+
+static struct udp_pcb* upload_pcb;
+static struct upload_session session = {.chunks = 0 };
+
+/* data of a chunk which was split into several pbufs */
+static uint32_t chunk_buffer[UPLOAD_CHUNK_SIZE / sizeof(uint32_t)];
+
+static void upload_recv_callback(void*, struct udp_pcb*, struct pbuf*,
+                                 ip_addr_t*, u16_t);
+static void upload_start(const struct upload_header*, struct pbuf*,
+                         ip_addr_t*, u16_t);
+static void upload_data(const struct upload_header*, struct pbuf*);
+static void upload_status(const struct upload_header*, ip_addr_t*, u16_t);
+static void upload_answer(const struct upload_header*, const void*, size_t,
+                          ip_addr_t*, u16_t);
+static size_t upload_chunk_length(uint32_t index);
+static void upload_erase(uint32_t address, size_t len);
+
+int
+upload_init()
+{
+  upload_pcb = udp_new();
+  if (upload_pcb == NULL) {
+    return 1;
+  }
+
+  if (udp_bind(upload_pcb, IP_ADDR_ANY, UPLOAD_PORT) != ERR_OK) {
+    udp_remove(upload_pcb);
+    return 1;
+  }
+
+  udp_recv(upload_pcb, upload_recv_callback, NULL);
+
+  return 0;
+}
+
+static void
+upload_recv_callback(void* arg, struct udp_pcb* pcb, struct pbuf* p,
+                     ip_addr_t* addr, u16_t port)
+{
+  LWIP_UNUSED_ARG(arg);
+  LWIP_UNUSED_ARG(pcb);
+
+  struct upload_header header;
+  if (pbuf_copy_partial(p, &header, sizeof(header), 0) != sizeof(header)) {
+    pbuf_free(p);
+    return;
+  }
+
+  switch (header.type) {
+    case upload_type_start:
+      upload_start(&header, p, addr, port);
+      break;
+    case upload_type_data:
+      upload_data(&header, p);
+      break;
+    case upload_type_status:
+      upload_status(&header, addr, port);
+      break;
+  }
+
+  pbuf_free(p);
+}
+
+static void
+upload_start(const struct upload_header* header, struct pbuf* p,
+             ip_addr_t* addr, u16_t port)
+{
+  struct upload_start start;
+  struct upload_header answer = *header;
+
+  session.chunks = 0;
+
+  if (pbuf_copy_partial(p, &start, sizeof(start), sizeof(*header)) !=
+        sizeof(start) ||
+      start.address > EXTMEM_SIZE ||
+      start.length > EXTMEM_SIZE - start.address ||
+      (extmem_get_type() == extmem_type_flash &&
+       start.address % EXTMEM_FLASH_SECTOR != 0)) {
+    answer.status = upload_status_invalid;
+    upload_answer(&answer, NULL, 0, addr, port);
+    return;
+  }
+
+  session.id = header->session;
+  session.address = start.address;
+  session.length = start.length;
+  session.chunks =
+    (start.length + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+  session.status = upload_status_ok;
+  memset(session.received, 0, (session.chunks + 7) / 8);
+  memset(session.erased, 0, sizeof(session.erased));
+
+  answer.status = upload_status_ok;
+  answer.index = session.chunks;
+  upload_answer(&answer, NULL, 0, addr, port);
+}
+
+/* chunks are written as they arrive, duplicates are dropped. Flash sectors
+ * are erased when the first chunk inside them arrives, so chunks may come
+ * in any order */
+static void
+upload_data(const struct upload_header* header, struct pbuf* p)
+{
+  const uint32_t index = header->index;
+
+  /* a running sequence may stream from the memory, the chunk is sent
+   * again once it is missing in the status */
+  if (header->session != session.id || index >= session.chunks ||
+      session.received[index / 8] & (1 << (index % 8)) ||
+      commands_running()) {
+    return;
+  }
+
+  const size_t len = upload_chunk_length(index);
+  if (p->tot_len != sizeof(*header) + len) {
+    session.status = upload_status_invalid;
+    return;
+  }
+
+  const void* data;
+  if (p->len == p->tot_len) {
+    data = (const uint8_t*)p->payload + sizeof(*header);
+  } else {
+    pbuf_copy_partial(p, chunk_buffer, len, sizeof(*header));
+    data = chunk_buffer;
+  }
+
+  const uint32_t address = session.address + index * UPLOAD_CHUNK_SIZE;
+  upload_erase(address, len);
+
+  if (extmem_program(address, data, len)) {
+    session.status = upload_status_failed;
+    return;
+  }
+
+  session.received[index / 8] |= 1 << (index % 8);
+}
+
+static void
+upload_status(const struct upload_header* header, ip_addr_t* addr,
+              u16_t port)
+{
+  static uint8_t missing[UPLOAD_STATUS_CHUNKS / 8];
+  struct upload_header answer = *header;
+
+  if (header->session != session.id || session.chunks == 0) {
+    answer.status = upload_status_session;
+    upload_answer(&answer, NULL, 0, addr, port);
+    return;
+  }
+
+  uint32_t first = 0;
+  while (first < session.chunks &&
+         session.received[first / 8] & (1 << (first % 8))) {
+    first++;
+  }
+
+  const uint32_t count = min(session.chunks - first, UPLOAD_STATUS_CHUNKS);
+  memset(missing, 0, (count + 7) / 8);
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint32_t index = first + i;
+    if (!(session.received[index / 8] & (1 << (index % 8)))) {
+      missing[i / 8] |= 1 << (i % 8);
+    }
+  }
+
+  answer.status = session.status;
+  answer.index = first;
+  upload_answer(&answer, missing, (count + 7) / 8, addr, port);
+}
+
+static void
+upload_answer(const struct upload_header* header, const void* data,
+              size_t len, ip_addr_t* addr, u16_t port)
+{
+  struct pbuf* p =
+    pbuf_alloc(PBUF_TRANSPORT, sizeof(*header) + len, PBUF_RAM);
+  if (p == NULL) {
+    /* the host asks again */
+    return;
+  }
+
+  struct upload_header* answer = p->payload;
+  *answer = *header;
+  answer->type |= UPLOAD_RESPONSE;
+  if (len > 0) {
+    memcpy(answer + 1, data, len);
+  }
+
+  udp_sendto(upload_pcb, p, addr, port);
+  pbuf_free(p);
+}
+
+static size_t
+upload_chunk_length(uint32_t index)
+{
+  return min(session.length - index * UPLOAD_CHUNK_SIZE, UPLOAD_CHUNK_SIZE);
+}
+
+/* erases the sectors touched by a chunk which haven't been erased in this
+ * session yet */
+static void
+upload_erase(uint32_t address, size_t len)
+{
+  if (extmem_get_type() != extmem_type_flash) {
+    return;
+  }
+
+  const uint32_t first = (address - session.address) / EXTMEM_FLASH_SECTOR;
+  const uint32_t last =
+    (address + len - 1 - session.address) / EXTMEM_FLASH_SECTOR;
+
+  for (uint32_t i = first; i <= last; ++i) {
+    if (!(session.erased[i / 8] & (1 << (i % 8)))) {
+      extmem_erase(session.address + i * EXTMEM_FLASH_SECTOR);
+      session.erased[i / 8] |= 1 << (i % 8);
+    }
+  }
+}
@@ -0,0 +1,99 @@
+/*
+ * Host test of the ramp step and rate solver and the chain compiler, run
+ * it with "make test". The functions driving the hardware are removed by
+ * the linker.
+ */
+
+#include "ramp.h"
+
+#include <math.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+static void
+check(int condition, const char* what)
+{
+  if (!condition) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+static void
+check_solution(uint32_t span, double duration, uint32_t step, uint16_t rate)
+{
+  /* fill the solution with garbage to catch fields which are not written */
+  ramp_solution solution = {
+    .step = 0xDEADBEEF, .rate = 0xBEEF, .duration = -1,
+  };
+
+  char what[80];
+  snprintf(what, sizeof(what), "span %lu over %g s", (unsigned long)span,
+           duration);
+
+  check(ramp_solve(span, duration, &solution) == 0, what);
+  check(solution.step == step && solution.rate == rate, what);
+  check(fabs(solution.duration - ramp_duration(span, step, rate)) < 1e-12,
+        what);
+}
+
+/* duration of the compiled chain in seconds */
+static double
+chain_duration()
+{
+  double duration = 0;
+  uint32_t from = ramp_chain_get_start();
+
+  for (size_t i = 0; i < ramp_chain_length(); ++i) {
+    const ramp_segment* seg = ramp_chain_get(i);
+    const uint32_t span =
+      seg->target > from ? seg->target - from : from - seg->target;
+    duration += ramp_duration(span, seg->step, seg->rate);
+    from = seg->target;
+  }
+
+  return duration;
+}
+
+static void
+check_plateau()
+{
+  /* the value holds between 1 ms and 2 ms */
+  const float points[][2] = {
+    { 0, 0 }, { 1e-3, 1e6 }, { 2e-3, 1e6 }, { 3e-3, 2e6 },
+  };
+
+  check(ramp_chain_compile_points(points, 4, 1, 10) == 0, "plateau compiles");
+  check(fabs(chain_duration() - 3e-3) < 1e-6, "plateau keeps its time");
+  check(ramp_chain_get(ramp_chain_length() - 1)->target == 2000000,
+        "plateau chain ends at the last point");
+}
+
+int
+main()
+{
+  ramp_solution solution;
+
+  check(ramp_solve(0, 1e-3, &solution) == 1, "span 0");
+  check(ramp_solve(100, 0, &solution) == 1, "duration 0");
+
+  /* 1000 steps of 4 ns each */
+  check_solution(1000, 4e-6, 1, 1);
+  /* 1000 steps with a rate of 10 */
+  check_solution(1000, 40e-6, 1, 10);
+
+  /* ticks / 0xFFFF > span: longer than the slowest ramp, clamped to it */
+  check_solution(429, 1, 1, 0xFFFF);
+  check_solution(1, 10, 1, 0xFFFF);
+
+  check_plateau();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * Host simulation of the UDP upload, run it with "make test". lwIP, the
+ * sequencer and the external memory are replaced by stand-ins: datagrams
+ * are handed to the receive callback directly, answers are captured and
+ * the memory is an array which behaves like a NOR flash if selected.
+ */
+
+#include "upload.h"
+
+#include "extmem.h"
+
+#include <lwip/pbuf.h>
+#include <lwip/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int failures = 0;
+
+static void
+check(int condition, const char* what)
+{
+  if (!condition) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+/* lwIP stand-ins */
+
+const ip_addr_t ip_addr_any = { 0 };
+
+static struct udp_pcb pcb;
+static udp_recv_fn recv_callback;
+static ip_addr_t host;
+
+/* the last answer sent to the host */
+static uint8_t answer[2048];
+static size_t answer_len;
+
+struct udp_pcb*
+udp_new()
+{
+  return &pcb;
+}
+
+void
+udp_remove(struct udp_pcb* p)
+{
+}
+
+err_t
+udp_bind(struct udp_pcb* p, ip_addr_t* addr, u16_t port)
+{
+  return ERR_OK;
+}
+
+void
+udp_recv(struct udp_pcb* p, udp_recv_fn recv, void* arg)
+{
+  recv_callback = recv;
+}
+
+err_t
+udp_sendto(struct udp_pcb* p, struct pbuf* q, ip_addr_t* addr, u16_t port)
+{
+  answer_len = pbuf_copy_partial(q, answer, sizeof(answer), 0);
+  return ERR_OK;
+}
+
+struct pbuf*
+pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+  struct pbuf* p = malloc(sizeof(*p) + length);
+  memset(p, 0, sizeof(*p));
+  p->payload = p + 1;
+  p->len = p->tot_len = length;
+  return p;
+}
+
+u8_t
+pbuf_free(struct pbuf* p)
+{
+  u8_t count = 0;
+  while (p != NULL) {
+    struct pbuf* next = p->next;
+    free(p);
+    p = next;
+    count++;
+  }
+  return count;
+}
+
+u16_t
+pbuf_copy_partial(struct pbuf* p, void* dataptr, u16_t len, u16_t offset)
+{
+  u16_t copied = 0;
+  for (; p != NULL && copied < len; p = p->next) {
+    if (offset >= p->len) {
+      offset -= p->len;
+      continue;
+    }
+    u16_t n = p->len - offset;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+    memcpy((uint8_t*)dataptr + copied, (uint8_t*)p->payload + offset, n);
+    copied += n;
+    offset = 0;
+  }
+  return copied;
+}
+
+/* sequencer and memory stand-ins */
+
+static int running = 0;
+
+int
+commands_running()
+{
+  return running;
+}
+
+static uint8_t* memory;
+static extmem_type type = extmem_type_sram;
+static unsigned erases[EXTMEM_SIZE / EXTMEM_FLASH_SECTOR];
+
+extmem_type
+extmem_get_type()
+{
+  return type;
+}
+
+/* programming a flash can only clear bits */
+int
+extmem_program(uint32_t address, const void* data, size_t len)
+{
+  if (address > EXTMEM_SIZE || len > EXTMEM_SIZE - address) {
+    return 1;
+  }
+
+  const uint8_t* src = data;
+  for (size_t i = 0; i < len; ++i) {
+    if (type == extmem_type_flash) {
+      memory[address + i] &= src[i];
+    } else {
+      memory[address + i] = src[i];
+    }
+  }
+
+  return 0;
+}
+
+int
+extmem_erase(uint32_t address)
+{
+  if (address >= EXTMEM_SIZE) {
+    return 1;
+  }
+
+  if (type == extmem_type_flash) {
+    const uint32_t sector = address / EXTMEM_FLASH_SECTOR;
+    memset(memory + sector * EXTMEM_FLASH_SECTOR, 0xFF, EXTMEM_FLASH_SECTOR);
+    erases[sector]++;
+  }
+
+  return 0;
+}
+
+/* the host side */
+
+static uint8_t source[256 * 1024];
+
+static struct upload_header
+send(const struct upload_header* header, const void* data, size_t len,
+     size_t split)
+{
+  const size_t total = sizeof(*header) + len;
+  uint8_t buf[sizeof(*header) + 2048];
+  memcpy(buf, header, sizeof(*header));
+  memcpy(buf + sizeof(*header), data, len);
+
+  /* the datagram arrives in one pbuf or two if split is given */
+  struct pbuf* p = pbuf_alloc(PBUF_RAW, split ? split : total, PBUF_POOL);
+  memcpy(p->payload, buf, p->len);
+  if (split) {
+    p->next = pbuf_alloc(PBUF_RAW, total - split, PBUF_POOL);
+    memcpy(p->next->payload, buf + split, total - split);
+    p->tot_len = total;
+  }
+
+  answer_len = 0;
+  recv_callback(NULL, &pcb, p, &host, 1234);
+
+  struct upload_header reply = { 0 };
+  if (answer_len >= sizeof(reply)) {
+    memcpy(&reply, answer, sizeof(reply));
+  }
+  return reply;
+}
+
+static struct upload_header
+start(uint16_t session, uint32_t address, uint32_t length)
+{
+  const struct upload_header header = {
+    .type = upload_type_start, .session = session,
+  };
+  const struct upload_start range = {.address = address, .length = length };
+
+  return send(&header, &range, sizeof(range), 0);
+}
+
+static size_t
+chunk_length(uint32_t length, uint32_t index)
+{
+  const uint32_t rest = length - index * UPLOAD_CHUNK_SIZE;
+  return rest < UPLOAD_CHUNK_SIZE ? rest : UPLOAD_CHUNK_SIZE;
+}
+
+static void
+chunk(uint16_t session, uint32_t length, uint32_t index, size_t split)
+{
+  const struct upload_header header = {
+    .type = upload_type_data, .session = session, .index = index,
+  };
+
+  send(&header, source + index * UPLOAD_CHUNK_SIZE,
+       chunk_length(length, index), split);
+}
+
+/* returns the first missing chunk, the bitmap is left in answer */
+static struct upload_header
+status(uint16_t session)
+{
+  const struct upload_header header = {
+    .type = upload_type_status, .session = session,
+  };
+
+  return send(&header, NULL, 0, 0);
+}
+
+static int
+missing(uint32_t first, uint32_t index)
+{
+  const uint32_t bit = index - first;
+  return answer[sizeof(struct upload_header) + bit / 8] & (1 << (bit % 8));
+}
+
+static void
+reset_memory(extmem_type t)
+{
+  type = t;
+  memset(memory, 0xA5, EXTMEM_SIZE);
+  memset(erases, 0, sizeof(erases));
+}
+
+static void
+test_start()
+{
+  struct upload_header reply = start(1, 0, 10000);
+  check(reply.type == (upload_type_start | UPLOAD_RESPONSE), "start answer");
+  check(reply.status == upload_status_ok, "start ok");
+  check(reply.index == 10, "start counts the chunks");
+
+  reply = start(2, EXTMEM_SIZE - 100, 101);
+  check(reply.status == upload_status_invalid, "start beyond the memory");
+  check(status(2).status == upload_status_session,
+        "an invalid start leaves no session");
+
+  /* a restart forgets the chunks of the previous session */
+  start(3, 0, 4096);
+  chunk(3, 4096, 0, 0);
+  chunk(3, 4096, 1, 0);
+  check(status(3).index == 2, "chunks are counted");
+  start(4, 0, 4096);
+  check(status(4).index == 0, "a restart begins without chunks");
+  check(status(3).status == upload_status_session, "old session is gone");
+
+  chunk(3, 4096, 2, 0);
+  check(status(4).index == 0, "chunks of the old session are dropped");
+}
+
+static void
+test_out_of_order(extmem_type t)
+{
+  reset_memory(t);
+
+  const uint32_t address = 3 * EXTMEM_FLASH_SECTOR;
+  const uint32_t length = 10 * UPLOAD_CHUNK_SIZE;
+  start(5, address, length);
+
+  /* backwards, every chunk twice and one split into two pbufs */
+  for (uint32_t i = 10; i-- > 0;) {
+    chunk(5, length, i, i == 4 ? 100 : 0);
+    chunk(5, length, i, 0);
+  }
+
+  const struct upload_header reply = status(5);
+  check(reply.status == upload_status_ok, "reordered status ok");
+  check(reply.index == 10, "reordered upload complete");
+  check(memcmp(memory + address, source, length) == 0,
+        "reordered data arrives intact");
+  check(memory[address - 1] == 0xA5, "nothing written before the range");
+
+  if (t == extmem_type_flash) {
+    int once = 1;
+    for (uint32_t s = 3; s < 6; ++s) {
+      once = once && erases[s] == 1;
+    }
+    check(once, "every flash sector is erased once");
+    check(erases[2] == 0 && erases[6] == 0, "no sector outside is erased");
+  }
+}
+
+static void
+test_lost_chunks()
+{
+  reset_memory(extmem_type_sram);
+
+  /* the last chunk is short */
+  const uint32_t length = 20 * UPLOAD_CHUNK_SIZE + 17;
+  start(6, 0, length);
+
+  for (uint32_t i = 0; i < 21; ++i) {
+    if (i != 3 && i != 4 && i != 11 && i != 20) {
+      chunk(6, length, i, 0);
+    }
+  }
+
+  struct upload_header reply = status(6);
+  check(reply.index == 3, "first missing chunk");
+  check(answer_len == sizeof(reply) + (21 - 3 + 7) / 8, "bitmap length");
+  check(missing(3, 3) && missing(3, 4) && missing(3, 11) && missing(3, 20),
+        "lost chunks are in the bitmap");
+  check(!missing(3, 5) && !missing(3, 19), "received chunks are not");
+
+  /* a short last chunk of the wrong size is refused */
+  const struct upload_header header = {
+    .type = upload_type_data, .session = 6, .index = 20,
+  };
+  send(&header, source, UPLOAD_CHUNK_SIZE, 0);
+  check(status(6).status == upload_status_invalid, "wrong length refused");
+
+  chunk(6, length, 3, 0);
+  chunk(6, length, 4, 0);
+  chunk(6, length, 11, 0);
+  chunk(6, length, 20, 0);
+
+  reply = status(6);
+  check(reply.index == 21, "retransmitted upload complete");
+  check(memcmp(memory, source, length) == 0, "retransmitted data intact");
+  check(memory[length] == 0xA5, "short last chunk stays in the range");
+}
+
+static void
+test_running()
+{
+  reset_memory(extmem_type_sram);
+
+  start(7, 0, 2 * UPLOAD_CHUNK_SIZE);
+
+  running = 1;
+  chunk(7, 2 * UPLOAD_CHUNK_SIZE, 0, 0);
+  running = 0;
+
+  check(status(7).index == 0, "chunks are refused while a sequence runs");
+  check(memory[0] == 0xA5, "memory untouched while a sequence runs");
+
+  chunk(7, 2 * UPLOAD_CHUNK_SIZE, 0, 0);
+  check(status(7).index == 1, "chunks are accepted afterwards");
+}
+
+static void
+test_flash_alignment()
+{
+  reset_memory(extmem_type_flash);
+
+  check(start(8, 100, 1000).status == upload_status_invalid,
+        "unaligned flash upload refused");
+  check(start(8, EXTMEM_FLASH_SECTOR, 1000).status == upload_status_ok,
+        "aligned flash upload accepted");
+
+  reset_memory(extmem_type_sram);
+  check(start(8, 100, 1000).status == upload_status_ok,
+        "unaligned SRAM upload accepted");
+}
+
+/* sends everything with random losses and reordering, then only what the
+ * status reports as missing, and reports the rounds and the throughput of
+ * the firmware side */
+static void
+test_loss(double loss)
+{
+  reset_memory(extmem_type_flash);
+
+  const uint32_t length = sizeof(source) - 100;
+  const uint32_t chunks = start(9, 0, length).index;
+
+  static uint8_t want[sizeof(source) / UPLOAD_CHUNK_SIZE + 1];
+  memset(want, 1, chunks);
+
+  const clock_t begin = clock();
+  size_t sent = 0;
+  int rounds = 0;
+  for (; rounds < 50; ++rounds) {
+    for (uint32_t n = 0; n < chunks; ++n) {
+      /* a random permutation would be nicer, a stride mixes well enough */
+      const uint32_t i = (n * 7919) % chunks;
+      if (want[i]) {
+        sent++;
+        if ((double)rand() / RAND_MAX >= loss) {
+          chunk(9, length, i, 0);
+        }
+      }
+    }
+
+    const struct upload_header reply = status(9);
+    if (reply.index == chunks) {
+      break;
+    }
+
+    memset(want, 0, chunks);
+    for (uint32_t i = reply.index; i < chunks; ++i) {
+      want[i] = missing(reply.index, i) != 0;
+    }
+  }
+  const double seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+  char what[80];
+  snprintf(what, sizeof(what), "upload with %g%% loss", loss * 100);
+  check(rounds < 50, what);
+  check(memcmp(memory, source, length) == 0, what);
+
+  printf("%g%% loss: %d retransmission rounds, %zu of %lu chunks sent, "
+         "%.0f MB/s\n",
+         loss * 100, rounds, sent, (unsigned long)chunks,
+         seconds > 0 ? length / seconds / 1e6 : 0);
+}
+
+int
+main()
+{
+  memory = malloc(EXTMEM_SIZE);
+  srand(1);
+  for (size_t i = 0; i < sizeof(source); ++i) {
+    source[i] = rand();
+  }
+
+  check(upload_init() == 0, "init");
+
+  test_start();
+  test_out_of_order(extmem_type_sram);
+  test_out_of_order(extmem_type_flash);
+  test_lost_chunks();
+  test_running();
+  test_flash_alignment();
+  test_loss(0);
+  test_loss(0.1);
+  test_loss(0.5);
+
+  free(memory);
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("all checks passed\n");
+  return 0;
+}